@@ -0,0 +1,1500 @@
+#include "BVH.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <future>
+#include <numeric>
+#include <thread>
+#include <utility>
+
+namespace dae
+{
+	namespace
+	{
+		//SAH cost of one traversal step relative to one primitive intersection
+		constexpr float g_TraversalCost{ 1.f };
+		constexpr float g_IntersectionCost{ 1.f };
+
+		constexpr uint32_t g_MaxBinCount{ 32 };
+
+		//Ranges smaller than this are not worth splitting over threads
+		constexpr uint32_t g_MinParallelPrimitiveCount{ 65536 };
+		//Subtrees smaller than this are built by the thread that reaches them
+		constexpr uint32_t g_MinTaskPrimitiveCount{ 4096 };
+
+		uint32_t GetChunkCount(uint32_t count, uint32_t threadCount)
+		{
+			return count >= g_MinParallelPrimitiveCount ? std::max(threadCount, 1u) : 1u;
+		}
+
+		//Runs function(chunkIndex, first, last) over [0, count) in GetChunkCount chunks, chunk 0 on the calling thread
+		template<typename Function>
+		uint32_t ForEachChunk(uint32_t count, uint32_t threadCount, Function&& function)
+		{
+			const uint32_t chunkCount{ GetChunkCount(count, threadCount) };
+			const uint32_t chunkSize{ (count + chunkCount - 1) / chunkCount };
+
+			std::vector<std::future<void>> tasks{};
+			for (uint32_t chunk{ 1 }; chunk < chunkCount; ++chunk)
+			{
+				const uint32_t first{ std::min(count, chunk * chunkSize) };
+				const uint32_t last{ std::min(count, first + chunkSize) };
+				tasks.push_back(std::async(std::launch::async, [&function, chunk, first, last]() { function(chunk, first, last); }));
+			}
+
+			function(0u, 0u, std::min(count, chunkSize));
+			for (std::future<void>& task : tasks)
+			{
+				task.get();
+			}
+			return chunkCount;
+		}
+
+		//Union of growChunk(bounds, first, last) over [0, count), each chunk grows its own box
+		template<typename GrowChunk>
+		AABB ReduceBounds(uint32_t count, uint32_t threadCount, GrowChunk&& growChunk)
+		{
+			AABB bounds{};
+			if (GetChunkCount(count, threadCount) == 1)
+			{
+				growChunk(bounds, 0u, count);
+				return bounds;
+			}
+
+			std::vector<AABB> chunkBounds(GetChunkCount(count, threadCount));
+			ForEachChunk(count, threadCount, [&](uint32_t chunk, uint32_t first, uint32_t last) { growChunk(chunkBounds[chunk], first, last); });
+			for (const AABB& chunk : chunkBounds)
+			{
+				bounds.Grow(chunk);
+			}
+			return bounds;
+		}
+
+		//Spatial splits are only tried when the object split children overlap by more than this fraction of the root area
+		constexpr float g_SpatialSplitOverlapThreshold{ 1e-4f };
+		//Every straddling reference is clipped once per spatial bin it touches, so spatial splits use fewer bins than object splits
+		constexpr uint32_t g_SpatialBinCount{ 16 };
+
+		AABB Intersection(const AABB& a, const AABB& b)
+		{
+			return AABB{ Vector3::Max(a.min, b.min), Vector3::Min(a.max, b.max) };
+		}
+
+		//Conservative 8-bit bounds of every child slot on a grid spanning the node bounds
+		void QuantizeNode(BVH4QuantizedNode& node, const AABB(&childBounds)[4], const AABB& bounds)
+		{
+			node.origin = bounds.min;
+
+			uint8_t* const quantizedMin[3]{ node.minX, node.minY, node.minZ };
+			uint8_t* const quantizedMax[3]{ node.maxX, node.maxY, node.maxZ };
+
+			for (int axis{ 0 }; axis < 3; ++axis)
+			{
+				const float origin{ bounds.min[axis] };
+
+				//Smallest power of two cell for which 255 cells still cover the node
+				int exponent{};
+				std::frexp((bounds.max[axis] - origin) / 255.f, &exponent);
+				exponent = std::clamp(exponent, -126, 127);
+				while (exponent < 127 && origin + 255.f * std::ldexp(1.f, exponent) < bounds.max[axis])
+				{
+					++exponent;
+				}
+				node.scaleExponent[axis] = static_cast<int8_t>(exponent);
+
+				//Traversal dequantizes as origin + offset * cellSize, round outwards until that encloses the child
+				const float cellSize{ node.GetCellSize(axis) };
+				for (int slot{ 0 }; slot < 4; ++slot)
+				{
+					if (node.IsEmpty(slot))
+					{
+						quantizedMin[axis][slot] = 0;
+						quantizedMax[axis][slot] = 0;
+						continue;
+					}
+
+					int minOffset{ std::clamp(static_cast<int>(std::floor((childBounds[slot].min[axis] - origin) / cellSize)), 0, 255) };
+					while (minOffset > 0 && origin + minOffset * cellSize > childBounds[slot].min[axis])
+					{
+						--minOffset;
+					}
+
+					int maxOffset{ std::clamp(static_cast<int>(std::ceil((childBounds[slot].max[axis] - origin) / cellSize)), 0, 255) };
+					while (maxOffset < 255 && origin + maxOffset * cellSize < childBounds[slot].max[axis])
+					{
+						++maxOffset;
+					}
+
+					quantizedMin[axis][slot] = static_cast<uint8_t>(minOffset);
+					quantizedMax[axis][slot] = static_cast<uint8_t>(maxOffset);
+				}
+			}
+		}
+
+		uint32_t GetBinCount(BVHBuildQuality quality)
+		{
+			switch (quality)
+			{
+			case BVHBuildQuality::Fast:
+				return 8;
+			case BVHBuildQuality::Medium:
+			default:
+				return g_MaxBinCount;
+			}
+		}
+
+		uint32_t GetBuildThreadCount(const BVHSettings& settings)
+		{
+			return settings.buildThreadCount > 0 ? settings.buildThreadCount : std::max(std::thread::hardware_concurrency(), 1u);
+		}
+
+		//Every builder only leaves more than one primitive in a leaf up to this size, so the quantized leaf counts always fit
+		uint32_t GetMaxLeafSize(const BVHSettings& settings)
+		{
+			const uint32_t maxLeafSize{ std::max(settings.maxLeafSize, 1u) };
+			return settings.layout == BVHLayout::Wide4Quantized ? std::min(maxLeafSize, BVH4QuantizedNode::maxPrimitiveCount) : maxLeafSize;
+		}
+
+		//True once the surface area heuristic could run out of levels: splits that peel off a few primitives at a time
+		//(a geometric progression of sizes or distances) would otherwise grow the tree past BVH::maxDepth
+		//Halving reaches a single primitive in bit_width(count - 1) levels, so median splits from here on always fit
+		bool NeedsMedianSplit(uint32_t count, uint32_t depth)
+		{
+			return depth + static_cast<uint32_t>(std::bit_width(count - 1)) >= BVH::maxDepth;
+		}
+
+#pragma region LinearBVH
+		//Marks a child of a LinearNode as a single primitive (sorted position) instead of another LinearNode
+		constexpr uint32_t g_LinearLeafFlag{ 0x80000000u };
+		//Range below a forced median split, no longer follows the linear hierarchy
+		constexpr uint32_t g_NoLinearNode{ UINT32_MAX };
+
+		//Internal node of the Karras hierarchy over the sorted primitives, covers the sorted range [first, last]
+		struct LinearNode
+		{
+			uint32_t first{};
+			uint32_t last{};
+			uint32_t child[2]{};
+		};
+
+		//Spreads the low 10 bits of value so there are two zero bits between each of them
+		uint32_t ExpandBits(uint32_t value)
+		{
+			value = (value * 0x00010001u) & 0xFF0000FFu;
+			value = (value * 0x00000101u) & 0x0F00F00Fu;
+			value = (value * 0x00000011u) & 0xC30C30C3u;
+			value = (value * 0x00000005u) & 0x49249249u;
+			return value;
+		}
+
+		//Spreads the low 21 bits of value so there are two zero bits between each of them
+		uint64_t ExpandBits(uint64_t value)
+		{
+			value &= 0x1FFFFFu;
+			value = (value | value << 32) & 0x001F00000000FFFFull;
+			value = (value | value << 16) & 0x001F0000FF0000FFull;
+			value = (value | value << 8) & 0x100F00F00F00F00Full;
+			value = (value | value << 4) & 0x10C30C30C30C30C3ull;
+			value = (value | value << 2) & 0x1249249249249249ull;
+			return value;
+		}
+
+		//30-bit (10 per axis) or 63-bit (21 per axis) Morton code of a point in [0, 1]^3
+		template<typename MortonCode>
+		MortonCode GetMortonCode(float x, float y, float z)
+		{
+			constexpr uint32_t bitsPerAxis{ sizeof(MortonCode) == 4 ? 10 : 21 };
+			constexpr float gridSize{ static_cast<float>(1u << bitsPerAxis) };
+			constexpr MortonCode maxCell{ (MortonCode{ 1 } << bitsPerAxis) - 1 };
+
+			const MortonCode cellX{ std::min(static_cast<MortonCode>(std::max(x * gridSize, 0.f)), maxCell) };
+			const MortonCode cellY{ std::min(static_cast<MortonCode>(std::max(y * gridSize, 0.f)), maxCell) };
+			const MortonCode cellZ{ std::min(static_cast<MortonCode>(std::max(z * gridSize, 0.f)), maxCell) };
+			return (ExpandBits(cellX) << 2) | (ExpandBits(cellY) << 1) | ExpandBits(cellZ);
+		}
+
+		//LSD radix sort on 8-bit digits, every pass counts and scatters per chunk so it runs on all threads
+		template<typename Key>
+		void RadixSort(std::vector<Key>& keys, std::vector<uint32_t>& values, uint32_t threadCount)
+		{
+			constexpr uint32_t digitCount{ 256 };
+			const uint32_t count{ static_cast<uint32_t>(keys.size()) };
+			const uint32_t chunkCount{ GetChunkCount(count, threadCount) };
+
+			std::vector<Key> sortedKeys(count);
+			std::vector<uint32_t> sortedValues(count);
+			std::vector<uint32_t> offsets(static_cast<size_t>(chunkCount) * digitCount);
+
+			for (uint32_t shift{ 0 }; shift < sizeof(Key) * 8; shift += 8)
+			{
+				std::fill(offsets.begin(), offsets.end(), 0u);
+				ForEachChunk(count, threadCount, [&](uint32_t chunk, uint32_t first, uint32_t last)
+					{
+						uint32_t* pHistogram{ &offsets[chunk * digitCount] };
+						for (uint32_t i{ first }; i < last; ++i)
+						{
+							++pHistogram[(keys[i] >> shift) & 0xFF];
+						}
+					});
+
+				//Digits are ordered first, chunks second, which keeps every pass stable
+				uint32_t sum{ 0 };
+				bool isSingleDigit{ false };
+				for (uint32_t digit{ 0 }; digit < digitCount; ++digit)
+				{
+					uint32_t digitTotal{ 0 };
+					for (uint32_t chunk{ 0 }; chunk < chunkCount; ++chunk)
+					{
+						const uint32_t histogram{ offsets[chunk * digitCount + digit] };
+						offsets[chunk * digitCount + digit] = sum;
+						sum += histogram;
+						digitTotal += histogram;
+					}
+					isSingleDigit |= digitTotal == count;
+				}
+
+				//Every key has the same digit (the unused top bits of a 30-bit code), nothing moves
+				if (isSingleDigit)
+				{
+					continue;
+				}
+
+				ForEachChunk(count, threadCount, [&](uint32_t chunk, uint32_t first, uint32_t last)
+					{
+						uint32_t* pOffsets{ &offsets[chunk * digitCount] };
+						for (uint32_t i{ first }; i < last; ++i)
+						{
+							const uint32_t position{ pOffsets[(keys[i] >> shift) & 0xFF]++ };
+							sortedKeys[position] = keys[i];
+							sortedValues[position] = values[i];
+						}
+					});
+
+				keys.swap(sortedKeys);
+				values.swap(sortedValues);
+			}
+		}
+
+		/**
+		 * Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees":
+		 * sorts primitiveIndices by the Morton code of their centroid, then finds the range and split of
+		 * every internal node independently. Node 0 is the root, equal codes are split by position.
+		 */
+		template<typename MortonCode>
+		std::vector<LinearNode> BuildLinearHierarchy(const std::vector<Vector3>& centroids, const AABB& centroidBounds,
+			std::vector<uint32_t>& primitiveIndices, uint32_t threadCount)
+		{
+			const uint32_t count{ static_cast<uint32_t>(centroids.size()) };
+
+			const Vector3 extent{ centroidBounds.max - centroidBounds.min };
+			const float scaleX{ extent.x > 0.f ? 1.f / extent.x : 0.f };
+			const float scaleY{ extent.y > 0.f ? 1.f / extent.y : 0.f };
+			const float scaleZ{ extent.z > 0.f ? 1.f / extent.z : 0.f };
+
+			std::vector<MortonCode> codes(count);
+			ForEachChunk(count, threadCount, [&](uint32_t, uint32_t first, uint32_t last)
+				{
+					for (uint32_t i{ first }; i < last; ++i)
+					{
+						codes[i] = GetMortonCode<MortonCode>(
+							(centroids[i].x - centroidBounds.min.x) * scaleX,
+							(centroids[i].y - centroidBounds.min.y) * scaleY,
+							(centroids[i].z - centroidBounds.min.z) * scaleZ);
+					}
+				});
+
+			RadixSort(codes, primitiveIndices, threadCount);
+
+			//Length of the common prefix of the codes at sorted positions i and j, -1 outside the range
+			const auto commonPrefix{ [&](uint32_t i, int64_t j)
+				{
+					if (j < 0 || j >= count)
+					{
+						return -1;
+					}
+
+					const MortonCode difference{ codes[i] ^ codes[j] };
+					if (difference == 0)
+					{
+						return static_cast<int>(sizeof(MortonCode) * 8) + std::countl_zero(i ^ static_cast<uint32_t>(j));
+					}
+					return std::countl_zero(difference);
+				} };
+
+			std::vector<LinearNode> nodes(count - 1);
+			ForEachChunk(count - 1, threadCount, [&](uint32_t, uint32_t firstNode, uint32_t lastNode)
+				{
+					for (uint32_t i{ firstNode }; i < lastNode; ++i)
+					{
+						//The range grows towards the neighbour with the longer common prefix
+						const int direction{ commonPrefix(i, int64_t{ i } + 1) > commonPrefix(i, int64_t{ i } - 1) ? 1 : -1 };
+						const int minPrefix{ commonPrefix(i, int64_t{ i } - direction) };
+
+						int64_t maxLength{ 2 };
+						while (commonPrefix(i, i + maxLength * direction) > minPrefix)
+						{
+							maxLength *= 2;
+						}
+
+						int64_t length{ 0 };
+						for (int64_t step{ maxLength / 2 }; step >= 1; step /= 2)
+						{
+							if (commonPrefix(i, i + (length + step) * direction) > minPrefix)
+							{
+								length += step;
+							}
+						}
+						const int64_t j{ i + length * direction };
+
+						//Binary search for the last position sharing more than the node prefix
+						const int nodePrefix{ commonPrefix(i, j) };
+						int64_t split{ 0 };
+						int64_t step{ length };
+						do
+						{
+							step = (step + 1) / 2;
+							if (commonPrefix(i, i + (split + step) * direction) > nodePrefix)
+							{
+								split += step;
+							}
+						} while (step > 1);
+						const uint32_t gamma{ static_cast<uint32_t>(i + split * direction + std::min(direction, 0)) };
+
+						LinearNode& node{ nodes[i] };
+						node.first = static_cast<uint32_t>(std::min<int64_t>(i, j));
+						node.last = static_cast<uint32_t>(std::max<int64_t>(i, j));
+						node.child[0] = node.first == gamma ? gamma | g_LinearLeafFlag : gamma;
+						node.child[1] = node.last == gamma + 1 ? (gamma + 1) | g_LinearLeafFlag : gamma + 1;
+					}
+				});
+
+			return nodes;
+		}
+#pragma endregion
+	}
+
+	void BVH::Build(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings, const PrimitiveClipper& clipPrimitive)
+	{
+		const auto start{ std::chrono::steady_clock::now() };
+		const uint32_t primitiveCount{ static_cast<uint32_t>(primitiveBounds.size()) };
+
+		m_Layout = settings.layout;
+		m_PrimitiveCount = primitiveCount;
+		m_Bounds = AABB{};
+		m_Nodes.clear();
+		m_WideNodes.clear();
+		m_QuantizedNodes.clear();
+		m_PrimitiveIndices.resize(primitiveCount);
+		std::iota(m_PrimitiveIndices.begin(), m_PrimitiveIndices.end(), 0u);
+
+		if (primitiveCount == 0)
+		{
+			m_BuildTime = 0.f;
+			return;
+		}
+
+		if (settings.spatialSplits && clipPrimitive)
+		{
+			SubdivideSpatial(primitiveBounds, settings, clipPrimitive);
+		}
+		else
+		{
+			const uint32_t threadCount{ GetBuildThreadCount(settings) };
+
+			std::vector<Vector3> centroids(primitiveCount);
+			ForEachChunk(primitiveCount, threadCount, [&](uint32_t, uint32_t first, uint32_t last)
+				{
+					for (uint32_t i{ first }; i < last; ++i)
+					{
+						centroids[i] = primitiveBounds[i].GetCenter();
+					}
+				});
+
+			//A binary tree with N leaves never has more than 2N - 1 nodes, allocated up front so threads can claim nodes without locking
+			m_Nodes.resize(2 * static_cast<size_t>(primitiveCount) - 1);
+			m_Nodes[0].leftFirst = 0;
+			m_Nodes[0].primitiveCount = primitiveCount;
+			UpdateNodeBounds(0, primitiveBounds, threadCount);
+
+			//Enough subtree tasks to keep every thread busy when the tree is unbalanced
+			uint32_t maxTaskDepth{ 0 };
+			while (threadCount > 1 && (1u << maxTaskDepth) < threadCount * 4)
+			{
+				++maxTaskDepth;
+			}
+
+			BuildContext context{ primitiveBounds, centroids, settings, threadCount, maxTaskDepth };
+			Subdivide(context, 0, 0);
+			m_Nodes.resize(context.nodeCount);
+		}
+
+		FinishBuild(primitiveBounds);
+		m_BuildTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void BVH::BuildLinear(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings)
+	{
+		const auto start{ std::chrono::steady_clock::now() };
+		const uint32_t primitiveCount{ static_cast<uint32_t>(primitiveBounds.size()) };
+
+		m_Layout = settings.layout;
+		m_PrimitiveCount = primitiveCount;
+		m_Bounds = AABB{};
+		m_Nodes.clear();
+		m_WideNodes.clear();
+		m_QuantizedNodes.clear();
+		m_PrimitiveIndices.resize(primitiveCount);
+		std::iota(m_PrimitiveIndices.begin(), m_PrimitiveIndices.end(), 0u);
+
+		if (primitiveCount == 0)
+		{
+			m_BuildTime = 0.f;
+			return;
+		}
+
+		const uint32_t threadCount{ GetBuildThreadCount(settings) };
+		const uint32_t maxLeafSize{ GetMaxLeafSize(settings) };
+
+		std::vector<Vector3> centroids(primitiveCount);
+		const AABB centroidBounds{ ReduceBounds(primitiveCount, threadCount, [&](AABB& bounds, uint32_t first, uint32_t last)
+			{
+				for (uint32_t i{ first }; i < last; ++i)
+				{
+					centroids[i] = primitiveBounds[i].GetCenter();
+					bounds.Grow(centroids[i]);
+				}
+			}) };
+
+		const std::vector<LinearNode> linearNodes{ settings.mortonCodeBits > 32 ?
+			BuildLinearHierarchy<uint64_t>(centroids, centroidBounds, m_PrimitiveIndices, threadCount) :
+			BuildLinearHierarchy<uint32_t>(centroids, centroidBounds, m_PrimitiveIndices, threadCount) };
+
+		//Emit the hierarchy depth first in the BVHNode layout, small ranges become one leaf
+		m_Nodes.reserve(2 * static_cast<size_t>(primitiveCount) - 1);
+		m_Nodes.emplace_back();
+
+		//Node to emit with the sorted range [first, last] it covers and the linear node it follows
+		struct EmitItem
+		{
+			uint32_t nodeIndex{};
+			uint32_t linearIndex{};
+			uint32_t first{};
+			uint32_t last{};
+			uint32_t depth{};
+		};
+
+		//The root of a single primitive tree is a leaf
+		std::vector<EmitItem> stack{ { 0u, primitiveCount > 1 ? 0u : g_LinearLeafFlag, 0u, primitiveCount - 1, 0u } };
+		while (!stack.empty())
+		{
+			const EmitItem item{ stack.back() };
+			stack.pop_back();
+
+			const uint32_t count{ item.last - item.first + 1 };
+			if (count <= maxLeafSize || count == 1)
+			{
+				m_Nodes[item.nodeIndex].leftFirst = item.first;
+				m_Nodes[item.nodeIndex].primitiveCount = count;
+				continue;
+			}
+
+			const uint32_t leftChildIndex{ static_cast<uint32_t>(m_Nodes.size()) };
+			m_Nodes.emplace_back();
+			m_Nodes.emplace_back();
+			m_Nodes[item.nodeIndex].leftFirst = leftChildIndex;
+			m_Nodes[item.nodeIndex].primitiveCount = 0;
+
+			//Equal or nearly equal codes make long chains, once they would run out of levels the sorted range is halved instead
+			if (item.linearIndex == g_NoLinearNode || NeedsMedianSplit(count, item.depth))
+			{
+				const uint32_t middle{ item.first + count / 2 };
+				stack.push_back({ leftChildIndex + 1, g_NoLinearNode, middle, item.last, item.depth + 1 });
+				stack.push_back({ leftChildIndex, g_NoLinearNode, item.first, middle - 1, item.depth + 1 });
+				continue;
+			}
+
+			for (int i{ 1 }; i >= 0; --i)
+			{
+				const uint32_t child{ linearNodes[item.linearIndex].child[i] };
+				const bool isLinearLeaf{ (child & g_LinearLeafFlag) != 0 };
+				const uint32_t first{ isLinearLeaf ? child & ~g_LinearLeafFlag : linearNodes[child].first };
+				const uint32_t last{ isLinearLeaf ? first : linearNodes[child].last };
+				stack.push_back({ leftChildIndex + i, child, first, last, item.depth + 1 });
+			}
+		}
+
+		RefitBinaryNodes(primitiveBounds);
+		FinishBuild(primitiveBounds);
+		m_BuildTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void BVH::FinishBuild(const std::vector<AABB>& primitiveBounds)
+	{
+		m_Nodes.shrink_to_fit();
+		m_Bounds = AABB{ m_Nodes[0].minAABB, m_Nodes[0].maxAABB };
+
+		if (m_Layout == BVHLayout::Binary)
+		{
+			return;
+		}
+
+		BuildWideNodes();
+		if (m_Layout == BVHLayout::Wide4Quantized)
+		{
+			BuildQuantizedNodes(primitiveBounds);
+			m_WideNodes.clear();
+			m_WideNodes.shrink_to_fit();
+		}
+
+		//The binary tree was only needed to collapse from
+		m_Nodes.clear();
+		m_Nodes.shrink_to_fit();
+	}
+
+	void BVH::Refit(const std::vector<AABB>& primitiveBounds)
+	{
+		if (m_Layout == BVHLayout::Wide4)
+		{
+			RefitWideNodes(primitiveBounds);
+			return;
+		}
+		if (m_Layout == BVHLayout::Wide4Quantized)
+		{
+			RefitQuantizedNodes(primitiveBounds);
+			return;
+		}
+
+		RefitBinaryNodes(primitiveBounds);
+	}
+
+	void BVH::RefitBinaryNodes(const std::vector<AABB>& primitiveBounds)
+	{
+		//Children are always stored after their parent, so walking backwards visits them first
+		for (size_t i{ m_Nodes.size() }; i-- > 0;)
+		{
+			BVHNode& node{ m_Nodes[i] };
+			if (node.IsLeaf())
+			{
+				UpdateNodeBounds(static_cast<uint32_t>(i), primitiveBounds);
+				continue;
+			}
+
+			const BVHNode& left{ m_Nodes[node.leftFirst] };
+			const BVHNode& right{ m_Nodes[node.leftFirst + 1] };
+			node.minAABB = Vector3::Min(left.minAABB, right.minAABB);
+			node.maxAABB = Vector3::Max(left.maxAABB, right.maxAABB);
+		}
+
+		if (!m_Nodes.empty())
+		{
+			m_Bounds = AABB{ m_Nodes[0].minAABB, m_Nodes[0].maxAABB };
+		}
+	}
+
+	size_t BVH::GetMemoryUsage() const
+	{
+		return m_Nodes.size() * sizeof(BVHNode) +
+			m_WideNodes.size() * sizeof(BVH4Node) +
+			m_QuantizedNodes.size() * sizeof(BVH4QuantizedNode) +
+			m_PrimitiveIndices.size() * sizeof(uint32_t);
+	}
+
+	AABB BVH::GetLeafBounds(uint32_t first, uint32_t primitiveCount, const std::vector<AABB>& primitiveBounds, uint32_t threadCount) const
+	{
+		return ReduceBounds(primitiveCount, threadCount, [&](AABB& bounds, uint32_t chunkFirst, uint32_t chunkLast)
+			{
+				for (uint32_t i{ chunkFirst }; i < chunkLast; ++i)
+				{
+					bounds.Grow(primitiveBounds[m_PrimitiveIndices[first + i]]);
+				}
+			});
+	}
+
+	void BVH::UpdateNodeBounds(uint32_t nodeIndex, const std::vector<AABB>& primitiveBounds, uint32_t threadCount)
+	{
+		BVHNode& node{ m_Nodes[nodeIndex] };
+
+		const AABB bounds{ GetLeafBounds(node.leftFirst, node.primitiveCount, primitiveBounds, threadCount) };
+		node.minAABB = bounds.min;
+		node.maxAABB = bounds.max;
+	}
+
+	void BVH::Subdivide(BuildContext& context, uint32_t rootIndex, uint32_t rootDepth)
+	{
+		const std::vector<AABB>& primitiveBounds{ context.primitiveBounds };
+		const std::vector<Vector3>& centroids{ context.centroids };
+		const BVHSettings& settings{ context.settings };
+		const uint32_t maxLeafSize{ GetMaxLeafSize(settings) };
+
+		//Big right subtrees near the top go to other threads, each task waits for the ones it started
+		std::vector<std::future<void>> subtreeTasks{};
+
+		//Explicit stack instead of recursion, degenerate input can produce very deep trees
+		std::vector<std::pair<uint32_t, uint32_t>> stack{ { rootIndex, rootDepth } };
+		while (!stack.empty())
+		{
+			const auto [nodeIndex, depth] { stack.back() };
+			stack.pop_back();
+
+			const BVHNode node{ m_Nodes[nodeIndex] };
+			if (node.primitiveCount <= 1)
+			{
+				continue;
+			}
+
+			uint32_t leftCount{ 0 };
+			if (NeedsMedianSplit(node.primitiveCount, depth))
+			{
+				if (node.primitiveCount <= maxLeafSize)
+				{
+					continue;
+				}
+				leftCount = Partition(node, GetMedianSplit(node, centroids), centroids);
+			}
+			else
+			{
+				const SplitCandidate split{ settings.quality == BVHBuildQuality::High ?
+					FindSweepSplit(node, primitiveBounds, centroids) :
+					FindBinnedSplit(node, primitiveBounds, centroids, GetBinCount(settings.quality), context.threadCount) };
+
+				//Costs are scaled by the parent area to avoid dividing by a degenerate box
+				const AABB nodeBounds{ node.minAABB, node.maxAABB };
+				const float leafCost{ g_IntersectionCost * node.primitiveCount * nodeBounds.Area() };
+				const float splitCost{ g_TraversalCost * nodeBounds.Area() + g_IntersectionCost * split.cost };
+
+				if (split.axis >= 0)
+				{
+					if (splitCost >= leafCost && node.primitiveCount <= maxLeafSize)
+					{
+						continue;
+					}
+					leftCount = Partition(node, split, centroids);
+				}
+				else
+				{
+					//All centroids coincide, no split plane separates them
+					if (node.primitiveCount <= maxLeafSize)
+					{
+						continue;
+					}
+					leftCount = node.primitiveCount / 2;
+				}
+			}
+
+			if (leftCount == 0 || leftCount == node.primitiveCount)
+			{
+				leftCount = node.primitiveCount / 2;
+			}
+
+			const uint32_t leftChildIndex{ context.nodeCount.fetch_add(2) };
+
+			BVHNode& leftChild{ m_Nodes[leftChildIndex] };
+			leftChild.leftFirst = node.leftFirst;
+			leftChild.primitiveCount = leftCount;
+
+			BVHNode& rightChild{ m_Nodes[leftChildIndex + 1] };
+			rightChild.leftFirst = node.leftFirst + leftCount;
+			rightChild.primitiveCount = node.primitiveCount - leftCount;
+
+			m_Nodes[nodeIndex].leftFirst = leftChildIndex;
+			m_Nodes[nodeIndex].primitiveCount = 0;
+
+			UpdateNodeBounds(leftChildIndex, primitiveBounds, context.threadCount);
+			UpdateNodeBounds(leftChildIndex + 1, primitiveBounds, context.threadCount);
+
+			if (depth < context.maxTaskDepth && rightChild.primitiveCount >= g_MinTaskPrimitiveCount)
+			{
+				subtreeTasks.push_back(std::async(std::launch::async, [this, &context, leftChildIndex, depth]()
+					{
+						Subdivide(context, leftChildIndex + 1, depth + 1);
+					}));
+			}
+			else
+			{
+				stack.push_back({ leftChildIndex + 1, depth + 1 });
+			}
+			stack.push_back({ leftChildIndex, depth + 1 });
+		}
+
+		for (std::future<void>& task : subtreeTasks)
+		{
+			task.get();
+		}
+	}
+
+	BVH::SplitCandidate BVH::FindBinnedSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<Vector3>& centroids, uint32_t binCount, uint32_t threadCount) const
+	{
+		SplitCandidate best{};
+
+		const uint32_t chunkCount{ GetChunkCount(node.primitiveCount, threadCount) };
+
+		const AABB centroidBounds{ ReduceBounds(node.primitiveCount, threadCount, [&](AABB& bounds, uint32_t first, uint32_t last)
+			{
+				for (uint32_t i{ first }; i < last; ++i)
+				{
+					bounds.Grow(centroids[m_PrimitiveIndices[node.leftFirst + i]]);
+				}
+			}) };
+
+		//Extra chunks bin into their own copies, merged afterwards (bin bounds and counts do not depend on the order)
+		std::vector<AABB> chunkBinBounds((chunkCount - 1) * g_MaxBinCount);
+		std::vector<uint32_t> chunkBinPrimitiveCount((chunkCount - 1) * g_MaxBinCount);
+
+		for (int axis{ 0 }; axis < 3; ++axis)
+		{
+			const float centroidMin{ centroidBounds.min[axis] };
+			const float centroidMax{ centroidBounds.max[axis] };
+			if (centroidMin == centroidMax)
+			{
+				continue;
+			}
+
+			AABB binBounds[g_MaxBinCount]{};
+			uint32_t binPrimitiveCount[g_MaxBinCount]{};
+
+			const float binScale{ binCount / (centroidMax - centroidMin) };
+			ForEachChunk(node.primitiveCount, threadCount, [&](uint32_t chunk, uint32_t first, uint32_t last)
+				{
+					AABB* pBinBounds{ binBounds };
+					uint32_t* pBinPrimitiveCount{ binPrimitiveCount };
+					if (chunk > 0)
+					{
+						pBinBounds = &chunkBinBounds[(chunk - 1) * g_MaxBinCount];
+						pBinPrimitiveCount = &chunkBinPrimitiveCount[(chunk - 1) * g_MaxBinCount];
+						std::fill_n(pBinBounds, binCount, AABB{});
+						std::fill_n(pBinPrimitiveCount, binCount, 0u);
+					}
+
+					for (uint32_t i{ first }; i < last; ++i)
+					{
+						const uint32_t primitiveIndex{ m_PrimitiveIndices[node.leftFirst + i] };
+						const uint32_t binIndex{ std::min(binCount - 1, static_cast<uint32_t>((centroids[primitiveIndex][axis] - centroidMin) * binScale)) };
+						++pBinPrimitiveCount[binIndex];
+						pBinBounds[binIndex].Grow(primitiveBounds[primitiveIndex]);
+					}
+				});
+
+			for (uint32_t chunk{ 1 }; chunk < chunkCount; ++chunk)
+			{
+				for (uint32_t i{ 0 }; i < binCount; ++i)
+				{
+					binBounds[i].Grow(chunkBinBounds[(chunk - 1) * g_MaxBinCount + i]);
+					binPrimitiveCount[i] += chunkBinPrimitiveCount[(chunk - 1) * g_MaxBinCount + i];
+				}
+			}
+
+			//Sweep the bin boundaries from both sides
+			float leftArea[g_MaxBinCount - 1]{};
+			uint32_t leftCount[g_MaxBinCount - 1]{};
+			float rightArea[g_MaxBinCount - 1]{};
+			uint32_t rightCount[g_MaxBinCount - 1]{};
+
+			AABB leftBox{};
+			AABB rightBox{};
+			uint32_t leftSum{ 0 };
+			uint32_t rightSum{ 0 };
+			for (uint32_t i{ 0 }; i < binCount - 1; ++i)
+			{
+				leftSum += binPrimitiveCount[i];
+				leftCount[i] = leftSum;
+				leftBox.Grow(binBounds[i]);
+				leftArea[i] = leftBox.Area();
+
+				rightSum += binPrimitiveCount[binCount - 1 - i];
+				rightCount[binCount - 2 - i] = rightSum;
+				rightBox.Grow(binBounds[binCount - 1 - i]);
+				rightArea[binCount - 2 - i] = rightBox.Area();
+			}
+
+			for (uint32_t i{ 0 }; i < binCount - 1; ++i)
+			{
+				if (leftCount[i] == 0 || rightCount[i] == 0)
+				{
+					continue;
+				}
+
+				const float cost{ leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i] };
+				if (cost < best.cost)
+				{
+					best.axis = axis;
+					best.cost = cost;
+					best.centroidMin = centroidMin;
+					best.binScale = binScale;
+					best.binCount = binCount;
+					best.splitBin = i + 1;
+				}
+			}
+		}
+
+		return best;
+	}
+
+	BVH::SplitCandidate BVH::FindSweepSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<Vector3>& centroids) const
+	{
+		SplitCandidate best{};
+		best.isSweep = true;
+
+		std::vector<uint32_t> sorted(m_PrimitiveIndices.begin() + node.leftFirst, m_PrimitiveIndices.begin() + node.leftFirst + node.primitiveCount);
+		std::vector<float> rightArea(node.primitiveCount);
+
+		for (int axis{ 0 }; axis < 3; ++axis)
+		{
+			std::sort(sorted.begin(), sorted.end(), [&centroids, axis](uint32_t a, uint32_t b)
+				{
+					return centroids[a][axis] < centroids[b][axis];
+				});
+
+			if (centroids[sorted.front()][axis] == centroids[sorted.back()][axis])
+			{
+				continue;
+			}
+
+			AABB rightBox{};
+			for (uint32_t i{ node.primitiveCount - 1 }; i > 0; --i)
+			{
+				rightBox.Grow(primitiveBounds[sorted[i]]);
+				rightArea[i] = rightBox.Area();
+			}
+
+			AABB leftBox{};
+			for (uint32_t i{ 1 }; i < node.primitiveCount; ++i)
+			{
+				leftBox.Grow(primitiveBounds[sorted[i - 1]]);
+
+				const float cost{ i * leftBox.Area() + (node.primitiveCount - i) * rightArea[i] };
+				if (cost < best.cost)
+				{
+					best.axis = axis;
+					best.cost = cost;
+					best.leftCount = i;
+				}
+			}
+		}
+
+		return best;
+	}
+
+	BVH::SplitCandidate BVH::GetMedianSplit(const BVHNode& node, const std::vector<Vector3>& centroids) const
+	{
+		AABB centroidBounds{};
+		for (uint32_t i{ 0 }; i < node.primitiveCount; ++i)
+		{
+			centroidBounds.Grow(centroids[m_PrimitiveIndices[node.leftFirst + i]]);
+		}
+
+		const Vector3 extent{ centroidBounds.max - centroidBounds.min };
+		SplitCandidate split{};
+		split.axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+		split.leftCount = node.primitiveCount / 2;
+		split.isSweep = true;
+		return split;
+	}
+
+	uint32_t BVH::Partition(const BVHNode& node, const SplitCandidate& split, const std::vector<Vector3>& centroids)
+	{
+		const auto first{ m_PrimitiveIndices.begin() + node.leftFirst };
+		const auto last{ first + node.primitiveCount };
+		const int axis{ split.axis };
+
+		if (split.isSweep)
+		{
+			std::nth_element(first, first + split.leftCount, last, [&centroids, axis](uint32_t a, uint32_t b)
+				{
+					return centroids[a][axis] < centroids[b][axis];
+				});
+			return split.leftCount;
+		}
+
+		const uint32_t binCount{ split.binCount };
+		const auto middle{ std::partition(first, last, [&](uint32_t primitiveIndex)
+			{
+				const uint32_t binIndex{ std::min(binCount - 1, static_cast<uint32_t>((centroids[primitiveIndex][axis] - split.centroidMin) * split.binScale)) };
+				return binIndex < split.splitBin;
+			}) };
+
+		return static_cast<uint32_t>(middle - first);
+	}
+
+	void BVH::BuildWideNodes()
+	{
+		m_WideNodes.clear();
+		if (m_Nodes.empty())
+		{
+			return;
+		}
+
+		//Every wide node absorbs at least one binary interior node
+		m_WideNodes.reserve(m_Nodes.size() / 2 + 1);
+		m_WideNodes.emplace_back();
+
+		//Binary node to collapse, with the wide node it becomes
+		std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0u, 0u } };
+		while (!stack.empty())
+		{
+			const auto [binaryIndex, wideIndex] { stack.back() };
+			stack.pop_back();
+
+			uint32_t children[4]{ binaryIndex };
+			int childCount{ 1 };
+
+			if (!m_Nodes[binaryIndex].IsLeaf())
+			{
+				children[0] = m_Nodes[binaryIndex].leftFirst;
+				children[1] = m_Nodes[binaryIndex].leftFirst + 1;
+				childCount = 2;
+
+				//Keep opening the largest interior child, it is the one most rays would enter anyway
+				while (childCount < 4)
+				{
+					int largestChild{ -1 };
+					float largestArea{ -1.f };
+					for (int i{ 0 }; i < childCount; ++i)
+					{
+						const BVHNode& child{ m_Nodes[children[i]] };
+						const float area{ AABB{ child.minAABB, child.maxAABB }.Area() };
+						if (!child.IsLeaf() && area > largestArea)
+						{
+							largestChild = i;
+							largestArea = area;
+						}
+					}
+
+					if (largestChild < 0)
+					{
+						break;
+					}
+
+					const uint32_t openedFirst{ m_Nodes[children[largestChild]].leftFirst };
+					children[largestChild] = openedFirst;
+					children[childCount++] = openedFirst + 1;
+				}
+			}
+
+			BVH4Node wideNode{};
+			for (int i{ 0 }; i < childCount; ++i)
+			{
+				const BVHNode& child{ m_Nodes[children[i]] };
+				wideNode.minX[i] = child.minAABB.x;
+				wideNode.minY[i] = child.minAABB.y;
+				wideNode.minZ[i] = child.minAABB.z;
+				wideNode.maxX[i] = child.maxAABB.x;
+				wideNode.maxY[i] = child.maxAABB.y;
+				wideNode.maxZ[i] = child.maxAABB.z;
+
+				if (child.IsLeaf())
+				{
+					wideNode.child[i] = child.leftFirst;
+					wideNode.primitiveCount[i] = child.primitiveCount;
+					continue;
+				}
+
+				wideNode.child[i] = static_cast<uint32_t>(m_WideNodes.size());
+				stack.push_back({ children[i], wideNode.child[i] });
+				m_WideNodes.emplace_back();
+			}
+
+			m_WideNodes[wideIndex] = wideNode;
+		}
+
+		m_WideNodes.shrink_to_fit();
+	}
+
+	void BVH::BuildQuantizedNodes(const std::vector<AABB>& primitiveBounds)
+	{
+		m_QuantizedNodes.resize(m_WideNodes.size());
+		for (size_t i{}; i < m_WideNodes.size(); ++i)
+		{
+			for (int slot{ 0 }; slot < 4; ++slot)
+			{
+				assert(m_WideNodes[i].primitiveCount[slot] <= BVH4QuantizedNode::maxPrimitiveCount);
+				m_QuantizedNodes[i].child[slot] = m_WideNodes[i].child[slot];
+				m_QuantizedNodes[i].primitiveCount[slot] = static_cast<uint8_t>(m_WideNodes[i].primitiveCount[slot]);
+			}
+		}
+
+		//The grids depend on the final bounds, refitting fills them in
+		RefitQuantizedNodes(primitiveBounds);
+	}
+
+	void BVH::RefitWideNodes(const std::vector<AABB>& primitiveBounds)
+	{
+		//Children are always stored after their parent, so walking backwards visits them first
+		std::vector<AABB> nodeBounds(m_WideNodes.size());
+		for (size_t i{ m_WideNodes.size() }; i-- > 0;)
+		{
+			BVH4Node& node{ m_WideNodes[i] };
+			for (int slot{ 0 }; slot < 4; ++slot)
+			{
+				if (node.IsEmpty(slot))
+				{
+					continue;
+				}
+
+				const AABB childBounds{ node.IsLeaf(slot) ?
+					GetLeafBounds(node.child[slot], node.primitiveCount[slot], primitiveBounds) :
+					nodeBounds[node.child[slot]] };
+
+				node.minX[slot] = childBounds.min.x;
+				node.minY[slot] = childBounds.min.y;
+				node.minZ[slot] = childBounds.min.z;
+				node.maxX[slot] = childBounds.max.x;
+				node.maxY[slot] = childBounds.max.y;
+				node.maxZ[slot] = childBounds.max.z;
+				nodeBounds[i].Grow(childBounds);
+			}
+		}
+
+		if (!nodeBounds.empty())
+		{
+			m_Bounds = nodeBounds[0];
+		}
+	}
+
+	void BVH::RefitQuantizedNodes(const std::vector<AABB>& primitiveBounds)
+	{
+		//Same bottom-up walk as RefitWideNodes, every node gets a new grid from its refitted bounds
+		std::vector<AABB> nodeBounds(m_QuantizedNodes.size());
+		for (size_t i{ m_QuantizedNodes.size() }; i-- > 0;)
+		{
+			BVH4QuantizedNode& node{ m_QuantizedNodes[i] };
+
+			AABB childBounds[4]{};
+			for (int slot{ 0 }; slot < 4; ++slot)
+			{
+				if (node.IsEmpty(slot))
+				{
+					continue;
+				}
+
+				childBounds[slot] = node.IsLeaf(slot) ?
+					GetLeafBounds(node.child[slot], node.primitiveCount[slot], primitiveBounds) :
+					nodeBounds[node.child[slot]];
+				nodeBounds[i].Grow(childBounds[slot]);
+			}
+
+			QuantizeNode(node, childBounds, nodeBounds[i]);
+		}
+
+		if (!nodeBounds.empty())
+		{
+			m_Bounds = nodeBounds[0];
+		}
+	}
+
+	AABB ClipTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2, const AABB& box)
+	{
+		//Sutherland-Hodgman against the six box planes, a triangle gains at most one vertex per plane
+		//Plain float arrays, this runs for every straddling reference in every spatial bin
+		constexpr int maxVertexCount{ 9 };
+		float polygon[maxVertexCount][3]{ { v0.x, v0.y, v0.z }, { v1.x, v1.y, v1.z }, { v2.x, v2.y, v2.z } };
+		float clipped[maxVertexCount][3]{};
+		int vertexCount{ 3 };
+
+		const float boxMin[3]{ box.min.x, box.min.y, box.min.z };
+		const float boxMax[3]{ box.max.x, box.max.y, box.max.z };
+
+		for (int plane{ 0 }; plane < 6 && vertexCount > 0; ++plane)
+		{
+			const int axis{ plane % 3 };
+			const bool isMaxPlane{ plane >= 3 };
+			const float position{ isMaxPlane ? boxMax[axis] : boxMin[axis] };
+
+			//Most planes of a slab do not cut the polygon at all
+			bool isFullyInside{ true };
+			for (int i{ 0 }; i < vertexCount && isFullyInside; ++i)
+			{
+				isFullyInside = isMaxPlane ? polygon[i][axis] <= position : polygon[i][axis] >= position;
+			}
+			if (isFullyInside)
+			{
+				continue;
+			}
+
+			int clippedCount{ 0 };
+			for (int i{ 0 }; i < vertexCount; ++i)
+			{
+				const float* current{ polygon[i] };
+				const float* next{ polygon[(i + 1) % vertexCount] };
+				const bool currentInside{ isMaxPlane ? current[axis] <= position : current[axis] >= position };
+				const bool nextInside{ isMaxPlane ? next[axis] <= position : next[axis] >= position };
+
+				if (currentInside)
+				{
+					std::copy(current, current + 3, clipped[clippedCount++]);
+				}
+
+				if (currentInside != nextInside)
+				{
+					const float interpolation{ (position - current[axis]) / (next[axis] - current[axis]) };
+					float* crossing{ clipped[clippedCount++] };
+					for (int component{ 0 }; component < 3; ++component)
+					{
+						crossing[component] = current[component] + (next[component] - current[component]) * interpolation;
+					}
+					crossing[axis] = position;
+				}
+			}
+
+			std::copy(&clipped[0][0], &clipped[0][0] + clippedCount * 3, &polygon[0][0]);
+			vertexCount = clippedCount;
+		}
+
+		if (vertexCount == 0)
+		{
+			return AABB{};
+		}
+
+		//Interpolated crossings can land a rounding error outside the box
+		float boundsMin[3]{ FLT_MAX, FLT_MAX, FLT_MAX };
+		float boundsMax[3]{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (int i{ 0 }; i < vertexCount; ++i)
+		{
+			for (int component{ 0 }; component < 3; ++component)
+			{
+				boundsMin[component] = std::min(boundsMin[component], polygon[i][component]);
+				boundsMax[component] = std::max(boundsMax[component], polygon[i][component]);
+			}
+		}
+
+		return AABB{
+			Vector3{ std::max(boundsMin[0], boxMin[0]), std::max(boundsMin[1], boxMin[1]), std::max(boundsMin[2], boxMin[2]) },
+			Vector3{ std::min(boundsMax[0], boxMax[0]), std::min(boundsMax[1], boxMax[1]), std::min(boundsMax[2], boxMax[2]) } };
+	}
+
+	void BVH::SubdivideSpatial(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings, const PrimitiveClipper& clipPrimitive)
+	{
+		const uint32_t maxLeafSize{ GetMaxLeafSize(settings) };
+		const uint32_t binCount{ GetBinCount(settings.quality) };
+
+		const size_t maxReferenceCount{ m_PrimitiveCount + static_cast<size_t>(m_PrimitiveCount * std::max(settings.maxDuplication, 0.f)) };
+		size_t referenceCount{ m_PrimitiveCount };
+
+		//Leaves append their references, so the primitive order is rebuilt from scratch
+		m_PrimitiveIndices.clear();
+		m_PrimitiveIndices.reserve(maxReferenceCount);
+
+		struct WorkItem
+		{
+			uint32_t nodeIndex{};
+			std::vector<Reference> references{};
+			uint32_t depth{};
+		};
+
+		WorkItem rootItem{ 0, std::vector<Reference>(m_PrimitiveCount) };
+		AABB rootBounds{};
+		for (uint32_t i{ 0 }; i < m_PrimitiveCount; ++i)
+		{
+			rootItem.references[i] = { primitiveBounds[i], i };
+			rootBounds.Grow(primitiveBounds[i]);
+		}
+		const float rootArea{ rootBounds.Area() };
+
+		m_Nodes.push_back({ rootBounds.min, 0, rootBounds.max, 0 });
+
+		//Explicit stack like Subdivide, every item owns the references of one node
+		std::vector<WorkItem> stack{};
+		stack.push_back(std::move(rootItem));
+		while (!stack.empty())
+		{
+			WorkItem item{ std::move(stack.back()) };
+			stack.pop_back();
+
+			std::vector<Reference>& references{ item.references };
+			const uint32_t count{ static_cast<uint32_t>(references.size()) };
+			const AABB nodeBounds{ m_Nodes[item.nodeIndex].minAABB, m_Nodes[item.nodeIndex].maxAABB };
+
+			auto makeLeaf{ [&]()
+				{
+					m_Nodes[item.nodeIndex].leftFirst = static_cast<uint32_t>(m_PrimitiveIndices.size());
+					m_Nodes[item.nodeIndex].primitiveCount = count;
+					for (const Reference& reference : references)
+					{
+						m_PrimitiveIndices.push_back(reference.primitiveIndex);
+					}
+				} };
+
+			if (count <= 1)
+			{
+				makeLeaf();
+				continue;
+			}
+
+			//Out of levels for the SAH, both split searches are skipped and the fallback below halves at the median
+			const bool isMedianSplit{ NeedsMedianSplit(count, item.depth) };
+
+			//Object split: binned SAH over the reference centroids
+			int objectAxis{ -1 };
+			float objectCost{ FLT_MAX };
+			float objectCentroidMin{};
+			float objectBinScale{};
+			uint32_t objectSplitBin{};
+			AABB objectLeftBounds{};
+			AABB objectRightBounds{};
+
+			std::vector<Vector3> centroids(count);
+			AABB centroidBounds{};
+			for (uint32_t i{ 0 }; i < count; ++i)
+			{
+				centroids[i] = references[i].bounds.GetCenter();
+				centroidBounds.Grow(centroids[i]);
+			}
+
+			for (int axis{ 0 }; axis < 3 && !isMedianSplit; ++axis)
+			{
+				const float centroidMin{ centroidBounds.min[axis] };
+				const float centroidMax{ centroidBounds.max[axis] };
+				if (centroidMin == centroidMax)
+				{
+					continue;
+				}
+
+				AABB binBounds[g_MaxBinCount]{};
+				uint32_t binReferenceCount[g_MaxBinCount]{};
+
+				const float binScale{ binCount / (centroidMax - centroidMin) };
+				for (uint32_t i{ 0 }; i < count; ++i)
+				{
+					const uint32_t binIndex{ std::min(binCount - 1, static_cast<uint32_t>((centroids[i][axis] - centroidMin) * binScale)) };
+					++binReferenceCount[binIndex];
+					binBounds[binIndex].Grow(references[i].bounds);
+				}
+
+				AABB leftBoxes[g_MaxBinCount]{};
+				uint32_t leftCounts[g_MaxBinCount]{};
+				AABB leftBox{};
+				uint32_t leftSum{ 0 };
+				for (uint32_t i{ 0 }; i < binCount - 1; ++i)
+				{
+					leftSum += binReferenceCount[i];
+					leftBox.Grow(binBounds[i]);
+					leftCounts[i] = leftSum;
+					leftBoxes[i] = leftBox;
+				}
+
+				AABB rightBox{};
+				uint32_t rightSum{ 0 };
+				for (uint32_t i{ binCount - 1 }; i > 0; --i)
+				{
+					rightSum += binReferenceCount[i];
+					rightBox.Grow(binBounds[i]);
+					if (leftCounts[i - 1] == 0 || rightSum == 0)
+					{
+						continue;
+					}
+
+					const float cost{ leftCounts[i - 1] * leftBoxes[i - 1].Area() + rightSum * rightBox.Area() };
+					if (cost < objectCost)
+					{
+						objectAxis = axis;
+						objectCost = cost;
+						objectCentroidMin = centroidMin;
+						objectBinScale = binScale;
+						objectSplitBin = i;
+						objectLeftBounds = leftBoxes[i - 1];
+						objectRightBounds = rightBox;
+					}
+				}
+			}
+
+			//Spatial split: binned over the node bounds, references straddling a bin get clipped into it
+			int spatialAxis{ -1 };
+			float spatialCost{ FLT_MAX };
+			float spatialPosition{};
+
+			//Small nodes end up as leaves soon anyway, not worth the clipping
+			const bool childrenOverlap{ objectAxis < 0 || Intersection(objectLeftBounds, objectRightBounds).Area() > g_SpatialSplitOverlapThreshold * rootArea };
+			if (!isMedianSplit && childrenOverlap && count > maxLeafSize && referenceCount < maxReferenceCount)
+			{
+				for (int axis{ 0 }; axis < 3; ++axis)
+				{
+					const float origin{ nodeBounds.min[axis] };
+					const float binSize{ (nodeBounds.max[axis] - origin) / g_SpatialBinCount };
+					if (binSize <= 0.f)
+					{
+						continue;
+					}
+
+					AABB binBounds[g_SpatialBinCount]{};
+					uint32_t entries[g_SpatialBinCount]{};
+					uint32_t exits[g_SpatialBinCount]{};
+
+					for (const Reference& reference : references)
+					{
+						const uint32_t firstBin{ std::min(g_SpatialBinCount - 1, static_cast<uint32_t>(std::max((reference.bounds.min[axis] - origin) / binSize, 0.f))) };
+						const uint32_t lastBin{ std::clamp(static_cast<uint32_t>(std::max((reference.bounds.max[axis] - origin) / binSize, 0.f)), firstBin, g_SpatialBinCount - 1) };
+						++entries[firstBin];
+						++exits[lastBin];
+
+						if (firstBin == lastBin)
+						{
+							binBounds[firstBin].Grow(reference.bounds);
+							continue;
+						}
+
+						for (uint32_t bin{ firstBin }; bin <= lastBin; ++bin)
+						{
+							AABB slab{ reference.bounds };
+							slab.min[axis] = std::max(slab.min[axis], origin + bin * binSize);
+							slab.max[axis] = std::min(slab.max[axis], origin + (bin + 1) * binSize);
+
+							const AABB clippedBounds{ clipPrimitive(reference.primitiveIndex, slab) };
+							if (clippedBounds.IsValid())
+							{
+								binBounds[bin].Grow(clippedBounds);
+							}
+						}
+					}
+
+					AABB leftBoxes[g_SpatialBinCount]{};
+					uint32_t leftCounts[g_SpatialBinCount]{};
+					AABB leftBox{};
+					uint32_t leftSum{ 0 };
+					for (uint32_t i{ 0 }; i < g_SpatialBinCount - 1; ++i)
+					{
+						leftSum += entries[i];
+						leftBox.Grow(binBounds[i]);
+						leftCounts[i] = leftSum;
+						leftBoxes[i] = leftBox;
+					}
+
+					AABB rightBox{};
+					uint32_t rightSum{ 0 };
+					for (uint32_t i{ g_SpatialBinCount - 1 }; i > 0; --i)
+					{
+						rightSum += exits[i];
+						rightBox.Grow(binBounds[i]);
+
+						//A plane every reference straddles only duplicates
+						if (leftCounts[i - 1] == 0 || rightSum == 0 || (leftCounts[i - 1] == count && rightSum == count))
+						{
+							continue;
+						}
+
+						const float cost{ leftCounts[i - 1] * leftBoxes[i - 1].Area() + rightSum * rightBox.Area() };
+						if (cost < spatialCost)
+						{
+							spatialAxis = axis;
+							spatialCost = cost;
+							spatialPosition = origin + i * binSize;
+						}
+					}
+				}
+			}
+
+			//Same leaf versus split decision as Subdivide
+			const float leafCost{ g_IntersectionCost * count * nodeBounds.Area() };
+			const float bestCost{ std::min(objectCost, spatialCost) };
+			const float splitCost{ g_TraversalCost * nodeBounds.Area() + g_IntersectionCost * bestCost };
+			if ((objectAxis < 0 && spatialAxis < 0) || splitCost >= leafCost)
+			{
+				if (count <= maxLeafSize)
+				{
+					makeLeaf();
+					continue;
+				}
+			}
+
+			std::vector<Reference> leftReferences{};
+			std::vector<Reference> rightReferences{};
+
+			if (spatialAxis >= 0 && spatialCost < objectCost)
+			{
+				for (const Reference& reference : references)
+				{
+					if (reference.bounds.max[spatialAxis] <= spatialPosition)
+					{
+						leftReferences.push_back(reference);
+						continue;
+					}
+					if (reference.bounds.min[spatialAxis] >= spatialPosition)
+					{
+						rightReferences.push_back(reference);
+						continue;
+					}
+
+					AABB leftSlab{ reference.bounds };
+					leftSlab.max[spatialAxis] = spatialPosition;
+					AABB rightSlab{ reference.bounds };
+					rightSlab.min[spatialAxis] = spatialPosition;
+
+					const AABB leftBounds{ clipPrimitive(reference.primitiveIndex, leftSlab) };
+					const AABB rightBounds{ clipPrimitive(reference.primitiveIndex, rightSlab) };
+					if (leftBounds.IsValid())
+					{
+						leftReferences.push_back({ leftBounds, reference.primitiveIndex });
+					}
+					if (rightBounds.IsValid())
+					{
+						rightReferences.push_back({ rightBounds, reference.primitiveIndex });
+					}
+					if (!leftBounds.IsValid() && !rightBounds.IsValid())
+					{
+						//Clipping lost a sliver to rounding, keep the reference whole
+						leftReferences.push_back(reference);
+					}
+				}
+
+				//Every straddler adds a reference, a split that would pass maxReferenceCount falls back to the object split
+				if (referenceCount + leftReferences.size() + rightReferences.size() - count > maxReferenceCount)
+				{
+					leftReferences.clear();
+					rightReferences.clear();
+
+					const float objectSplitCost{ g_TraversalCost * nodeBounds.Area() + g_IntersectionCost * objectCost };
+					if ((objectAxis < 0 || objectSplitCost >= leafCost) && count <= maxLeafSize)
+					{
+						makeLeaf();
+						continue;
+					}
+				}
+			}
+
+			if (leftReferences.empty() && rightReferences.empty() && objectAxis >= 0)
+			{
+				for (uint32_t i{ 0 }; i < count; ++i)
+				{
+					const uint32_t binIndex{ std::min(binCount - 1, static_cast<uint32_t>((centroids[i][objectAxis] - objectCentroidMin) * objectBinScale)) };
+					(binIndex < objectSplitBin ? leftReferences : rightReferences).push_back(references[i]);
+				}
+			}
+
+			//Median split, all centroids coincide or the split degenerated: halve at the centroid median like Subdivide
+			if (leftReferences.empty() || rightReferences.empty())
+			{
+				const Vector3 extent{ centroidBounds.max - centroidBounds.min };
+				const int axis{ extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2) };
+				std::nth_element(references.begin(), references.begin() + count / 2, references.end(), [axis](const Reference& a, const Reference& b)
+					{
+						return a.bounds.GetCenter()[axis] < b.bounds.GetCenter()[axis];
+					});
+
+				leftReferences.assign(references.begin(), references.begin() + count / 2);
+				rightReferences.assign(references.begin() + count / 2, references.end());
+			}
+
+			referenceCount += leftReferences.size() + rightReferences.size() - count;
+
+			const uint32_t leftChildIndex{ static_cast<uint32_t>(m_Nodes.size()) };
+			for (const std::vector<Reference>* pChildReferences : { &leftReferences, &rightReferences })
+			{
+				AABB childBounds{};
+				for (const Reference& reference : *pChildReferences)
+				{
+					childBounds.Grow(reference.bounds);
+				}
+				m_Nodes.push_back({ childBounds.min, 0, childBounds.max, 0 });
+			}
+
+			m_Nodes[item.nodeIndex].leftFirst = leftChildIndex;
+			m_Nodes[item.nodeIndex].primitiveCount = 0;
+
+			references.clear();
+			references.shrink_to_fit();
+			stack.push_back({ leftChildIndex + 1, std::move(rightReferences), item.depth + 1 });
+			stack.push_back({ leftChildIndex, std::move(leftReferences), item.depth + 1 });
+		}
+	}
+}
@@ -0,0 +1,271 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cfloat>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "Math.h"
+
+namespace dae
+{
+#pragma region AABB
+	struct AABB
+	{
+		Vector3 min{ FLT_MAX, FLT_MAX, FLT_MAX };
+		Vector3 max{ -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+		void Grow(const Vector3& point)
+		{
+			min = Vector3::Min(min, point);
+			max = Vector3::Max(max, point);
+		}
+
+		void Grow(const AABB& other)
+		{
+			min = Vector3::Min(min, other.min);
+			max = Vector3::Max(max, other.max);
+		}
+
+		Vector3 GetCenter() const
+		{
+			return (min + max) * 0.5f;
+		}
+
+		//Bounds of the box after transforming all eight corners
+		AABB Transformed(const Matrix& transform) const
+		{
+			AABB result{};
+			for (int corner{ 0 }; corner < 8; ++corner)
+			{
+				result.Grow(transform.TransformPoint(
+					(corner & 1) ? max.x : min.x,
+					(corner & 2) ? max.y : min.y,
+					(corner & 4) ? max.z : min.z));
+			}
+			return result;
+		}
+
+		float Area() const
+		{
+			const Vector3 extent{ max - min };
+			if (extent.x < 0.f || extent.y < 0.f || extent.z < 0.f)
+			{
+				return 0.f;
+			}
+			return 2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+		}
+
+		bool IsValid() const
+		{
+			return min.x <= max.x && min.y <= max.y && min.z <= max.z;
+		}
+	};
+
+	//Bounds of the part of the triangle inside box, invalid when they do not overlap
+	AABB ClipTriangle(const Vector3& v0, const Vector3& v1, const Vector3& v2, const AABB& box);
+#pragma endregion
+
+#pragma region BVH
+	enum class BVHBuildQuality
+	{
+		Fast,	//binned SAH with few bins, quickest build
+		Medium,	//binned SAH with more bins
+		High	//full sweep SAH over every split candidate, slowest build
+	};
+
+	enum class BVHLayout
+	{
+		Binary,			//two children per node
+		Wide4,			//binary tree collapsed into four children per node, tested with one SSE slab test
+		Wide4Quantized	//Wide4 with 8-bit child bounds, half the node size
+	};
+
+	struct BVHSettings
+	{
+		//Largest leaf the SAH leaves unsplit, clamped to BVH4QuantizedNode::maxPrimitiveCount (255) for Wide4Quantized,
+		//whose leaves store their size in 8 bits
+		uint32_t maxLeafSize{ 4 };
+		BVHBuildQuality quality{ BVHBuildQuality::Medium };
+		BVHLayout layout{ BVHLayout::Binary };
+
+		//SBVH: also consider splitting primitive references with a plane, only used when Build gets a PrimitiveClipper
+		bool spatialSplits{ false };
+		//Hard cap on the references spatial splits add: a build never ends up with more than (1 + maxDuplication) times as many as primitives
+		float maxDuplication{ 0.5f };
+
+		//Threads for the binned/sweep and linear builders, 0 uses every hardware thread and 1 builds on the calling thread only
+		uint32_t buildThreadCount{ 0 };
+
+		//BuildLinear sort key: 30 (10 bits per axis) or 63 (21 bits per axis, for large or very clustered meshes)
+		uint32_t mortonCodeBits{ 30 };
+	};
+
+	//Bounds of the part of a primitive inside box, invalid when they do not overlap
+	using PrimitiveClipper = std::function<AABB(uint32_t primitiveIndex, const AABB& box)>;
+
+	//32 bytes, two nodes per cache line
+	struct BVHNode
+	{
+		Vector3 minAABB{};
+		uint32_t leftFirst{}; //left child index for interior nodes (right child = leftFirst + 1), first primitive for leaves
+		Vector3 maxAABB{};
+		uint32_t primitiveCount{}; //0 for interior nodes
+
+		bool IsLeaf() const { return primitiveCount > 0; }
+	};
+
+	//128 bytes, the child boxes are stored per component so all four test at once
+	struct alignas(16) BVH4Node
+	{
+		static constexpr uint32_t emptySlot{ UINT32_MAX };
+
+		float minX[4]{}, minY[4]{}, minZ[4]{};
+		float maxX[4]{}, maxY[4]{}, maxZ[4]{};
+		uint32_t child[4]{ emptySlot, emptySlot, emptySlot, emptySlot }; //wide node index for interior children, first primitive for leaves
+		uint32_t primitiveCount[4]{}; //0 for interior children
+
+		bool IsEmpty(int slot) const { return child[slot] == emptySlot; }
+		bool IsLeaf(int slot) const { return primitiveCount[slot] > 0; }
+	};
+
+	//64 bytes, one cache line: the child boxes are 8-bit offsets on a grid spanning the bounds of the node itself
+	struct alignas(16) BVH4QuantizedNode
+	{
+		static constexpr uint32_t emptySlot{ UINT32_MAX };
+		//Largest leaf primitiveCount can hold
+		static constexpr uint32_t maxPrimitiveCount{ UINT8_MAX };
+
+		Vector3 origin{}; //grid origin, min corner of the node bounds
+		int8_t scaleExponent[3]{}; //grid cell size per axis is 2^scaleExponent
+		uint8_t padding{};
+		uint8_t minX[4]{}, minY[4]{}, minZ[4]{};
+		uint8_t maxX[4]{}, maxY[4]{}, maxZ[4]{};
+		uint32_t child[4]{ emptySlot, emptySlot, emptySlot, emptySlot }; //wide node index for interior children, first primitive for leaves
+		uint8_t primitiveCount[4]{}; //0 for interior children
+
+		bool IsEmpty(int slot) const { return child[slot] == emptySlot; }
+		bool IsLeaf(int slot) const { return primitiveCount[slot] > 0; }
+
+		//Exact power of two, so grid offset * cell size never rounds
+		float GetCellSize(int axis) const
+		{
+			const uint32_t bits{ static_cast<uint32_t>(scaleExponent[axis] + 127) << 23 };
+			float cellSize{};
+			std::memcpy(&cellSize, &bits, sizeof(float));
+			return cellSize;
+		}
+	};
+
+	/**
+	 * \brief Binary bounding volume hierarchy built with the surface area heuristic.
+	 * Works on primitive bounds only, leaves reference ranges in GetPrimitiveIndices().
+	 * The wide layouts collapse the binary tree into GetWideNodes() or GetQuantizedNodes() with the same leaves,
+	 * the binary nodes are dropped afterwards so only the traversed format stays in memory.
+	 */
+	class BVH final
+	{
+	public:
+		//Deepest node level any build produces (the root is level 0), traversal stacks are sized from it
+		//Builds switch to median splits only where the surface area heuristic would run out of levels
+		static constexpr uint32_t maxDepth{ 64 };
+
+		BVH() = default;
+
+		void Build(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings = {}, const PrimitiveClipper& clipPrimitive = {});
+		//Linear BVH: sorts the primitives along a Morton curve and splits where the codes differ, no SAH
+		//Much quicker than Build but the tree traces slower, meant for geometry that deforms every frame
+		//Uses maxLeafSize, layout, buildThreadCount and mortonCodeBits from settings
+		void BuildLinear(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings = {});
+		//Recalculate the node bounds without changing the tree topology
+		//Spatially split references get their full primitive bounds back, still correct but looser than a rebuild
+		void Refit(const std::vector<AABB>& primitiveBounds);
+
+		bool IsEmpty() const { return m_PrimitiveIndices.empty(); }
+		uint32_t GetPrimitiveCount() const { return m_PrimitiveCount; }
+		//Leaf entries, more than GetPrimitiveCount() when spatial splits duplicated references
+		uint32_t GetReferenceCount() const { return static_cast<uint32_t>(m_PrimitiveIndices.size()); }
+		//Bytes used by the nodes and the primitive order
+		size_t GetMemoryUsage() const;
+		//Duration of the last Build, BuildLinear or BVHCache load in milliseconds
+		float GetBuildTime() const { return m_BuildTime; }
+
+		BVHLayout GetLayout() const { return m_Layout; }
+		const AABB& GetBounds() const { return m_Bounds; }
+		const std::vector<BVHNode>& GetNodes() const { return m_Nodes; }
+		const std::vector<BVH4Node>& GetWideNodes() const { return m_WideNodes; }
+		const std::vector<BVH4QuantizedNode>& GetQuantizedNodes() const { return m_QuantizedNodes; }
+		const std::vector<uint32_t>& GetPrimitiveIndices() const { return m_PrimitiveIndices; }
+
+	private:
+		//Serializes the node and primitive arrays as they are
+		friend class BVHCache;
+
+		struct SplitCandidate
+		{
+			int axis{ -1 };
+			float cost{ FLT_MAX };
+
+			//binned splits: primitives with a centroid bin below splitBin go left
+			float centroidMin{};
+			float binScale{};
+			uint32_t binCount{};
+			uint32_t splitBin{};
+
+			//sweep splits: the range is sorted along axis, the first leftCount primitives go left
+			uint32_t leftCount{};
+			bool isSweep{ false };
+		};
+
+		//Part of a primitive assigned to a node, spatial splits clip its bounds
+		struct Reference
+		{
+			AABB bounds{};
+			uint32_t primitiveIndex{};
+		};
+
+		//State shared by all threads of one Build
+		struct BuildContext
+		{
+			const std::vector<AABB>& primitiveBounds;
+			const std::vector<Vector3>& centroids;
+			const BVHSettings& settings;
+			uint32_t threadCount{ 1 };
+			uint32_t maxTaskDepth{ 0 };
+			std::atomic<uint32_t> nodeCount{ 1 };
+		};
+
+		BVHLayout m_Layout{ BVHLayout::Binary };
+		uint32_t m_PrimitiveCount{};
+		float m_BuildTime{};
+		AABB m_Bounds{};
+		std::vector<BVHNode> m_Nodes{};
+		std::vector<BVH4Node> m_WideNodes{};
+		std::vector<BVH4QuantizedNode> m_QuantizedNodes{};
+		std::vector<uint32_t> m_PrimitiveIndices{};
+
+		void UpdateNodeBounds(uint32_t nodeIndex, const std::vector<AABB>& primitiveBounds, uint32_t threadCount = 1);
+		void Subdivide(BuildContext& context, uint32_t rootIndex, uint32_t rootDepth);
+
+		SplitCandidate FindBinnedSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<Vector3>& centroids, uint32_t binCount, uint32_t threadCount) const;
+		SplitCandidate FindSweepSplit(const BVHNode& node, const std::vector<AABB>& primitiveBounds, const std::vector<Vector3>& centroids) const;
+		//Sweep split at the centroid median along the widest centroid axis
+		SplitCandidate GetMedianSplit(const BVHNode& node, const std::vector<Vector3>& centroids) const;
+		uint32_t Partition(const BVHNode& node, const SplitCandidate& split, const std::vector<Vector3>& centroids);
+
+		void SubdivideSpatial(const std::vector<AABB>& primitiveBounds, const BVHSettings& settings, const PrimitiveClipper& clipPrimitive);
+
+		AABB GetLeafBounds(uint32_t first, uint32_t primitiveCount, const std::vector<AABB>& primitiveBounds, uint32_t threadCount = 1) const;
+
+		//Bounds of the root and the collapse into the wide layouts, shared by Build and BuildLinear
+		void FinishBuild(const std::vector<AABB>& primitiveBounds);
+		void RefitBinaryNodes(const std::vector<AABB>& primitiveBounds);
+
+		void BuildWideNodes();
+		void BuildQuantizedNodes(const std::vector<AABB>& primitiveBounds);
+		void RefitWideNodes(const std::vector<AABB>& primitiveBounds);
+		void RefitQuantizedNodes(const std::vector<AABB>& primitiveBounds);
+	};
+#pragma endregion
+}
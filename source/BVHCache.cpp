@@ -0,0 +1,445 @@
+#include "BVHCache.h"
+#include "DataTypes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dae
+{
+	namespace
+	{
+		constexpr uint32_t g_FileMagic{ 0x43485642 }; //"BVHC"
+		//Bump whenever the file layout or one of the serialized structs changes
+		constexpr uint32_t g_FileVersion{ 1 };
+
+		constexpr uint64_t g_FNVOffsetBasis{ 14695981039346656037ull };
+		constexpr uint64_t g_FNVPrime{ 1099511628211ull };
+
+		struct FileHeader
+		{
+			uint32_t magic{ g_FileMagic };
+			uint32_t version{ g_FileVersion };
+			uint64_t key{};
+
+			uint32_t layout{};
+			uint32_t primitiveCount{};
+			float boundsMin[3]{};
+			float boundsMax[3]{};
+
+			uint64_t nodeCount{};
+			uint64_t wideNodeCount{};
+			uint64_t quantizedNodeCount{};
+			uint64_t primitiveIndexCount{};
+
+			uint64_t triangleCount{};
+			uint64_t kernelDataStride{};
+		};
+
+		void HashBytes(uint64_t& hash, const void* pData, size_t size)
+		{
+			const uint8_t* pBytes{ static_cast<const uint8_t*>(pData) };
+			for (size_t i{ 0 }; i < size; ++i)
+			{
+				hash ^= pBytes[i];
+				hash *= g_FNVPrime;
+			}
+		}
+
+		template<typename T>
+		void HashValue(uint64_t& hash, const T& value)
+		{
+			HashBytes(hash, &value, sizeof(T));
+		}
+
+		//The size goes in first so {a, b} + {c} and {a} + {b, c} hash differently
+		template<typename T>
+		void HashArray(uint64_t& hash, const std::vector<T>& values)
+		{
+			HashValue(hash, static_cast<uint64_t>(values.size()));
+			HashBytes(hash, values.data(), values.size() * sizeof(T));
+		}
+
+		template<typename T>
+		void WriteArray(std::ofstream& file, const std::vector<T>& values)
+		{
+			file.write(reinterpret_cast<const char*>(values.data()), static_cast<std::streamsize>(values.size() * sizeof(T)));
+		}
+
+		//Copies count elements out of the mapping, false when the file is too short
+		template<typename T>
+		bool ReadArray(const uint8_t*& pData, const uint8_t* pEnd, uint64_t count, std::vector<T>& values)
+		{
+			if (count > static_cast<uint64_t>(pEnd - pData) / sizeof(T))
+			{
+				return false;
+			}
+
+			values.resize(static_cast<size_t>(count));
+			std::memcpy(values.data(), pData, static_cast<size_t>(count) * sizeof(T));
+			pData += count * sizeof(T);
+			return true;
+		}
+
+		//Walks the tree from the root: children in range and reached only once, leaf ranges inside the primitive indices
+		//and no level deeper than BVH::maxDepth, which the fixed size traversal stacks rely on
+		bool IsValidTree(const std::vector<BVHNode>& nodes, uint64_t primitiveIndexCount)
+		{
+			if (nodes.empty())
+			{
+				return false;
+			}
+
+			std::vector<bool> isReached(nodes.size());
+			isReached[0] = true;
+			//(node index, depth)
+			std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0u, 0u } };
+			while (!stack.empty())
+			{
+				const auto [nodeIndex, depth] { stack.back() };
+				stack.pop_back();
+
+				const BVHNode& node{ nodes[nodeIndex] };
+				if (node.IsLeaf())
+				{
+					if (uint64_t{ node.leftFirst } + node.primitiveCount > primitiveIndexCount)
+					{
+						return false;
+					}
+					continue;
+				}
+
+				if (depth >= BVH::maxDepth || uint64_t{ node.leftFirst } + 1 >= nodes.size())
+				{
+					return false;
+				}
+				for (uint32_t child{ node.leftFirst }; child < node.leftFirst + 2; ++child)
+				{
+					if (isReached[child])
+					{
+						return false;
+					}
+					isReached[child] = true;
+					stack.push_back({ child, depth + 1 });
+				}
+			}
+			return true;
+		}
+
+		//Same checks for the wide layouts, where leaves are child slots one level below their node
+		template<typename WideNode>
+		bool IsValidTree(const std::vector<WideNode>& nodes, uint64_t primitiveIndexCount)
+		{
+			if (nodes.empty())
+			{
+				return false;
+			}
+
+			std::vector<bool> isReached(nodes.size());
+			isReached[0] = true;
+			std::vector<std::pair<uint32_t, uint32_t>> stack{ { 0u, 0u } };
+			while (!stack.empty())
+			{
+				const auto [nodeIndex, depth] { stack.back() };
+				stack.pop_back();
+
+				const WideNode& node{ nodes[nodeIndex] };
+				for (int slot{ 0 }; slot < 4; ++slot)
+				{
+					if (node.IsEmpty(slot))
+					{
+						continue;
+					}
+					if (depth >= BVH::maxDepth)
+					{
+						return false;
+					}
+
+					const uint32_t child{ node.child[slot] };
+					if (node.IsLeaf(slot))
+					{
+						if (uint64_t{ child } + node.primitiveCount[slot] > primitiveIndexCount)
+						{
+							return false;
+						}
+						continue;
+					}
+
+					if (child >= nodes.size() || isReached[child])
+					{
+						return false;
+					}
+					isReached[child] = true;
+					stack.push_back({ child, depth + 1 });
+				}
+			}
+			return true;
+		}
+
+		//Read-only view of a whole file, empty when it does not exist
+		class MappedFile final
+		{
+		public:
+			explicit MappedFile(const std::string& path)
+			{
+#if defined(_WIN32)
+				const HANDLE file{ CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr) };
+				if (file == INVALID_HANDLE_VALUE)
+				{
+					return;
+				}
+
+				LARGE_INTEGER size{};
+				if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+				{
+					//The view keeps the mapping alive, both handles can go right away
+					const HANDLE mapping{ CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) };
+					if (mapping)
+					{
+						m_pData = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+						m_Size = m_pData ? static_cast<size_t>(size.QuadPart) : 0;
+						CloseHandle(mapping);
+					}
+				}
+				CloseHandle(file);
+#else
+				const int file{ open(path.c_str(), O_RDONLY) };
+				if (file < 0)
+				{
+					return;
+				}
+
+				struct stat status{};
+				if (fstat(file, &status) == 0 && status.st_size > 0)
+				{
+					void* pMapping{ mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0) };
+					if (pMapping != MAP_FAILED)
+					{
+						m_pData = static_cast<const uint8_t*>(pMapping);
+						m_Size = static_cast<size_t>(status.st_size);
+					}
+				}
+				close(file);
+#endif
+			}
+
+			~MappedFile()
+			{
+				if (!m_pData)
+				{
+					return;
+				}
+#if defined(_WIN32)
+				UnmapViewOfFile(m_pData);
+#else
+				munmap(const_cast<uint8_t*>(m_pData), m_Size);
+#endif
+			}
+
+			MappedFile(const MappedFile&) = delete;
+			MappedFile(MappedFile&&) noexcept = delete;
+			MappedFile& operator=(const MappedFile&) = delete;
+			MappedFile& operator=(MappedFile&&) noexcept = delete;
+
+			const uint8_t* GetData() const { return m_pData; }
+			size_t GetSize() const { return m_Size; }
+
+		private:
+			const uint8_t* m_pData{ nullptr };
+			size_t m_Size{ 0 };
+		};
+	}
+
+	BVHCache::BVHCache(const std::string& directory)
+		: m_Directory{ directory }
+	{
+	}
+
+	uint64_t BVHCache::GetKey(const std::vector<Vector3>& positions, const std::vector<Vector3>& normals, const std::vector<int>& indices,
+		const BVHSettings& settings, TriangleIntersectionKernel kernel)
+	{
+		uint64_t hash{ g_FNVOffsetBasis };
+		HashValue(hash, g_FileVersion);
+
+		HashArray(hash, positions);
+		HashArray(hash, normals);
+		HashArray(hash, indices);
+
+		//Every thread count builds the same tree, buildThreadCount is left out on purpose
+		HashValue(hash, settings.maxLeafSize);
+		HashValue(hash, settings.quality);
+		HashValue(hash, settings.layout);
+		HashValue(hash, settings.spatialSplits);
+		HashValue(hash, settings.maxDuplication);
+		HashValue(hash, settings.mortonCodeBits);
+
+		HashValue(hash, kernel);
+		return hash;
+	}
+
+	bool BVHCache::Load(uint64_t key, BVH& bvh, TriangleSoA& triangles) const
+	{
+		const auto start{ std::chrono::steady_clock::now() };
+
+		const MappedFile file{ GetPath(key) };
+		if (file.GetSize() < sizeof(FileHeader))
+		{
+			return false;
+		}
+
+		FileHeader header{};
+		std::memcpy(&header, file.GetData(), sizeof(FileHeader));
+		if (header.magic != g_FileMagic || header.version != g_FileVersion || header.key != key ||
+			header.layout > static_cast<uint32_t>(BVHLayout::Wide4Quantized) || header.triangleCount != header.primitiveIndexCount)
+		{
+			return false;
+		}
+
+		//Fill copies first so a truncated file leaves the mesh as it was
+		BVH loadedBVH{};
+		TriangleSoA loadedTriangles{};
+
+		const uint8_t* pData{ file.GetData() + sizeof(FileHeader) };
+		const uint8_t* pEnd{ file.GetData() + file.GetSize() };
+		bool isValid{ ReadArray(pData, pEnd, header.nodeCount, loadedBVH.m_Nodes) &&
+			ReadArray(pData, pEnd, header.wideNodeCount, loadedBVH.m_WideNodes) &&
+			ReadArray(pData, pEnd, header.quantizedNodeCount, loadedBVH.m_QuantizedNodes) &&
+			ReadArray(pData, pEnd, header.primitiveIndexCount, loadedBVH.m_PrimitiveIndices) };
+
+		for (std::vector<float>* pComponent : { &loadedTriangles.v0x, &loadedTriangles.v0y, &loadedTriangles.v0z,
+			&loadedTriangles.edge1x, &loadedTriangles.edge1y, &loadedTriangles.edge1z,
+			&loadedTriangles.edge2x, &loadedTriangles.edge2y, &loadedTriangles.edge2z,
+			&loadedTriangles.normalx, &loadedTriangles.normaly, &loadedTriangles.normalz })
+		{
+			isValid = isValid && ReadArray(pData, pEnd, header.triangleCount + TriangleSoA::packetWidth - 1, *pComponent);
+		}
+		isValid = isValid && ReadArray(pData, pEnd, header.triangleCount * header.kernelDataStride, loadedTriangles.kernelData);
+
+		if (!isValid || pData != pEnd)
+		{
+			return false;
+		}
+
+		//A damaged file must not hand the traversal an index outside the arrays, so every one is checked before use
+		//Only the nodes of the stored layout are kept after a build, the other two arrays are always empty
+		const uint64_t primitiveIndexCount{ header.primitiveIndexCount };
+		switch (static_cast<BVHLayout>(header.layout))
+		{
+		case BVHLayout::Wide4:
+			isValid = header.nodeCount == 0 && header.quantizedNodeCount == 0 && IsValidTree(loadedBVH.m_WideNodes, primitiveIndexCount);
+			break;
+		case BVHLayout::Wide4Quantized:
+			isValid = header.nodeCount == 0 && header.wideNodeCount == 0 && IsValidTree(loadedBVH.m_QuantizedNodes, primitiveIndexCount);
+			break;
+		case BVHLayout::Binary:
+		default:
+			isValid = header.wideNodeCount == 0 && header.quantizedNodeCount == 0 && IsValidTree(loadedBVH.m_Nodes, primitiveIndexCount);
+			break;
+		}
+
+		const uint32_t primitiveCount{ header.primitiveCount };
+		if (!isValid || !std::all_of(loadedBVH.m_PrimitiveIndices.begin(), loadedBVH.m_PrimitiveIndices.end(),
+			[primitiveCount](uint32_t primitiveIndex) { return primitiveIndex < primitiveCount; }))
+		{
+			return false;
+		}
+
+		loadedBVH.m_Layout = static_cast<BVHLayout>(header.layout);
+		loadedBVH.m_PrimitiveCount = header.primitiveCount;
+		loadedBVH.m_Bounds = AABB{ { header.boundsMin[0], header.boundsMin[1], header.boundsMin[2] }, { header.boundsMax[0], header.boundsMax[1], header.boundsMax[2] } };
+		loadedBVH.m_BuildTime = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+		loadedTriangles.count = static_cast<size_t>(header.triangleCount);
+		loadedTriangles.kernelDataStride = static_cast<size_t>(header.kernelDataStride);
+
+		bvh = std::move(loadedBVH);
+		triangles = std::move(loadedTriangles);
+		return true;
+	}
+
+	void BVHCache::Save(uint64_t key, const BVH& bvh, const TriangleSoA& triangles) const
+	{
+		if (bvh.IsEmpty())
+		{
+			return;
+		}
+
+		std::error_code error{};
+		std::filesystem::create_directories(m_Directory, error);
+
+		//Workers restarting at the same time may write the same key, each writes its own file and the last rename wins
+		const std::string path{ GetPath(key) };
+		const std::string temporaryPath{ path + "." + std::to_string(std::random_device{}()) + ".tmp" };
+		{
+			std::ofstream file{ temporaryPath, std::ios::binary };
+			if (!file)
+			{
+				return;
+			}
+
+			FileHeader header{};
+			header.key = key;
+			header.layout = static_cast<uint32_t>(bvh.m_Layout);
+			header.primitiveCount = bvh.m_PrimitiveCount;
+			for (int axis{ 0 }; axis < 3; ++axis)
+			{
+				header.boundsMin[axis] = bvh.m_Bounds.min[axis];
+				header.boundsMax[axis] = bvh.m_Bounds.max[axis];
+			}
+			header.nodeCount = bvh.m_Nodes.size();
+			header.wideNodeCount = bvh.m_WideNodes.size();
+			header.quantizedNodeCount = bvh.m_QuantizedNodes.size();
+			header.primitiveIndexCount = bvh.m_PrimitiveIndices.size();
+			header.triangleCount = triangles.count;
+			header.kernelDataStride = triangles.kernelDataStride;
+			file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+
+			WriteArray(file, bvh.m_Nodes);
+			WriteArray(file, bvh.m_WideNodes);
+			WriteArray(file, bvh.m_QuantizedNodes);
+			WriteArray(file, bvh.m_PrimitiveIndices);
+			for (const std::vector<float>* pComponent : { &triangles.v0x, &triangles.v0y, &triangles.v0z,
+				&triangles.edge1x, &triangles.edge1y, &triangles.edge1z,
+				&triangles.edge2x, &triangles.edge2y, &triangles.edge2z,
+				&triangles.normalx, &triangles.normaly, &triangles.normalz })
+			{
+				WriteArray(file, *pComponent);
+			}
+			WriteArray(file, triangles.kernelData);
+
+			if (!file)
+			{
+				file.close();
+				std::filesystem::remove(temporaryPath, error);
+				return;
+			}
+		}
+
+		std::filesystem::rename(temporaryPath, path, error);
+		if (error)
+		{
+			std::filesystem::remove(temporaryPath, error);
+		}
+	}
+
+	std::string BVHCache::GetPath(uint64_t key) const
+	{
+		std::ostringstream fileName{};
+		fileName << std::hex << std::setw(16) << std::setfill('0') << key << ".bvh";
+		return (std::filesystem::path{ m_Directory } / fileName.str()).string();
+	}
+}
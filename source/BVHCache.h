@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Math.h"
+#include "BVH.h"
+
+namespace dae
+{
+	//Forward Declarations
+	struct TriangleSoA;
+	enum class TriangleIntersectionKernel;
+
+	/**
+	 * \brief On-disk cache of built mesh BVHs and their triangle layout, one file per key.
+	 * The key hashes everything the build depends on, so a file never needs invalidating: changed geometry
+	 * or settings simply map to another file. Files are memory-mapped on load and written through a
+	 * temporary file + rename, so processes sharing the directory never read a half written file.
+	 */
+	class BVHCache final
+	{
+	public:
+		explicit BVHCache(const std::string& directory);
+
+		//FNV-1a over the geometry, the build settings that change the tree and the kernel that shapes the triangle layout
+		static uint64_t GetKey(const std::vector<Vector3>& positions, const std::vector<Vector3>& normals, const std::vector<int>& indices,
+			const BVHSettings& settings, TriangleIntersectionKernel kernel);
+
+		//False when there is no valid file for key (missing, truncated or with an index out of range), bvh and triangles are left untouched then
+		bool Load(uint64_t key, BVH& bvh, TriangleSoA& triangles) const;
+		//Failing to write only costs the next run a rebuild, so errors are ignored
+		void Save(uint64_t key, const BVH& bvh, const TriangleSoA& triangles) const;
+
+		const std::string& GetDirectory() const { return m_Directory; }
+
+	private:
+		std::string m_Directory{};
+
+		std::string GetPath(uint64_t key) const;
+	};
+}
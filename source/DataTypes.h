@@ -1,7 +1,11 @@
 #pragma once
+#include <algorithm>
 #include <cassert>
+#include <emmintrin.h>
 
 #include "Math.h"
+#include "BVH.h"
+#include "BVHCache.h"
 #include "vector"
 
 namespace dae
@@ -54,6 +58,132 @@ namespace dae
 		unsigned char materialIndex{};
 	};
 
+	//Ray-triangle test used by a mesh, see TriangleKernels.h
+	enum class TriangleIntersectionKernel
+	{
+		EdgeTests,			//plane intersection + three edge tests
+		MollerTrumbore,		//barycentrics straight from the edges
+		Watertight,			//Woop et al., no leaks along shared edges
+		PrecomputedAffine	//Baldwin-Weber, per-triangle world to unit triangle transform
+	};
+
+	//Precomputed triangles in structure-of-arrays form: vertex 0, the two edges leaving it and the normal
+	struct TriangleSoA
+	{
+		std::vector<float> v0x{}, v0y{}, v0z{};
+		std::vector<float> edge1x{}, edge1y{}, edge1z{};
+		std::vector<float> edge2x{}, edge2y{}, edge2z{};
+		std::vector<float> normalx{}, normaly{}, normalz{};
+
+		//Extra per-triangle data of the kernel, kernelDataStride floats per triangle
+		//Watertight: v1, v2 (exact vertices, v0 + edge would round differently per triangle)
+		//PrecomputedAffine: 3x4 world to triangle space matrix, one row per output component
+		std::vector<float> kernelData{};
+		size_t kernelDataStride{ 0 };
+
+		//Wide kernels load packetWidth triangles starting at any index, the component arrays are zero padded so that never reads past the end
+		static constexpr size_t packetWidth{ 8 };
+		size_t count{ 0 };
+
+		size_t Size() const { return count; }
+
+		void Resize(size_t size, TriangleIntersectionKernel kernel)
+		{
+			count = size;
+			for (std::vector<float>* pComponent : { &v0x, &v0y, &v0z, &edge1x, &edge1y, &edge1z, &edge2x, &edge2y, &edge2z, &normalx, &normaly, &normalz })
+			{
+				pComponent->assign(size + packetWidth - 1, 0.f);
+			}
+
+			switch (kernel)
+			{
+			case TriangleIntersectionKernel::Watertight:
+				kernelDataStride = 6;
+				break;
+			case TriangleIntersectionKernel::PrecomputedAffine:
+				kernelDataStride = 12;
+				break;
+			default:
+				kernelDataStride = 0;
+				break;
+			}
+			kernelData.resize(size * kernelDataStride);
+		}
+
+		void SetKernelData(size_t index, TriangleIntersectionKernel kernel, const Vector3& v0, const Vector3& v1, const Vector3& v2)
+		{
+			float* pKernelData{ kernelData.data() + index * kernelDataStride };
+
+			if (kernel == TriangleIntersectionKernel::Watertight)
+			{
+				pKernelData[0] = v1.x;
+				pKernelData[1] = v1.y;
+				pKernelData[2] = v1.z;
+				pKernelData[3] = v2.x;
+				pKernelData[4] = v2.y;
+				pKernelData[5] = v2.z;
+			}
+			else if (kernel == TriangleIntersectionKernel::PrecomputedAffine)
+			{
+				const Vector3 edge1{ v1 - v0 };
+				const Vector3 edge2{ v2 - v0 };
+				const Vector3 normal{ Vector3::Cross(edge1, edge2) };
+
+				const float determinant{ Vector3::Dot(normal, normal) };
+				if (determinant == 0.f)
+				{
+					//Degenerate triangle, an all zero transform never reports a hit
+					std::fill(pKernelData, pKernelData + kernelDataStride, 0.f);
+					return;
+				}
+
+				//Inverse of the matrix with columns edge1, edge2, normal: its rows are these cross products
+				const float inverseDeterminant{ 1.f / determinant };
+				const Vector3 rows[3]
+				{
+					Vector3::Cross(edge2, normal) * inverseDeterminant,
+					Vector3::Cross(normal, edge1) * inverseDeterminant,
+					normal * inverseDeterminant
+				};
+
+				for (int r{ 0 }; r < 3; ++r)
+				{
+					pKernelData[r * 4] = rows[r].x;
+					pKernelData[r * 4 + 1] = rows[r].y;
+					pKernelData[r * 4 + 2] = rows[r].z;
+					pKernelData[r * 4 + 3] = -Vector3::Dot(rows[r], v0);
+				}
+			}
+		}
+
+		void Set(size_t index, const Vector3& v0, const Vector3& v1, const Vector3& v2, const Vector3& normal)
+		{
+			v0x[index] = v0.x;
+			v0y[index] = v0.y;
+			v0z[index] = v0.z;
+			edge1x[index] = v1.x - v0.x;
+			edge1y[index] = v1.y - v0.y;
+			edge1z[index] = v1.z - v0.z;
+			edge2x[index] = v2.x - v0.x;
+			edge2y[index] = v2.y - v0.y;
+			edge2z[index] = v2.z - v0.z;
+			normalx[index] = normal.x;
+			normaly[index] = normal.y;
+			normalz[index] = normal.z;
+		}
+
+		Vector3 GetNormal(size_t index) const
+		{
+			return { normalx[index], normaly[index], normalz[index] };
+		}
+	};
+
+	enum class MeshTransformMode
+	{
+		TransformVertices,	//bake the transform into transformedPositions/transformedNormals on every update
+		TransformRays		//keep the mesh in object space and move rays into it instead, O(1) updates
+	};
+
 	struct TriangleMesh
 	{
 		TriangleMesh() = default;
@@ -93,6 +223,24 @@ namespace dae
 		std::vector<Vector3> transformedPositions{};
 		std::vector<Vector3> transformedNormals{};
 
+		//TransformRays only supports rigid transforms (rotation, translation, positive scale)
+		MeshTransformMode transformMode{ MeshTransformMode::TransformVertices };
+		Matrix objectToWorld{};
+		Matrix worldToObject{};
+
+		//Acceleration structure over GetBVHPositions(), leaves index triangles (indices / 3)
+		BVHSettings bvhSettings{};
+		BVH bvh{};
+		//Set when positions change every frame (skinning, simulation): the BVH is rebuilt with BVH::BuildLinear
+		//on every UpdateTransforms, refitting a tree under large deformation makes the boxes overlap more and more
+		bool isDeforming{ false };
+		//When set, builds of the BVH and triangle layout are loaded from / saved to this cache
+		const BVHCache* pBVHCache{ nullptr };
+
+		//GetBVHPositions() triangles in BVH leaf order, so a leaf is one contiguous range
+		TriangleSoA triangles{};
+		TriangleIntersectionKernel intersectionKernel{ TriangleIntersectionKernel::MollerTrumbore };
+
 		void Translate(const Vector3& translation)
 		{
 			translationTransform = Matrix::CreateTranslation(translation);
@@ -153,6 +301,26 @@ namespace dae
 			//const auto finalTransform = ...
 
 			const Matrix finalTransformMatrix = scaleTransform *rotationTransform *translationTransform;
+
+			if (transformMode == MeshTransformMode::TransformRays)
+			{
+				objectToWorld = finalTransformMatrix;
+				worldToObject = Matrix::Inverse(finalTransformMatrix);
+
+				transformedPositions.clear();
+				transformedNormals.clear();
+
+				//The object space BVH only needs a build when the triangles change
+				const size_t triangleCount{ indices.size() % 3 ? 0 : indices.size() / 3 };
+				if (isDeforming || bvh.IsEmpty() || bvh.GetPrimitiveCount() != triangleCount)
+				{
+					UpdateBVH();
+				}
+
+				UpdateTransformedAABB(finalTransformMatrix);
+				return;
+			}
+
 			transformedPositions.clear();
 			transformedPositions.reserve(positions.size());
 			//Transform Positions (positions > transformedPositions)
@@ -171,8 +339,115 @@ namespace dae
 				transformedNormals.emplace_back(finalTransformMatrix.TransformVector(normals[i]));
 			}
 
-			UpdateTransformedAABB(finalTransformMatrix);
+			UpdateBVH();
+
+			//The BVH root holds the exact bounds of the transformed vertices
+			if (!bvh.IsEmpty())
+			{
+				transformedMinAABB = bvh.GetBounds().min;
+				transformedMaxAABB = bvh.GetBounds().max;
+			}
+		}
+
+		//Positions the BVH and the hit tests work on: object space for TransformRays, world space otherwise
+		const std::vector<Vector3>& GetBVHPositions() const
+		{
+			return transformMode == MeshTransformMode::TransformRays ? positions : transformedPositions;
+		}
+
+		const std::vector<Vector3>& GetBVHNormals() const
+		{
+			return transformMode == MeshTransformMode::TransformRays ? normals : transformedNormals;
+		}
+
+		void UpdateBVH()
+		{
+			const size_t triangleCount{ indices.size() % 3 ? 0 : indices.size() / 3 };
+			const std::vector<Vector3>& bvhPositions{ GetBVHPositions() };
+
+			//Only full builds go through the cache, a refit or linear rebuild is about as quick as a load
+			const bool isTopologyChanged{ bvh.IsEmpty() || bvh.GetPrimitiveCount() != triangleCount };
+			const bool isCacheable{ pBVHCache && isTopologyChanged && !isDeforming };
+			const uint64_t cacheKey{ isCacheable ? BVHCache::GetKey(bvhPositions, GetBVHNormals(), indices, bvhSettings, intersectionKernel) : 0 };
+			const bool isCached{ isCacheable && pBVHCache->Load(cacheKey, bvh, triangles) };
+
+			if (!isCached)
+			{
+				std::vector<AABB> triangleBounds(triangleCount);
+				for (size_t i{}; i < triangleCount; ++i)
+				{
+					triangleBounds[i].Grow(bvhPositions[indices[i * 3]]);
+					triangleBounds[i].Grow(bvhPositions[indices[i * 3 + 1]]);
+					triangleBounds[i].Grow(bvhPositions[indices[i * 3 + 2]]);
+				}
+
+				//Rebuild when the topology changed, otherwise only move the node bounds along
+				if (isDeforming)
+				{
+					bvh.BuildLinear(triangleBounds, bvhSettings);
+				}
+				else if (isTopologyChanged)
+				{
+					//Only used when bvhSettings.spatialSplits is set
+					const auto clipTriangle{ [&](uint32_t triangleIndex, const AABB& box)
+						{
+							return ClipTriangle(bvhPositions[indices[triangleIndex * 3]], bvhPositions[indices[triangleIndex * 3 + 1]], bvhPositions[indices[triangleIndex * 3 + 2]], box);
+						} };
+					bvh.Build(triangleBounds, bvhSettings, clipTriangle);
+				}
+				else
+				{
+					bvh.Refit(triangleBounds);
+				}
+			}
+
+			//Object space bounds for the transformed AABB of TransformRays meshes
+			if (transformMode == MeshTransformMode::TransformRays && !bvh.IsEmpty())
+			{
+				minAABB = bvh.GetBounds().min;
+				maxAABB = bvh.GetBounds().max;
+			}
+
+			if (!isCached)
+			{
+				UpdateTriangleLayout();
+			}
+
+			if (isCacheable && !isCached)
+			{
+				pBVHCache->Save(cacheKey, bvh, triangles);
+			}
+		}
+
+		void UpdateTriangleLayout()
+		{
+			const std::vector<Vector3>& bvhPositions{ GetBVHPositions() };
+			const std::vector<Vector3>& bvhNormals{ GetBVHNormals() };
+			const std::vector<uint32_t>& triangleOrder{ bvh.GetPrimitiveIndices() };
+
+			triangles.Resize(triangleOrder.size(), intersectionKernel);
+			for (size_t i{}; i < triangleOrder.size(); ++i)
+			{
+				const size_t triangleIndex{ triangleOrder[i] };
+				const Vector3& v0{ bvhPositions[indices[triangleIndex * 3]] };
+				const Vector3& v1{ bvhPositions[indices[triangleIndex * 3 + 1]] };
+				const Vector3& v2{ bvhPositions[indices[triangleIndex * 3 + 2]] };
+
+				triangles.Set(i, v0, v1, v2, bvhNormals[triangleIndex]);
+				triangles.SetKernelData(i, intersectionKernel, v0, v1, v2);
+			}
+		}
+
+		void SetIntersectionKernel(TriangleIntersectionKernel kernel)
+		{
+			intersectionKernel = kernel;
+			UpdateTriangleLayout();
+		}
 
+		void RebuildBVH()
+		{
+			bvh = {};
+			UpdateBVH();
 		}
 		void UpdateAABB()
 		{
@@ -225,6 +500,12 @@ namespace dae
 				tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
 			}
 			// (xmin, ymax, zmax)
+			tAABB = finalTransform.TransformPoint(minAABB.x, maxAABB.y, maxAABB.z);
+			{
+				tMinAABB = Vector3::Min(tAABB, tMinAABB);
+				tMaxAABB = Vector3::Max(tAABB, tMaxAABB);
+			}
+			// (xmin, ymax, zmin)
 			tAABB = finalTransform.TransformPoint(minAABB.x, maxAABB.y, minAABB.z);
 			{
 				tMinAABB = Vector3::Min(tAABB, tMinAABB);
@@ -236,6 +517,50 @@ namespace dae
 		}
 
 	};
+
+	//Placement of a shared TriangleMesh, the mesh has to use MeshTransformMode::TransformRays
+	struct TriangleMeshInstance
+	{
+		const TriangleMesh* pMesh{ nullptr };
+		unsigned char materialIndex{};
+
+		Matrix rotationTransform{};
+		Matrix translationTransform{};
+		Matrix scaleTransform{};
+
+		Matrix objectToWorld{};
+		Matrix worldToObject{};
+
+		Vector3 transformedMinAABB;
+		Vector3 transformedMaxAABB;
+
+		void Translate(const Vector3& translation)
+		{
+			translationTransform = Matrix::CreateTranslation(translation);
+		}
+
+		void RotateY(float yaw)
+		{
+			rotationTransform = Matrix::CreateRotationY(yaw);
+		}
+
+		void Scale(const Vector3& scale)
+		{
+			scaleTransform = Matrix::CreateScale(scale);
+		}
+
+		void UpdateTransforms()
+		{
+			assert(pMesh && pMesh->transformMode == MeshTransformMode::TransformRays);
+
+			objectToWorld = scaleTransform * rotationTransform * translationTransform;
+			worldToObject = Matrix::Inverse(objectToWorld);
+
+			const AABB worldBounds{ AABB{ pMesh->minAABB, pMesh->maxAABB }.Transformed(objectToWorld) };
+			transformedMinAABB = worldBounds.min;
+			transformedMaxAABB = worldBounds.max;
+		}
+	};
 #pragma endregion
 #pragma region LIGHT
 	enum class LightType
@@ -273,5 +598,118 @@ namespace dae
 		bool didHit{ false };
 		unsigned char materialIndex{ 0 };
 	};
+
+	//Pyramid of the rays leaving origin between four corner directions, such as the camera rays of a screen tile
+	struct Frustum
+	{
+		Frustum() = default;
+		//Corners in order around the frustum, in either winding
+		Frustum(const Vector3& _origin, const Vector3(&_corners)[4]) :
+			origin{ _origin }
+		{
+			Vector3 center{};
+			for (int i{ 0 }; i < 4; ++i)
+			{
+				corners[i] = _corners[i];
+				center += _corners[i];
+			}
+
+			for (int i{ 0 }; i < 4; ++i)
+			{
+				normals[i] = Vector3::Cross(corners[i], corners[(i + 1) % 4]);
+				if (Vector3::Dot(normals[i], center) < 0.f)
+				{
+					normals[i] = -normals[i];
+				}
+			}
+		}
+
+		Vector3 origin{};
+		Vector3 corners[4]{};
+		//Side planes through origin, facing inward
+		Vector3 normals[4]{};
+
+		//Conservative: only false when the box lies fully behind one of the side planes
+		bool Overlaps(const AABB& box) const
+		{
+			for (const Vector3& normal : normals)
+			{
+				const Vector3 farthestCorner{ normal.x >= 0.f ? box.max.x : box.min.x, normal.y >= 0.f ? box.max.y : box.min.y, normal.z >= 0.f ? box.max.z : box.min.z };
+				if (Vector3::Dot(normal, farthestCorner - origin) < 0.f)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		//The same rays in the space of transform, for object space BVHs
+		Frustum Transformed(const Matrix& transform) const
+		{
+			const Vector3 transformedCorners[4]{ transform.TransformVector(corners[0]), transform.TransformVector(corners[1]),
+				transform.TransformVector(corners[2]), transform.TransformVector(corners[3]) };
+			return Frustum{ transform.TransformPoint(origin), transformedCorners };
+		}
+	};
+
+	//Rays traced together, one per SSE lane: a 2x2 block of primary rays
+	//rays holds the scalar rays, Load() copies them into the per-component registers the packet hit tests read
+	struct RayPacket
+	{
+		static constexpr int laneCount{ 4 };
+		static constexpr int allLanes{ (1 << laneCount) - 1 };
+
+		Ray rays[laneCount]{};
+		//Lanes holding a ray, the others are never tested or written
+		int activeMask{ allLanes };
+
+		__m128 originX{}, originY{}, originZ{};
+		__m128 directionX{}, directionY{}, directionZ{};
+		__m128 inversedDirectionX{}, inversedDirectionY{}, inversedDirectionZ{};
+		__m128 tMin{};
+		//Shrinks to the closest hit of every lane, the scalar max of rays is left as it was
+		__m128 tMax{};
+
+		void Load()
+		{
+			originX = _mm_setr_ps(rays[0].origin.x, rays[1].origin.x, rays[2].origin.x, rays[3].origin.x);
+			originY = _mm_setr_ps(rays[0].origin.y, rays[1].origin.y, rays[2].origin.y, rays[3].origin.y);
+			originZ = _mm_setr_ps(rays[0].origin.z, rays[1].origin.z, rays[2].origin.z, rays[3].origin.z);
+			directionX = _mm_setr_ps(rays[0].direction.x, rays[1].direction.x, rays[2].direction.x, rays[3].direction.x);
+			directionY = _mm_setr_ps(rays[0].direction.y, rays[1].direction.y, rays[2].direction.y, rays[3].direction.y);
+			directionZ = _mm_setr_ps(rays[0].direction.z, rays[1].direction.z, rays[2].direction.z, rays[3].direction.z);
+
+			const __m128 one{ _mm_set1_ps(1.f) };
+			inversedDirectionX = _mm_div_ps(one, directionX);
+			inversedDirectionY = _mm_div_ps(one, directionY);
+			inversedDirectionZ = _mm_div_ps(one, directionZ);
+
+			tMin = _mm_setr_ps(rays[0].min, rays[1].min, rays[2].min, rays[3].min);
+			tMax = _mm_setr_ps(rays[0].max, rays[1].max, rays[2].max, rays[3].max);
+		}
+
+		float GetMax(int lane) const
+		{
+			alignas(16) float maxima[laneCount];
+			_mm_store_ps(maxima, tMax);
+			return maxima[lane];
+		}
+
+		void SetMax(int lane, float max)
+		{
+			alignas(16) float maxima[laneCount];
+			_mm_store_ps(maxima, tMax);
+			maxima[lane] = max;
+			tMax = _mm_load_ps(maxima);
+		}
+
+		//Scalar ray of lane with the current packet max, for the tests that have no packet version
+		Ray GetRay(int lane) const
+		{
+			Ray ray{ rays[lane] };
+			ray.max = GetMax(lane);
+			return ray;
+		}
+	};
 #pragma endregion
 }
\ No newline at end of file
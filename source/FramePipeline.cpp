@@ -0,0 +1,115 @@
+#include "FramePipeline.h"
+#include "Renderer.h"
+#include "Scene.h"
+
+namespace dae
+{
+	FramePipeline::FramePipeline(Renderer* pRenderer, Scene* pSceneA, Scene* pSceneB)
+		: m_pRenderer{ pRenderer },
+		m_pScenes{ pSceneA, pSceneB },
+		m_FrameBuffers{ std::vector<uint32_t>(pRenderer->GetPixelCount()), std::vector<uint32_t>(pRenderer->GetPixelCount()) },
+		m_RenderThread{ [this]() { RenderLoop(); } },
+		m_PresentThread{ [this]() { PresentLoop(); } }
+	{
+	}
+
+	FramePipeline::~FramePipeline()
+	{
+		Flush();
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			m_IsStopping = true;
+		}
+		m_Condition.notify_all();
+
+		m_RenderThread.join();
+		m_PresentThread.join();
+	}
+
+	Scene* FramePipeline::BeginFrame()
+	{
+		std::unique_lock<std::mutex> lock{ m_Mutex };
+		const uint64_t frame{ m_SubmittedFrameCount };
+
+		//The scene was last used by frame - 2
+		m_Condition.wait(lock, [&]() { return frame < 2 || m_RenderedFrameCount >= frame - 1; });
+
+		Scene* pScene{ m_pScenes[frame % 2] };
+		if (frame > 0)
+		{
+			pScene->GetCamera() = m_Camera;
+		}
+		return pScene;
+	}
+
+	void FramePipeline::EndFrame()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			m_Camera = m_pScenes[m_SubmittedFrameCount % 2]->GetCamera();
+			++m_SubmittedFrameCount;
+		}
+		m_Condition.notify_all();
+	}
+
+	void FramePipeline::Flush()
+	{
+		std::unique_lock<std::mutex> lock{ m_Mutex };
+		m_Condition.wait(lock, [this]() { return m_PresentedFrameCount == m_SubmittedFrameCount; });
+	}
+
+	void FramePipeline::RenderLoop()
+	{
+		while (true)
+		{
+			uint64_t frame{};
+			{
+				//Needs a submitted frame and its frame buffer back from the present thread, which showed frame - 2 from it
+				std::unique_lock<std::mutex> lock{ m_Mutex };
+				m_Condition.wait(lock, [this]()
+					{
+						return m_IsStopping || (m_RenderedFrameCount < m_SubmittedFrameCount &&
+							(m_RenderedFrameCount < 2 || m_PresentedFrameCount >= m_RenderedFrameCount - 1));
+					});
+				if (m_IsStopping)
+				{
+					return;
+				}
+				frame = m_RenderedFrameCount;
+			}
+
+			m_pRenderer->RenderFrame(m_pScenes[frame % 2], m_FrameBuffers[frame % 2].data());
+
+			{
+				std::lock_guard<std::mutex> lock{ m_Mutex };
+				++m_RenderedFrameCount;
+			}
+			m_Condition.notify_all();
+		}
+	}
+
+	void FramePipeline::PresentLoop()
+	{
+		while (true)
+		{
+			uint64_t frame{};
+			{
+				std::unique_lock<std::mutex> lock{ m_Mutex };
+				m_Condition.wait(lock, [this]() { return m_IsStopping || m_PresentedFrameCount < m_RenderedFrameCount; });
+				if (m_IsStopping)
+				{
+					return;
+				}
+				frame = m_PresentedFrameCount;
+			}
+
+			m_pRenderer->Present(m_FrameBuffers[frame % 2].data());
+
+			{
+				std::lock_guard<std::mutex> lock{ m_Mutex };
+				++m_PresentedFrameCount;
+			}
+			m_Condition.notify_all();
+		}
+	}
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+
+namespace dae
+{
+	class Renderer;
+	class Scene;
+
+	/**
+	 * \brief Overlaps the scene update, the rendering and the presentation of consecutive frames.
+	 * While the calling thread updates frame N + 1, a render thread renders frame N and a present thread shows frame N - 1,
+	 * at the cost of one frame of extra latency.
+	 * The render-visible state is double buffered as two instances of the same scene, frame N uses scene N % 2 and frame buffer N % 2.
+	 * The camera is carried over from one scene to the other, everything else Update has to set from the timer alone
+	 * (as every scene does now), state built up over frames would drift apart between the two scenes.
+	 */
+	class FramePipeline final
+	{
+	public:
+		//Both scenes initialized, pRenderer must outlive the pipeline
+		FramePipeline(Renderer* pRenderer, Scene* pSceneA, Scene* pSceneB);
+		~FramePipeline();
+
+		FramePipeline(const FramePipeline&) = delete;
+		FramePipeline(FramePipeline&&) noexcept = delete;
+		FramePipeline& operator=(const FramePipeline&) = delete;
+		FramePipeline& operator=(FramePipeline&&) noexcept = delete;
+
+		//Scene to update for the next frame, waits until the render thread is done with it
+		Scene* BeginFrame();
+		//Hands the scene returned by BeginFrame to the render thread
+		void EndFrame();
+		//Waits until every frame handed over is rendered and presented
+		//The renderer and the scenes can then be used directly until the next BeginFrame
+		void Flush();
+
+	private:
+		Renderer* m_pRenderer;
+		Scene* m_pScenes[2];
+		std::vector<uint32_t> m_FrameBuffers[2];
+		//Camera of the last frame handed over, copied before the render thread gets the scene since rendering writes to it
+		Camera m_Camera{};
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_Condition{};
+		//Frames handed over by EndFrame, rendered and presented since the start, frame N is done with a stage once its count is past N
+		uint64_t m_SubmittedFrameCount{ 0 };
+		uint64_t m_RenderedFrameCount{ 0 };
+		uint64_t m_PresentedFrameCount{ 0 };
+		bool m_IsStopping{ false };
+
+		std::thread m_RenderThread;
+		std::thread m_PresentThread;
+
+		void RenderLoop();
+		void PresentLoop();
+	};
+}
@@ -5,40 +5,17 @@
 
 namespace dae
 {
-#pragma region Material BASE
-	class Material
-	{
-	public:
-		Material() = default;
-		virtual ~Material() = default;
-
-		Material(const Material&) = delete;
-		Material(Material&&) noexcept = delete;
-		Material& operator=(const Material&) = delete;
-		Material& operator=(Material&&) noexcept = delete;
-
-		/**
-		 * \brief Function used to calculate the correct color for the specific material and its parameters
-		 * \param hitRecord current hitrecord
-		 * \param l light direction
-		 * \param v view direction
-		 * \return color
-		 */
-		virtual ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) = 0;
-	};
-#pragma endregion
-
 #pragma region Material SOLID COLOR
 	//SOLID COLOR
 	//===========
-	class Material_SolidColor final : public Material
+	class Material_SolidColor final
 	{
 	public:
 		Material_SolidColor(const ColorRGB& color): m_Color(color)
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord, const Vector3& l, const Vector3& v) override
+		ColorRGB Shade(const HitRecord& hitRecord, const Vector3& l, const Vector3& v) const
 		{
 			return m_Color;
 		}
@@ -51,13 +28,13 @@ namespace dae
 #pragma region Material LAMBERT
 	//LAMBERT
 	//=======
-	class Material_Lambert final : public Material
+	class Material_Lambert final
 	{
 	public:
 		Material_Lambert(const ColorRGB& diffuseColor, float diffuseReflectance) :
 			m_DiffuseColor(diffuseColor), m_DiffuseReflectance(diffuseReflectance){}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) const
 		{
 			//todo: W3
 			//assert(false && "Not Implemented Yet");
@@ -73,7 +50,7 @@ namespace dae
 #pragma region Material LAMBERT PHONG
 	//LAMBERT-PHONG
 	//=============
-	class Material_LambertPhong final : public Material
+	class Material_LambertPhong final
 	{
 	public:
 		Material_LambertPhong(const ColorRGB& diffuseColor, float kd, float ks, float phongExponent):
@@ -82,7 +59,7 @@ namespace dae
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) const
 		{
 			//todo: W3
 			//assert(false && "Not Implemented Yet");
@@ -100,7 +77,7 @@ namespace dae
 
 #pragma region Material COOK TORRENCE
 	//COOK TORRENCE
-	class Material_CookTorrence final : public Material
+	class Material_CookTorrence final
 	{
 	public:
 		Material_CookTorrence(const ColorRGB& albedo, float metalness, float roughness):
@@ -108,7 +85,7 @@ namespace dae
 		{
 		}
 
-		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) override
+		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) const
 		{
 			//todo: W3
 			//assert(false && "Not Implemented Yet");
@@ -157,4 +134,63 @@ namespace dae
 		float m_Roughness{0.1f}; // [1.0 > 0.0] >> [ROUGH > SMOOTH]
 	};
 #pragma endregion
+
+#pragma region Material
+	enum class MaterialType : uint8_t
+	{
+		SolidColor,
+		Lambert,
+		LambertPhong,
+		CookTorrence
+	};
+
+	/**
+	 * \brief Any of the material types above, stored by value.
+	 * Scenes keep these in one contiguous table and Shade picks the BRDF with a switch instead of a virtual call,
+	 * shading never writes to a material so one table is shared by all render threads.
+	 */
+	class Material final
+	{
+	public:
+		Material(const Material_SolidColor& solidColor) : m_Type{ MaterialType::SolidColor }, m_SolidColor{ solidColor } {}
+		Material(const Material_Lambert& lambert) : m_Type{ MaterialType::Lambert }, m_Lambert{ lambert } {}
+		Material(const Material_LambertPhong& lambertPhong) : m_Type{ MaterialType::LambertPhong }, m_LambertPhong{ lambertPhong } {}
+		Material(const Material_CookTorrence& cookTorrence) : m_Type{ MaterialType::CookTorrence }, m_CookTorrence{ cookTorrence } {}
+
+		MaterialType GetType() const { return m_Type; }
+
+		/**
+		 * \brief Function used to calculate the correct color for the specific material and its parameters
+		 * \param hitRecord current hitrecord
+		 * \param l light direction
+		 * \param v view direction
+		 * \return color
+		 */
+		ColorRGB Shade(const HitRecord& hitRecord = {}, const Vector3& l = {}, const Vector3& v = {}) const
+		{
+			switch (m_Type)
+			{
+			case MaterialType::SolidColor:
+				return m_SolidColor.Shade(hitRecord, l, v);
+			case MaterialType::Lambert:
+				return m_Lambert.Shade(hitRecord, l, v);
+			case MaterialType::LambertPhong:
+				return m_LambertPhong.Shade(hitRecord, l, v);
+			case MaterialType::CookTorrence:
+				return m_CookTorrence.Shade(hitRecord, l, v);
+			}
+			return {};
+		}
+
+	private:
+		MaterialType m_Type;
+		union
+		{
+			Material_SolidColor m_SolidColor;
+			Material_Lambert m_Lambert;
+			Material_LambertPhong m_LambertPhong;
+			Material_CookTorrence m_CookTorrence;
+		};
+	};
+#pragma endregion
 }
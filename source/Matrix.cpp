@@ -82,6 +82,43 @@ namespace dae {
 		return out;
 	}
 
+	//Assumes an affine matrix (last column 0,0,0,1)
+	const Matrix& Matrix::Inverse()
+	{
+		const Vector3 xAxis{ data[0] };
+		const Vector3 yAxis{ data[1] };
+		const Vector3 zAxis{ data[2] };
+		const Vector3 t{ data[3] };
+
+		const Vector3 yCrossZ{ Vector3::Cross(yAxis, zAxis) };
+		const Vector3 zCrossX{ Vector3::Cross(zAxis, xAxis) };
+		const Vector3 xCrossY{ Vector3::Cross(xAxis, yAxis) };
+
+		const float determinant{ Vector3::Dot(xAxis, yCrossZ) };
+		assert(determinant != 0.f && "Matrix is not invertible");
+		const float inverseDeterminant{ 1.f / determinant };
+
+		//The inverse 3x3 has the cross products as its columns
+		const Vector3 column0{ yCrossZ * inverseDeterminant };
+		const Vector3 column1{ zCrossX * inverseDeterminant };
+		const Vector3 column2{ xCrossY * inverseDeterminant };
+
+		data[0] = { column0.x, column1.x, column2.x, 0 };
+		data[1] = { column0.y, column1.y, column2.y, 0 };
+		data[2] = { column0.z, column1.z, column2.z, 0 };
+		data[3] = { -Vector3::Dot(t, column0), -Vector3::Dot(t, column1), -Vector3::Dot(t, column2), 1 };
+
+		return *this;
+	}
+
+	Matrix Matrix::Inverse(const Matrix& m)
+	{
+		Matrix out{ m };
+		out.Inverse();
+
+		return out;
+	}
+
 	Vector3 Matrix::GetAxisX() const
 	{
 		return data[0];
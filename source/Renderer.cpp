@@ -2,8 +2,6 @@
 #include "SDL.h"
 #include "SDL_surface.h"
 
-#include <thread>
-
 //Project includes
 #include "Renderer.h"
 #include "Math.h"
@@ -12,188 +10,970 @@
 #include "Scene.h"
 #include "Utils.h"
 
-#include <future> // ASYNC stuff
+#include <chrono>
+#include <cstring>
 
-#include <ppl.h> //Parallel stuff
+using namespace dae;
 
+namespace
+{
+	//Every other bit of value, the x (or y, shifted down once) coordinate of a 2D Morton code
+	uint32_t CompactBits(uint32_t value)
+	{
+		value &= 0x55555555;
+		value = (value | (value >> 1)) & 0x33333333;
+		value = (value | (value >> 2)) & 0x0F0F0F0F;
+		value = (value | (value >> 4)) & 0x00FF00FF;
+		value = (value | (value >> 8)) & 0x0000FFFF;
+		return value;
+	}
 
-//#define ASYNC
-#define PARALLEL_FOR
+	//Cell at distance along the Hilbert curve through a gridSize square, gridSize a power of two
+	void GetHilbertCell(uint32_t gridSize, uint32_t distance, uint32_t& x, uint32_t& y)
+	{
+		x = 0;
+		y = 0;
+		for (uint32_t size = 1; size < gridSize; size *= 2)
+		{
+			const uint32_t rx = 1 & (distance / 2);
+			const uint32_t ry = 1 & (distance ^ rx);
+			if (ry == 0)
+			{
+				if (rx == 1)
+				{
+					x = size - 1 - x;
+					y = size - 1 - y;
+				}
+				std::swap(x, y);
+			}
+			x += size * rx;
+			y += size * ry;
+			distance /= 4;
+		}
+	}
 
-using namespace dae;
+	//Calls task(first, end) for every batchSize long range of [0, count), spread over the threads of threadPool
+	template<typename Task>
+	void ForEachBatch(ThreadPool& threadPool, uint32_t count, uint32_t batchSize, const Task& task)
+	{
+		const uint32_t batchCount = (count + batchSize - 1) / batchSize;
+		threadPool.ParallelFor(batchCount, [&](uint32_t batchIndex)
+			{
+				const uint32_t first = batchIndex * batchSize;
+				task(first, std::min(first + batchSize, count));
+			});
+	}
+}
 
-Renderer::Renderer(SDL_Window * pWindow) :
+Renderer::Renderer(SDL_Window * pWindow, uint32_t threadCount) :
 	m_pWindow(pWindow),
-	m_pBuffer(SDL_GetWindowSurface(pWindow))
+	m_pBuffer(SDL_GetWindowSurface(pWindow)),
+	m_ThreadPool(threadCount)
 {
 	//Initialize
 	SDL_GetWindowSize(pWindow, &m_Width, &m_Height);
 	m_pBufferPixels = static_cast<uint32_t*>(m_pBuffer->pixels);
+	UpdateTileOrder();
 }
 
-void Renderer::Render(Scene* pScene) const
+void Renderer::Render(Scene* pScene)
 {
+	RenderFrame(pScene, m_pBufferPixels);
+
+	//Update SDL Surface
+	SDL_UpdateWindowSurface(m_pWindow);
+}
+
+void Renderer::RenderFrame(Scene* pScene, uint32_t* pPixels)
+{
+	m_pTargetPixels = pPixels;
+	pScene->UpdateTopLevelBVH();
+
 	Camera& camera = pScene->GetCamera();
 	auto& materials = pScene->GetMaterials();
 	auto& lights = pScene->GetLights();
 
-	const uint32_t numPixels = m_Width * m_Height;
-
 	float aspectRatio{ m_Width / float(m_Height) };
 
 	const Matrix cameraToWorld{ camera.CalculateCameraToWorld() };
-	const float fov{ tan(camera.fovAngle * TO_RADIANS / 2.f) };	
+
+	if (m_ProgressiveRenderingEnabled)
+	{
+		RenderProgressive(pScene, pPixels, aspectRatio, camera, lights, materials);
+		return;
+	}
+
+	if (m_CurrentRenderPath != RenderPath::Pixel)
+	{
+		RenderWavefront(pScene, aspectRatio, camera, lights, materials);
+		return;
+	}
+
+	//One task per tile, tiles are uneven work so idle threads steal them from the busy ones
+	const uint32_t numTasks = GetTileCount();
+	const TileKernel renderTile{ GetTileKernel() };
+	const auto renderTask = [&](uint32_t taskIndex)
+		{
+			(this->*renderTile)(pScene, m_TileOrder[taskIndex], aspectRatio, camera, lights, materials);
+		};
+
+	m_ThreadPool.ParallelFor(numTasks, renderTask);
+}
+
+void Renderer::Present(const uint32_t* pPixels) const
+{
+	std::memcpy(m_pBufferPixels, pPixels, GetPixelCount() * sizeof(uint32_t));
+	SDL_UpdateWindowSurface(m_pWindow);
+}
+
+
+	
 
 
-#if defined(ASYNC)
-	const uint32_t numCores = std::thread::hardware_concurrency();
-	std::vector<std::future<void>> async_futures{};
-	const uint32_t numPixelsPerTask = numPixels / numCores;
-	uint32_t numUnassigndPixels = numPixels % numCores;
-	uint32_t currPixelIndex{ 0 };
+const char* Renderer::GetRenderPathName() const
+{
+	switch (m_CurrentRenderPath)
+	{
+	case RenderPath::Pixel:
+		return "pixel";
+	case RenderPath::Wavefront:
+		return "wavefront";
+	case RenderPath::Deferred:
+		return "deferred";
+	}
+	return "";
+}
 
+const char* Renderer::GetTileOrderName() const
+{
+	switch (m_CurrentTileOrder)
+	{
+	case TileOrder::Scanline:
+		return "scanline";
+	case TileOrder::Morton:
+		return "Morton";
+	case TileOrder::Hilbert:
+		return "Hilbert";
+	}
+	return "";
+}
+
+void Renderer::SetTileSize(int tileSize)
+{
+	m_TileSize = std::max(tileSize + (tileSize & 1), 2);
+	UpdateTileOrder();
+}
+
+int Renderer::AutoTuneTileSize(Scene* pScene)
+{
+	constexpr int tileSizes[]{ 8, 16, 32, 64 };
+	constexpr int frameCount{ 3 };
 
-	for (uint32_t coreId = 0; coreId < numCores; ++coreId)
+	int bestTileSize{ m_TileSize };
+	float bestRaysPerSecond{ 0.f };
+	for (const int tileSize : tileSizes)
 	{
-		uint32_t taskSize{ numPixelsPerTask };
-		if (numUnassigndPixels)
+		SetTileSize(tileSize);
+
+		//The first frame also sizes the per-thread and wavefront buffers, so it is left out
+		//The fastest of the others counts, a frame slowed down by something else running says nothing about the tile size
+		Render(pScene);
+		float bestFrameTime{ FLT_MAX };
+		for (int i{ 0 }; i < frameCount; ++i)
 		{
-			++taskSize;
-			--numUnassigndPixels;
+			const auto start{ std::chrono::steady_clock::now() };
+			Render(pScene);
+			bestFrameTime = std::min(bestFrameTime, std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count());
 		}
 
-		async_futures.push_back(std::async(std::launch::async, [=, this]
+		const float raysPerSecond{ m_Width * m_Height / bestFrameTime };
+		if (raysPerSecond > bestRaysPerSecond)
+		{
+			bestRaysPerSecond = raysPerSecond;
+			bestTileSize = tileSize;
+		}
+	}
+
+	SetTileSize(bestTileSize);
+	return bestTileSize;
+}
+
+bool Renderer::SaveBufferToImage() const
+{
+	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
+}
+
+
+Renderer::TileKernel Renderer::GetTileKernel() const
+{
+	switch (m_CurrentLightingMode)
+	{
+	case LightingMode::ObservedArea:
+		return m_ShadowsEnabled ? &Renderer::RenderTile<LightingMode::ObservedArea, true> : &Renderer::RenderTile<LightingMode::ObservedArea, false>;
+	case LightingMode::Radiance:
+		return m_ShadowsEnabled ? &Renderer::RenderTile<LightingMode::Radiance, true> : &Renderer::RenderTile<LightingMode::Radiance, false>;
+	case LightingMode::BRDF:
+		return m_ShadowsEnabled ? &Renderer::RenderTile<LightingMode::BRDF, true> : &Renderer::RenderTile<LightingMode::BRDF, false>;
+	case LightingMode::Combined:
+	default:
+		return m_ShadowsEnabled ? &Renderer::RenderTile<LightingMode::Combined, true> : &Renderer::RenderTile<LightingMode::Combined, false>;
+	}
+}
+
+Renderer::ProgressiveTileKernel Renderer::GetProgressiveTileKernel() const
+{
+	switch (m_CurrentLightingMode)
+	{
+	case LightingMode::ObservedArea:
+		return m_ShadowsEnabled ? &Renderer::TraceProgressiveTile<LightingMode::ObservedArea, true> : &Renderer::TraceProgressiveTile<LightingMode::ObservedArea, false>;
+	case LightingMode::Radiance:
+		return m_ShadowsEnabled ? &Renderer::TraceProgressiveTile<LightingMode::Radiance, true> : &Renderer::TraceProgressiveTile<LightingMode::Radiance, false>;
+	case LightingMode::BRDF:
+		return m_ShadowsEnabled ? &Renderer::TraceProgressiveTile<LightingMode::BRDF, true> : &Renderer::TraceProgressiveTile<LightingMode::BRDF, false>;
+	case LightingMode::Combined:
+	default:
+		return m_ShadowsEnabled ? &Renderer::TraceProgressiveTile<LightingMode::Combined, true> : &Renderer::TraceProgressiveTile<LightingMode::Combined, false>;
+	}
+}
+
+template<Renderer::LightingMode lightingMode, bool shadowsEnabled>
+void Renderer::RenderTile(Scene* pScene, uint32_t tileIndex, float aspectRatio,
+	const Camera& camera, const std::vector<Light>& lights, const std::vector<Material>& materials) const
+{
+	const int tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	const int firstPx = (tileIndex % tileCountX) * m_TileSize;
+	const int firstPy = (tileIndex / tileCountX) * m_TileSize;
+	const int endPx = std::min(firstPx + m_TileSize, m_Width);
+	const int endPy = std::min(firstPy + m_TileSize, m_Height);
+
+	const FrustumVisibility* pVisibility{ CullTile(pScene, firstPx, firstPy, endPx, endPy, aspectRatio, camera) };
+
+	if (m_PacketTracingEnabled)
+	{
+		for (int py = firstPy; py < endPy; py += 2)
+		{
+			for (int px = firstPx; px < endPx; px += 2)
 			{
-				const uint32_t pixelIndexEnd = currPixelIndex + taskSize;
-				for (uint32_t pixelIndex{ currPixelIndex }; pixelIndex < pixelIndexEnd; pixelIndex++)
-				{
-					RenderPixel(pScene, pixelIndex, fov, aspectRatio, camera, lights, materials);
-				}
-			}));
-		currPixelIndex += taskSize;
+				RenderPacket<lightingMode, shadowsEnabled>(pScene, px, py, aspectRatio, camera, lights, materials, pVisibility);
+			}
+		}
+		return;
 	}
 
-	for (const std::future<void>& f : async_futures)
+	for (int py = firstPy; py < endPy; ++py)
 	{
-		f.wait();
+		for (int px = firstPx; px < endPx; ++px)
+		{
+			RenderPixel<lightingMode, shadowsEnabled>(pScene, px + (py * m_Width), aspectRatio, camera, lights, materials, pVisibility);
+		}
 	}
+}
 
+template<Renderer::LightingMode lightingMode, bool shadowsEnabled>
+void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float aspectRatio, 
+	const Camera& camera, const std::vector<Light>& lights, const std::vector<Material>& materials, const FrustumVisibility* pVisibility) const
+{
+	const int px = pixelIndex % m_Width ;
+	const int py = pixelIndex / m_Width ;
 
-#elif defined(PARALLEL_FOR)
+	const Vector3 rayDirection{ GetViewRayDirection(px + 0.5f, py + 0.5f, aspectRatio, camera) };
 
-	concurrency::parallel_for(0u, numPixels, [=, this](int i) {
-		RenderPixel(pScene, i, fov, aspectRatio, camera, lights, materials);
-		});	
+	const Ray viewRay{ camera.origin, rayDirection };
+	HitRecord closestHit{};
+	if (pVisibility)
+	{
+		pScene->GetClosestHit(viewRay, *pVisibility, closestHit);
+	}
+	else
+	{
+		pScene->GetClosestHit(viewRay, closestHit);
+	}
 
-#else
-	//sychroon
+	ShadePixel<lightingMode, shadowsEnabled>(pScene, px, py, closestHit, rayDirection, lights, materials);
+}
 
-	for (uint32_t i = 0; i < numPixels; i++)
+template<Renderer::LightingMode lightingMode, bool shadowsEnabled>
+void Renderer::RenderPacket(Scene* pScene, int firstPx, int firstPy, float aspectRatio,
+	const Camera& camera, const std::vector<Light>& lights, const std::vector<Material>& materials, const FrustumVisibility* pVisibility) const
+{
+	//Lanes cover the block row by row, lanes past the edge of the image repeat the first ray and stay inactive
+	RayPacket packet{};
+	packet.activeMask = 0;
+	Vector3 rayDirections[RayPacket::laneCount]{};
+	for (int lane{ 0 }; lane < RayPacket::laneCount; ++lane)
 	{
-		RenderPixel(pScene, i, fov, aspectRatio, camera, lights, materials);
+		const int px = firstPx + lane % 2;
+		const int py = firstPy + lane / 2;
+		if (px < m_Width && py < m_Height)
+		{
+			rayDirections[lane] = GetViewRayDirection(px + 0.5f, py + 0.5f, aspectRatio, camera);
+			packet.activeMask |= 1 << lane;
+		}
+		else
+		{
+			rayDirections[lane] = rayDirections[0];
+		}
+		packet.rays[lane] = { camera.origin, rayDirections[lane] };
 	}
-#endif
+	packet.Load();
 
+	HitRecord closestHits[RayPacket::laneCount]{};
+	if (pVisibility)
+	{
+		pScene->GetClosestHit(packet, *pVisibility, closestHits);
+	}
+	else
+	{
+		pScene->GetClosestHit(packet, closestHits);
+	}
 
-	//@END
-	//Update SDL Surface
-	SDL_UpdateWindowSurface(m_pWindow);
+	GeometryUtils::ForEachLane(packet.activeMask, [&](int lane)
+		{
+			ShadePixel<lightingMode, shadowsEnabled>(pScene, firstPx + lane % 2, firstPy + lane / 2, closestHits[lane], rayDirections[lane], lights, materials);
+		});
 }
 
+#pragma region Progressive
+template<Renderer::LightingMode lightingMode, bool shadowsEnabled>
+void Renderer::TraceProgressiveTile(Scene* pScene, uint32_t tileIndex, uint32_t pass, float aspectRatio,
+	const Camera& camera, const std::vector<Light>& lights, const std::vector<Material>& materials) const
+{
+	const int stride{ Progressive::sparseStride >> pass };
+	const int tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	const int firstPx = (tileIndex % tileCountX) * m_TileSize;
+	const int firstPy = (tileIndex / tileCountX) * m_TileSize;
+	const int endPx = std::min(firstPx + m_TileSize, m_Width);
+	const int endPy = std::min(firstPy + m_TileSize, m_Height);
 
-	
+	const FrustumVisibility* pVisibility{ CullTile(pScene, firstPx, firstPy, endPx, endPy, aspectRatio, camera) };
 
+	//Sparse samples are too far apart for 2x2 packets, every pixel traces on its own
+	for (int py = (firstPy + stride - 1) / stride * stride; py < endPy; py += stride)
+	{
+		for (int px = (firstPx + stride - 1) / stride * stride; px < endPx; px += stride)
+		{
+			//Already traced by the previous pass, on the grid with twice the spacing
+			if (pass > 0 && px % (2 * stride) == 0 && py % (2 * stride) == 0)
+			{
+				continue;
+			}
+			RenderPixel<lightingMode, shadowsEnabled>(pScene, px + (py * m_Width), aspectRatio, camera, lights, materials, pVisibility);
+		}
+	}
+}
 
-bool Renderer::SaveBufferToImage() const
+void Renderer::RenderProgressive(Scene* pScene, uint32_t* pPixels, float aspectRatio, const Camera& camera,
+	const std::vector<Light>& lights, const std::vector<Material>& materials)
 {
-	return SDL_SaveBMP(m_pBuffer, "RayTracing_Buffer.bmp");
+	const auto deadline{ std::chrono::steady_clock::now() + std::chrono::duration<float, std::milli>(m_ProgressiveFrameBudget) };
+	const uint32_t tileCount{ GetTileCount() };
+
+	Progressive& progressive{ m_Progressive };
+	const bool isSameView{ progressive.isValid &&
+		progressive.cameraOrigin.x == camera.origin.x && progressive.cameraOrigin.y == camera.origin.y && progressive.cameraOrigin.z == camera.origin.z &&
+		progressive.cameraForward.x == camera.forward.x && progressive.cameraForward.y == camera.forward.y && progressive.cameraForward.z == camera.forward.z &&
+		progressive.lightingMode == m_CurrentLightingMode && progressive.shadowsEnabled == m_ShadowsEnabled };
+
+	if (!isSameView)
+	{
+		progressive.samples.resize(GetPixelCount());
+		progressive.tileStrides.assign(tileCount, Progressive::untraced);
+		progressive.completeStride = Progressive::untraced;
+		progressive.pass = 0;
+		progressive.nextTask = 0;
+		progressive.isValid = true;
+		progressive.cameraOrigin = camera.origin;
+		progressive.cameraForward = camera.forward;
+		progressive.lightingMode = m_CurrentLightingMode;
+		progressive.shadowsEnabled = m_ShadowsEnabled;
+	}
+	else if (progressive.pass == Progressive::passCount)
+	{
+		//Complete image, trace it again so moving geometry shows up, the old samples stay on screen until they are replaced
+		progressive.pass = 0;
+		progressive.nextTask = 0;
+	}
+
+	//Chunks of a few tiles per thread, so the budget is checked often without leaving threads idle
+	const uint32_t chunkSize{ m_ThreadPool.GetThreadCount() * 4 };
+	const ProgressiveTileKernel traceTile{ GetProgressiveTileKernel() };
+	m_pTargetPixels = progressive.samples.data();
+	bool hasRefined{ false };
+	while (progressive.pass < Progressive::passCount)
+	{
+		//The sparse pass always completes, it is the least a frame shows
+		//Every frame refines at least one chunk as well, so a budget the sparse pass already spends does not stall the refinement
+		const bool isSparsePass{ progressive.pass == 0 };
+		if (!isSparsePass && hasRefined && std::chrono::steady_clock::now() >= deadline)
+		{
+			break;
+		}
+		hasRefined = !isSparsePass;
+
+		const uint32_t firstTask{ progressive.nextTask };
+		const uint32_t taskCount{ isSparsePass ? tileCount - firstTask : std::min(chunkSize, tileCount - firstTask) };
+		const uint32_t pass{ progressive.pass };
+		m_ThreadPool.ParallelFor(taskCount, [&](uint32_t taskIndex)
+			{
+				(this->*traceTile)(pScene, m_TileOrder[firstTask + taskIndex], pass, aspectRatio, camera, lights, materials);
+			});
+
+		const int stride{ Progressive::sparseStride >> pass };
+		for (uint32_t taskIndex{ firstTask }; taskIndex < firstTask + taskCount; ++taskIndex)
+		{
+			int& tileStride{ progressive.tileStrides[m_TileOrder[taskIndex]] };
+			tileStride = std::min(tileStride, stride);
+		}
+
+		progressive.nextTask += taskCount;
+		if (progressive.nextTask == tileCount)
+		{
+			progressive.completeStride = std::min(progressive.completeStride, stride);
+			++progressive.pass;
+			progressive.nextTask = 0;
+		}
+	}
+
+	ResolveProgressiveSamples(pPixels);
+}
+
+void Renderer::ResolveProgressiveSamples(uint32_t* pPixels)
+{
+	const Progressive& progressive{ m_Progressive };
+	const SDL_PixelFormat* pFormat{ m_pBuffer->format };
+	//Every spacing is a power of two, so the grid lookups are masks
+	const int gridMask{ progressive.completeStride - 1 };
+	const int tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	//Last pixel on the grid in each direction, samples past it fall outside the image
+	const int lastGridX{ (m_Width - 1) & ~gridMask };
+	const int lastGridY{ (m_Height - 1) & ~gridMask };
+
+	m_ThreadPool.ParallelFor(static_cast<uint32_t>(m_Height), [&](uint32_t rowIndex)
+		{
+			const int py{ static_cast<int>(rowIndex) };
+			const int y0{ py & ~gridMask };
+			const int y1{ std::min(y0 + gridMask + 1, lastGridY) };
+			const float ty{ y1 > y0 ? static_cast<float>(py - y0) / (y1 - y0) : 0.f };
+			const uint32_t* pTopRow{ progressive.samples.data() + y0 * m_Width };
+			const uint32_t* pBottomRow{ progressive.samples.data() + y1 * m_Width };
+			const uint32_t* pSamples{ progressive.samples.data() + py * m_Width };
+			uint32_t* pRow{ pPixels + py * m_Width };
+
+			for (int tileX = 0; tileX < tileCountX; ++tileX)
+			{
+				const int tileMask{ progressive.tileStrides[tileX + (py / m_TileSize) * tileCountX] - 1 };
+				const bool isTracedRow{ (py & tileMask) == 0 };
+				const int endPx{ std::min((tileX + 1) * m_TileSize, m_Width) };
+				for (int px = tileX * m_TileSize; px < endPx; ++px)
+				{
+					if (isTracedRow && (px & tileMask) == 0)
+					{
+						pRow[px] = pSamples[px];
+						continue;
+					}
+
+					const int x0{ px & ~gridMask };
+					const int x1{ std::min(x0 + gridMask + 1, lastGridX) };
+					const float tx{ x1 > x0 ? static_cast<float>(px - x0) / (x1 - x0) : 0.f };
+
+					//Window surfaces hold 8 bits per channel, blended channel by channel in place
+					uint32_t pixel{ pFormat->Amask };
+					for (const uint8_t shift : { pFormat->Rshift, pFormat->Gshift, pFormat->Bshift })
+					{
+						const float top{ Lerpf(static_cast<float>((pTopRow[x0] >> shift) & 0xFF), static_cast<float>((pTopRow[x1] >> shift) & 0xFF), tx) };
+						const float bottom{ Lerpf(static_cast<float>((pBottomRow[x0] >> shift) & 0xFF), static_cast<float>((pBottomRow[x1] >> shift) & 0xFF), tx) };
+						pixel |= static_cast<uint32_t>(Lerpf(top, bottom, ty) + 0.5f) << shift;
+					}
+					pRow[px] = pixel;
+				}
+			}
+		});
 }
+#pragma endregion
 
+uint32_t Renderer::GetTileCount() const
+{
+	return ((m_Width + m_TileSize - 1) / m_TileSize) * ((m_Height + m_TileSize - 1) / m_TileSize);
+}
 
-void Renderer::RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, 
-	const Camera& camera, const std::vector<Light>& lights, const std::vector<Material*>& materials) const
+void Renderer::UpdateTileOrder()
 {
-	const int px = pixelIndex % m_Width ;
-	const int py = pixelIndex / m_Width ;
+	const uint32_t tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	const uint32_t tileCountY = (m_Height + m_TileSize - 1) / m_TileSize;
+	m_TileOrder.clear();
+	m_TileOrder.reserve(tileCountX * tileCountY);
+	//Progressive passes keep their place as an index into the tile order
+	m_Progressive.isValid = false;
+
+	if (m_CurrentTileOrder == TileOrder::Scanline)
+	{
+		for (uint32_t tileIndex = 0; tileIndex < tileCountX * tileCountY; ++tileIndex)
+		{
+			m_TileOrder.push_back(tileIndex);
+		}
+		return;
+	}
 
-	float rx{ px + 0.5f };
-	float ry{ py + 0.5f };
+	//Walks the curve through the smallest power of two square holding the grid and skips the cells outside it
+	uint32_t gridSize = 1;
+	while (gridSize < tileCountX || gridSize < tileCountY)
+	{
+		gridSize *= 2;
+	}
 
-	float gradient = px / static_cast<float>(m_Width);
-	gradient += py / static_cast<float>(m_Width);
-	gradient /= 2.0f;
+	for (uint32_t distance = 0; distance < gridSize * gridSize; ++distance)
+	{
+		uint32_t x{}, y{};
+		if (m_CurrentTileOrder == TileOrder::Morton)
+		{
+			x = CompactBits(distance);
+			y = CompactBits(distance >> 1);
+		}
+		else
+		{
+			GetHilbertCell(gridSize, distance, x, y);
+		}
 
-	float cx = ((2 * (px + 0.5f)) / m_Width - 1) * aspectRatio;
-	float cy = 1 - (2 * (py + 0.5f)) / m_Height;
+		if (x < tileCountX && y < tileCountY)
+		{
+			m_TileOrder.push_back(x + y * tileCountX);
+		}
+	}
+}
+
+const FrustumVisibility* Renderer::CullTile(Scene* pScene, int firstPx, int firstPy, int endPx, int endPy, float aspectRatio, const Camera& camera) const
+{
+	if (!m_TileCullingEnabled)
+	{
+		return nullptr;
+	}
+
+	//Culls the scene against the frustum through the outer pixel edges of the tile once, all its rays then only test what survived
+	thread_local FrustumVisibility visibility{};
+	const Vector3 corners[4]
+	{
+		GetViewRayDirection(static_cast<float>(firstPx), static_cast<float>(firstPy), aspectRatio, camera),
+		GetViewRayDirection(static_cast<float>(endPx), static_cast<float>(firstPy), aspectRatio, camera),
+		GetViewRayDirection(static_cast<float>(endPx), static_cast<float>(endPy), aspectRatio, camera),
+		GetViewRayDirection(static_cast<float>(firstPx), static_cast<float>(endPy), aspectRatio, camera)
+	};
+	pScene->CullFrustum(Frustum{ camera.origin, corners }, visibility);
+	return &visibility;
+}
+
+Vector3 Renderer::GetViewRayDirection(float x, float y, float aspectRatio, const Camera& camera) const
+{
+	float cx = ((2 * x) / m_Width - 1) * aspectRatio;
+	float cy = 1 - (2 * y) / m_Height;
 
 	Vector3 rayDirection{ cx,cy,1 };
 	rayDirection.Normalize();
 
 	rayDirection = camera.cameraToWorld.TransformVector(rayDirection);
 	rayDirection.Normalize();
-	
-	Ray viewRay{};
-	HitRecord closestHit{};
-	ColorRGB finalColor{};	
+	return rayDirection;
+}
 
-	viewRay = { camera.origin, rayDirection };
-	pScene->GetClosestHit(viewRay, closestHit);
+template<Renderer::LightingMode lightingMode, bool shadowsEnabled>
+void Renderer::ShadePixel(Scene* pScene, int px, int py, const HitRecord& closestHit, const Vector3& rayDirection,
+	const std::vector<Light>& lights, const std::vector<Material>& materials) const
+{
+	ColorRGB finalColor{};	
 
 	if (closestHit.didHit)
 	{
-		for (const Light& light : lights)
+		for (uint32_t lightIndex{ 0 }; lightIndex < lights.size(); ++lightIndex)
 		{
-			Vector3 lightDirection = LightUtils::GetDirectionToLight(light, closestHit.origin + (closestHit.normal * 0.001f)).Normalized();
-			const float lightrayMagnitude{ lightDirection.Magnitude() };
-			if (m_ShadowsEnabled)
+			const Light& light{ lights[lightIndex] };
+			ShadowRayRecord shadowRay{};
+			if (!GetShadowRay(closestHit, light, shadowRay))
+			{
+				continue;
+			}
+
+			if constexpr (shadowsEnabled)
 			{
-				Ray lightRay{ closestHit.origin + (closestHit.normal * 0.001f),lightDirection };
-				lightRay.max = lightrayMagnitude;
-				if (pScene->DoesHit(lightRay))
+				if (pScene->DoesHit(shadowRay.ray, lightIndex))
 				{
 					continue;
 				}
 			}
 
-			const float observedArea{ Vector3::Dot(closestHit.normal, lightDirection) };
-			if (observedArea < 0)
+			finalColor += GetLightContribution<lightingMode>(closestHit, light, shadowRay, rayDirection, materials[closestHit.materialIndex]);
+		}
+	}
+
+	WritePixel(px + (py * m_Width), finalColor);
+}
+
+bool Renderer::GetShadowRay(const HitRecord& hit, const Light& light, ShadowRayRecord& shadowRay) const
+{
+	Vector3 lightDirection = LightUtils::GetDirectionToLight(light, hit.origin + (hit.normal * 0.001f)).Normalized();
+	const float lightrayMagnitude{ lightDirection.Magnitude() };
+
+	//Surfaces facing away from the light need no shadow ray
+	shadowRay.observedArea = Vector3::Dot(hit.normal, lightDirection);
+	if (shadowRay.observedArea < 0)
+	{
+		shadowRay.isActive = false;
+		return false;
+	}
+
+	shadowRay.ray = Ray{ hit.origin + (hit.normal * 0.001f),lightDirection };
+	shadowRay.ray.max = lightrayMagnitude;
+	shadowRay.isActive = true;
+	return true;
+}
+
+template<Renderer::LightingMode lightingMode>
+ColorRGB Renderer::GetLightContribution(const HitRecord& hit, const Light& light, const ShadowRayRecord& shadowRay, const Vector3& rayDirection,
+	const Material& material) const
+{
+	const Vector3& lightDirection{ shadowRay.ray.direction };
+	if constexpr (lightingMode == LightingMode::Combined)
+	{
+		return (LightUtils::GetRadiance(light, hit.origin) * material.Shade(hit, lightDirection, rayDirection)) * shadowRay.observedArea;
+	}
+	else if constexpr (lightingMode == LightingMode::Radiance)
+	{
+		return LightUtils::GetRadiance(light, hit.origin);
+	}
+	else if constexpr (lightingMode == LightingMode::BRDF)
+	{
+		return material.Shade(hit, lightDirection, rayDirection);
+	}
+	else
+	{
+		return ColorRGB{ 1.f, 1.f, 1.f } * shadowRay.observedArea;
+	}
+}
+
+void Renderer::WritePixel(uint32_t pixelIndex, ColorRGB color) const
+{
+	//Update Color in Buffer
+	color.MaxToOne();
+
+	m_pTargetPixels[pixelIndex] = SDL_MapRGB(m_pBuffer->format,
+		static_cast<uint8_t>(color.r * 255),
+		static_cast<uint8_t>(color.g * 255),
+		static_cast<uint8_t>(color.b * 255));
+}
+
+#pragma region Wavefront
+void Renderer::RenderWavefront(Scene* pScene, float aspectRatio, const Camera& camera,
+	const std::vector<Light>& lights, const std::vector<Material>& materials)
+{
+	//Each stage runs one small loop over a whole stream, so its code and data stay in cache instead of every pixel going through all of them
+	const uint32_t tileCount = GetTileCount();
+	GenerateCameraRays(tileCount, aspectRatio, camera);
+	IntersectCameraRays(pScene, tileCount, aspectRatio, camera);
+	CompactHits();
+	if (m_CurrentRenderPath == RenderPath::Deferred)
+	{
+		SortGBufferByMaterial(static_cast<uint32_t>(materials.size()));
+	}
+	GenerateShadowRays(lights);
+	if (m_ShadowsEnabled)
+	{
+		TraceShadowRays(pScene);
+	}
+
+	switch (m_CurrentLightingMode)
+	{
+	case LightingMode::ObservedArea:
+		ShadeGBuffer<LightingMode::ObservedArea>(lights, materials);
+		break;
+	case LightingMode::Radiance:
+		ShadeGBuffer<LightingMode::Radiance>(lights, materials);
+		break;
+	case LightingMode::BRDF:
+		ShadeGBuffer<LightingMode::BRDF>(lights, materials);
+		break;
+	case LightingMode::Combined:
+		ShadeGBuffer<LightingMode::Combined>(lights, materials);
+		break;
+	}
+}
+
+void Renderer::GenerateCameraRays(uint32_t tileCount, float aspectRatio, const Camera& camera)
+{
+	const uint32_t tileRayCount = m_TileSize * m_TileSize;
+	m_Wavefront.rayDirections.resize(tileCount * tileRayCount);
+	m_Wavefront.pixelIndices.resize(tileCount * tileRayCount);
+	m_Wavefront.hits.resize(tileCount * tileRayCount);
+
+	const int tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	const int blockCountX = m_TileSize / 2;
+	ForEachBatch(m_ThreadPool, tileCount, 1, [&](uint32_t firstTask, uint32_t endTask)
+		{
+			for (uint32_t taskIndex = firstTask; taskIndex < endTask; ++taskIndex)
+			{
+				const uint32_t tileIndex = m_TileOrder[taskIndex];
+				const int firstPx = (tileIndex % tileCountX) * m_TileSize;
+				const int firstPy = (tileIndex / tileCountX) * m_TileSize;
+				for (uint32_t tileRay = 0; tileRay < tileRayCount; ++tileRay)
+				{
+					//Same lane order as RenderPacket, so IntersectCameraRays loads packets straight from the stream
+					const uint32_t block = tileRay / RayPacket::laneCount;
+					const uint32_t lane = tileRay % RayPacket::laneCount;
+					const int px = firstPx + (block % blockCountX) * 2 + lane % 2;
+					const int py = firstPy + (block / blockCountX) * 2 + lane / 2;
+
+					const uint32_t rayIndex = taskIndex * tileRayCount + tileRay;
+					if (px < m_Width && py < m_Height)
+					{
+						m_Wavefront.rayDirections[rayIndex] = GetViewRayDirection(px + 0.5f, py + 0.5f, aspectRatio, camera);
+						m_Wavefront.pixelIndices[rayIndex] = px + (py * m_Width);
+					}
+					else
+					{
+						//Inactive lanes repeat the first ray of their block
+						m_Wavefront.rayDirections[rayIndex] = m_Wavefront.rayDirections[rayIndex - lane];
+						m_Wavefront.pixelIndices[rayIndex] = Wavefront::invalidPixel;
+					}
+				}
+			}
+		});
+}
+
+void Renderer::IntersectCameraRays(Scene* pScene, uint32_t tileCount, float aspectRatio, const Camera& camera)
+{
+	const uint32_t tileRayCount = m_TileSize * m_TileSize;
+	const int tileCountX = (m_Width + m_TileSize - 1) / m_TileSize;
+	ForEachBatch(m_ThreadPool, tileCount, 1, [&](uint32_t firstTask, uint32_t endTask)
+		{
+			for (uint32_t taskIndex = firstTask; taskIndex < endTask; ++taskIndex)
 			{
-				continue;
+				const uint32_t tileIndex = m_TileOrder[taskIndex];
+				const int firstPx = (tileIndex % tileCountX) * m_TileSize;
+				const int firstPy = (tileIndex / tileCountX) * m_TileSize;
+				const FrustumVisibility* pVisibility{ CullTile(pScene, firstPx, firstPy,
+					std::min(firstPx + m_TileSize, m_Width), std::min(firstPy + m_TileSize, m_Height), aspectRatio, camera) };
+
+				const uint32_t firstRay = taskIndex * tileRayCount;
+				for (uint32_t rayIndex = firstRay; rayIndex < firstRay + tileRayCount; rayIndex += RayPacket::laneCount)
+				{
+					RayPacket packet{};
+					packet.activeMask = 0;
+					for (int lane{ 0 }; lane < RayPacket::laneCount; ++lane)
+					{
+						m_Wavefront.hits[rayIndex + lane] = HitRecord{};
+						packet.rays[lane] = { camera.origin, m_Wavefront.rayDirections[rayIndex + lane] };
+						if (m_Wavefront.pixelIndices[rayIndex + lane] != Wavefront::invalidPixel)
+						{
+							packet.activeMask |= 1 << lane;
+						}
+					}
+
+					if (packet.activeMask == 0)
+					{
+						continue;
+					}
+
+					if (!m_PacketTracingEnabled)
+					{
+						GeometryUtils::ForEachLane(packet.activeMask, [&](int lane)
+							{
+								HitRecord& closestHit{ m_Wavefront.hits[rayIndex + lane] };
+								if (pVisibility)
+								{
+									pScene->GetClosestHit(packet.rays[lane], *pVisibility, closestHit);
+								}
+								else
+								{
+									pScene->GetClosestHit(packet.rays[lane], closestHit);
+								}
+							});
+						continue;
+					}
+
+					packet.Load();
+					HitRecord closestHits[RayPacket::laneCount]{};
+					if (pVisibility)
+					{
+						pScene->GetClosestHit(packet, *pVisibility, closestHits);
+					}
+					else
+					{
+						pScene->GetClosestHit(packet, closestHits);
+					}
+					std::copy(std::begin(closestHits), std::end(closestHits), m_Wavefront.hits.begin() + rayIndex);
+				}
 			}
+		});
+}
 
-			switch (m_CurrentLightingMode)
+void Renderer::CompactHits()
+{
+	//Misses are finished here, only rays that hit something go on to the shadow and shading stages
+	//Every batch counts its hits first, the sum over the batches before it is where it writes them, so the order stays the same
+	const uint32_t rayCount = static_cast<uint32_t>(m_Wavefront.pixelIndices.size());
+	std::vector<uint32_t>& offsets{ m_Wavefront.batchOffsets };
+	offsets.assign((rayCount + m_WavefrontBatchSize - 1) / m_WavefrontBatchSize, 0);
+	ForEachBatch(m_ThreadPool, rayCount, m_WavefrontBatchSize, [&](uint32_t firstRay, uint32_t endRay)
+		{
+			uint32_t hitCount = 0;
+			for (uint32_t rayIndex = firstRay; rayIndex < endRay; ++rayIndex)
 			{
-			case LightingMode::Combined:
-				
+				const uint32_t pixelIndex = m_Wavefront.pixelIndices[rayIndex];
+				if (pixelIndex == Wavefront::invalidPixel)
+				{
+					continue;
+				}
+
+				if (m_Wavefront.hits[rayIndex].didHit)
+				{
+					++hitCount;
+				}
+				else
 				{
-					finalColor += (LightUtils::GetRadiance(light, closestHit.origin) * materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, rayDirection)) * observedArea;
+					WritePixel(pixelIndex, ColorRGB{});
 				}
-				break;
-			case LightingMode::Radiance:
-				finalColor += LightUtils::GetRadiance(light, closestHit.origin);
-				break;
+			}
+			offsets[firstRay / m_WavefrontBatchSize] = hitCount;
+		});
 
-			case LightingMode::BRDF:
-				finalColor += materials[closestHit.materialIndex]->Shade(closestHit, lightDirection, rayDirection);
-				break;
+	uint32_t sampleCount = 0;
+	for (uint32_t& offset : offsets)
+	{
+		const uint32_t hitCount = offset;
+		offset = sampleCount;
+		sampleCount += hitCount;
+	}
 
-			case LightingMode::ObservedArea:
-				
+	m_Wavefront.gBuffer.resize(sampleCount);
+	ForEachBatch(m_ThreadPool, rayCount, m_WavefrontBatchSize, [&](uint32_t firstRay, uint32_t endRay)
+		{
+			uint32_t sampleIndex = offsets[firstRay / m_WavefrontBatchSize];
+			for (uint32_t rayIndex = firstRay; rayIndex < endRay; ++rayIndex)
+			{
+				const uint32_t pixelIndex = m_Wavefront.pixelIndices[rayIndex];
+				if (pixelIndex != Wavefront::invalidPixel && m_Wavefront.hits[rayIndex].didHit)
 				{
-					finalColor += ColorRGB{ 1.f, 1.f, 1.f } *observedArea;
+					m_Wavefront.gBuffer[sampleIndex++] = GBufferSample{ m_Wavefront.hits[rayIndex], m_Wavefront.rayDirections[rayIndex], pixelIndex };
 				}
-				break;
 			}
+		});
+}
+
+void Renderer::SortGBufferByMaterial(uint32_t materialCount)
+{
+	//Counting sort with a histogram per batch, offsets are ordered by material first and batch second,
+	//so it stays stable and each material keeps its samples in tile order
+	const uint32_t sampleCount = static_cast<uint32_t>(m_Wavefront.gBuffer.size());
+	const uint32_t batchCount = (sampleCount + m_WavefrontBatchSize - 1) / m_WavefrontBatchSize;
+	std::vector<uint32_t>& offsets{ m_Wavefront.materialOffsets };
+	offsets.assign(static_cast<size_t>(batchCount) * materialCount, 0);
+	ForEachBatch(m_ThreadPool, sampleCount, m_WavefrontBatchSize, [&](uint32_t firstSample, uint32_t endSample)
+		{
+			uint32_t* pHistogram{ &offsets[(firstSample / m_WavefrontBatchSize) * materialCount] };
+			for (uint32_t sampleIndex = firstSample; sampleIndex < endSample; ++sampleIndex)
+			{
+				++pHistogram[m_Wavefront.gBuffer[sampleIndex].hit.materialIndex];
+			}
+		});
+
+	uint32_t sum = 0;
+	for (uint32_t materialIndex = 0; materialIndex < materialCount; ++materialIndex)
+	{
+		for (uint32_t batchIndex = 0; batchIndex < batchCount; ++batchIndex)
+		{
+			uint32_t& offset{ offsets[batchIndex * materialCount + materialIndex] };
+			const uint32_t histogram = offset;
+			offset = sum;
+			sum += histogram;
 		}
 	}
 
-	//Update Color in Buffer
-	finalColor.MaxToOne();
+	m_Wavefront.sortedGBuffer.resize(sampleCount);
+	ForEachBatch(m_ThreadPool, sampleCount, m_WavefrontBatchSize, [&](uint32_t firstSample, uint32_t endSample)
+		{
+			uint32_t* pOffsets{ &offsets[(firstSample / m_WavefrontBatchSize) * materialCount] };
+			for (uint32_t sampleIndex = firstSample; sampleIndex < endSample; ++sampleIndex)
+			{
+				const GBufferSample& sample{ m_Wavefront.gBuffer[sampleIndex] };
+				m_Wavefront.sortedGBuffer[pOffsets[sample.hit.materialIndex]++] = sample;
+			}
+		});
+	std::swap(m_Wavefront.gBuffer, m_Wavefront.sortedGBuffer);
+}
 
-	m_pBufferPixels[px + (py * m_Width)] = SDL_MapRGB(m_pBuffer->format,
-		static_cast<uint8_t>(finalColor.r * 255),
-		static_cast<uint8_t>(finalColor.g * 255),
-		static_cast<uint8_t>(finalColor.b * 255));
+void Renderer::GenerateShadowRays(const std::vector<Light>& lights)
+{
+	const uint32_t sampleCount = static_cast<uint32_t>(m_Wavefront.gBuffer.size());
+	m_Wavefront.shadowRays.resize(sampleCount * lights.size());
+	ForEachBatch(m_ThreadPool, sampleCount, m_WavefrontBatchSize, [&](uint32_t firstSample, uint32_t endSample)
+		{
+			for (uint32_t lightIndex{ 0 }; lightIndex < lights.size(); ++lightIndex)
+			{
+				for (uint32_t sampleIndex = firstSample; sampleIndex < endSample; ++sampleIndex)
+				{
+					ShadowRayRecord& shadowRay{ m_Wavefront.shadowRays[lightIndex * sampleCount + sampleIndex] };
+					shadowRay = ShadowRayRecord{};
+					GetShadowRay(m_Wavefront.gBuffer[sampleIndex].hit, lights[lightIndex], shadowRay);
+				}
+			}
+		});
 }
 
+void Renderer::TraceShadowRays(Scene* pScene)
+{
+	const uint32_t sampleCount = static_cast<uint32_t>(m_Wavefront.gBuffer.size());
+	ForEachBatch(m_ThreadPool, static_cast<uint32_t>(m_Wavefront.shadowRays.size()), m_WavefrontBatchSize, [&](uint32_t firstRay, uint32_t endRay)
+		{
+			for (uint32_t rayIndex = firstRay; rayIndex < endRay; ++rayIndex)
+			{
+				ShadowRayRecord& shadowRay{ m_Wavefront.shadowRays[rayIndex] };
+				if (shadowRay.isActive)
+				{
+					shadowRay.isBlocked = pScene->DoesHit(shadowRay.ray, rayIndex / sampleCount);
+				}
+			}
+		});
+}
+
+template<Renderer::LightingMode lightingMode>
+void Renderer::ShadeGBuffer(const std::vector<Light>& lights, const std::vector<Material>& materials)
+{
+	const uint32_t sampleCount = static_cast<uint32_t>(m_Wavefront.gBuffer.size());
+	ForEachBatch(m_ThreadPool, sampleCount, m_WavefrontBatchSize, [&](uint32_t firstSample, uint32_t endSample)
+		{
+			thread_local std::vector<ColorRGB> finalColors{};
+			finalColors.assign(endSample - firstSample, ColorRGB{});
+
+			//Runs of one material shade light by light, after the material sort these are long and every call in the inner loop goes to the same BRDF
+			//Each sample still adds its lights in the same order as ShadePixel, so all paths round the same way
+			uint32_t runStart = firstSample;
+			while (runStart < endSample)
+			{
+				const unsigned char materialIndex{ m_Wavefront.gBuffer[runStart].hit.materialIndex };
+				const Material& material{ materials[materialIndex] };
+				uint32_t runEnd = runStart + 1;
+				while (runEnd < endSample && m_Wavefront.gBuffer[runEnd].hit.materialIndex == materialIndex)
+				{
+					++runEnd;
+				}
 
+				for (uint32_t lightIndex{ 0 }; lightIndex < lights.size(); ++lightIndex)
+				{
+					const ShadowRayRecord* pShadowRays{ &m_Wavefront.shadowRays[lightIndex * sampleCount] };
+					for (uint32_t sampleIndex = runStart; sampleIndex < runEnd; ++sampleIndex)
+					{
+						const ShadowRayRecord& shadowRay{ pShadowRays[sampleIndex] };
+						if (shadowRay.isActive && !shadowRay.isBlocked)
+						{
+							const GBufferSample& sample{ m_Wavefront.gBuffer[sampleIndex] };
+							finalColors[sampleIndex - firstSample] += GetLightContribution<lightingMode>(sample.hit, lights[lightIndex], shadowRay, sample.viewDirection, material);
+						}
+					}
+				}
+				runStart = runEnd;
+			}
+
+			for (uint32_t sampleIndex = firstSample; sampleIndex < endSample; ++sampleIndex)
+			{
+				WritePixel(m_Wavefront.gBuffer[sampleIndex].pixelIndex, finalColors[sampleIndex - firstSample]);
+			}
+		});
+}
+#pragma endregion
@@ -3,6 +3,9 @@
 #include <cstdint>
 #include<vector>
 
+#include "DataTypes.h"
+#include "ThreadPool.h"
+
 struct SDL_Window;
 struct SDL_Surface;
 
@@ -11,12 +14,16 @@ namespace dae
 	class Scene;
 	struct Camera;
 	struct Light;
+	struct HitRecord;
+	struct FrustumVisibility;
+	struct Vector3;
 	class Material;
 
 	class Renderer final
 	{
 	public:
-		Renderer(SDL_Window* pWindow);
+		//threadCount: render threads including the calling one, 0 uses every hardware thread
+		Renderer(SDL_Window* pWindow, uint32_t threadCount = 0);
 		~Renderer() = default;
 
 		Renderer(const Renderer&) = delete;
@@ -24,15 +31,73 @@ namespace dae
 		Renderer& operator=(const Renderer&) = delete;
 		Renderer& operator=(Renderer&&) noexcept = delete;
 
-		void Render(Scene* pScene) const;
+		//Renders into the window surface and shows it
+		void Render(Scene* pScene);
+		//Renders into pPixels (GetPixelCount() pixels in the window surface format) without showing it
+		void RenderFrame(Scene* pScene, uint32_t* pPixels);
+		//Copies a frame from RenderFrame into the window surface and shows it, may run on another thread than RenderFrame
+		void Present(const uint32_t* pPixels) const;
+		uint32_t GetPixelCount() const { return static_cast<uint32_t>(m_Width * m_Height); }
 
-		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float fov, float aspectRatio, const Camera& camera,
-			const std::vector<Light>& lights, const std::vector<Material*>& materials)const;
+		//Renders the frame stage by stage instead of pixel by pixel
+		void RenderWavefront(Scene* pScene, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials);
 
 		bool SaveBufferToImage() const;
 
 
 		void Toggelshadow() { m_ShadowsEnabled = !m_ShadowsEnabled; }
+		void TogglePacketTracing() { m_PacketTracingEnabled = !m_PacketTracingEnabled; }
+		bool IsPacketTracingEnabled() const { return m_PacketTracingEnabled; }
+		void ToggleTileCulling() { m_TileCullingEnabled = !m_TileCullingEnabled; }
+		bool IsTileCullingEnabled() const { return m_TileCullingEnabled; }
+		//Rounded up to an even size, so tiles split into whole 2x2 packets
+		void SetTileSize(int tileSize);
+		int GetTileSize() const { return m_TileSize; }
+		//Renders a few frames of pScene with every candidate tile size and keeps the one with the most camera rays per second
+		int AutoTuneTileSize(Scene* pScene);
+		const ThreadPool& GetThreadPool() const { return m_ThreadPool; }
+		void CycleRenderPaths() {
+			switch (m_CurrentRenderPath)
+			{
+			case dae::Renderer::RenderPath::Pixel:
+				m_CurrentRenderPath = RenderPath::Wavefront;
+				break;
+			case dae::Renderer::RenderPath::Wavefront:
+				m_CurrentRenderPath = RenderPath::Deferred;
+				break;
+			case dae::Renderer::RenderPath::Deferred:
+				m_CurrentRenderPath = RenderPath::Pixel;
+				break;
+			default:
+				break;
+			}
+		}
+		const char* GetRenderPathName() const;
+		void CycleTileOrders() {
+			switch (m_CurrentTileOrder)
+			{
+			case dae::Renderer::TileOrder::Scanline:
+				m_CurrentTileOrder = TileOrder::Morton;
+				break;
+			case dae::Renderer::TileOrder::Morton:
+				m_CurrentTileOrder = TileOrder::Hilbert;
+				break;
+			case dae::Renderer::TileOrder::Hilbert:
+				m_CurrentTileOrder = TileOrder::Scanline;
+				break;
+			default:
+				break;
+			}
+			UpdateTileOrder();
+		}
+		const char* GetTileOrderName() const;
+		//Progressive: a sparse pass first with the gaps interpolated, then finer passes until the frame budget runs out
+		void ToggleProgressiveRendering() { m_ProgressiveRenderingEnabled = !m_ProgressiveRenderingEnabled; m_Progressive.isValid = false; }
+		bool IsProgressiveRenderingEnabled() const { return m_ProgressiveRenderingEnabled; }
+		//Milliseconds the progressive passes may take per frame, the sparse pass always completes
+		void SetProgressiveFrameBudget(float milliseconds) { m_ProgressiveFrameBudget = milliseconds; }
+		float GetProgressiveFrameBudget() const { return m_ProgressiveFrameBudget; }
 
 		void CycleLightingModes() {
 			switch (m_CurrentLightingMode)
@@ -59,6 +124,8 @@ namespace dae
 
 		SDL_Surface* m_pBuffer{};
 		uint32_t* m_pBufferPixels{};
+		//Pixels the current frame writes to, the window surface or a buffer given to RenderFrame
+		uint32_t* m_pTargetPixels{};
 
 		int m_Width{};
 		int m_Height{};
@@ -71,11 +138,165 @@ namespace dae
 			Combined
 		};
 
+		//All give the same image
+		enum class RenderPath
+		{
+			Pixel,		//every pixel from camera ray to color in one call
+			Wavefront,	//every stage over the whole image in turn, see RenderWavefront
+			Deferred	//Wavefront with the G-buffer sorted by material before shading
+		};
+
+		//Order tiles are handed out in, all give the same image
+		enum class TileOrder
+		{
+			Scanline,	//row by row
+			Morton,		//Z-order curve over the tile grid
+			Hilbert		//Hilbert curve over the tile grid, every next tile touches the previous one
+		};
+
 		LightingMode m_CurrentLightingMode{ LightingMode::Combined };
+		RenderPath m_CurrentRenderPath{ RenderPath::Pixel };
 		bool m_ShadowsEnabled{ true };
+		//Camera rays in 2x2 packets instead of one ray per pixel, both give the same image
+		bool m_PacketTracingEnabled{ true };
+		//Camera rays only test what the frustum of their tile overlaps, both give the same image
+		bool m_TileCullingEnabled{ true };
+		//Even, so tiles split into whole 2x2 packets
+		int m_TileSize{ 16 };
+		//Curve orders keep the tiles a thread works through (and the ones it steals) close together on screen
+		TileOrder m_CurrentTileOrder{ TileOrder::Hilbert };
+		//Tile index per task index, rebuilt when the tile size or the order changes
+		std::vector<uint32_t> m_TileOrder{};
+		//Items one wavefront task works through
+		uint32_t m_WavefrontBatchSize{ 1024 };
+		bool m_ProgressiveRenderingEnabled{ false };
+		float m_ProgressiveFrameBudget{ 30.f }; //milliseconds
+
+		//Shadow ray from a hit towards one light
+		struct ShadowRayRecord
+		{
+			Ray ray{};
+			float observedArea{};
+			bool isActive{ false }; //false when the surface faces away from the light
+			bool isBlocked{ false };
+		};
+
+		//Surface seen by a camera ray: hit holds its position, normal and material
+		struct GBufferSample
+		{
+			HitRecord hit{};
+			Vector3 viewDirection{};
+			uint32_t pixelIndex{};
+		};
+
+		//Wavefront streams, kept between frames so they are only allocated once
+		struct Wavefront
+		{
+			static constexpr uint32_t invalidPixel{ UINT32_MAX };
+
+			//Camera rays tile by tile in m_TileOrder, four per 2x2 block, tiles on the image edge keep their full size
+			std::vector<Vector3> rayDirections{};
+			//Image pixel per camera ray, invalidPixel for rays past the edge of the image
+			std::vector<uint32_t> pixelIndices{};
+			std::vector<HitRecord> hits{};
+			//Compacted camera rays that hit something, sorted by material on the deferred path
+			std::vector<GBufferSample> gBuffer{};
+			//Start in gBuffer of the hits of every batch of camera rays
+			std::vector<uint32_t> batchOffsets{};
+			//Scatter target and per batch and material start offsets of the material sort
+			std::vector<GBufferSample> sortedGBuffer{};
+			std::vector<uint32_t> materialOffsets{};
+			//gBuffer.size() records per light, light after light so rays towards the same light are traced together
+			std::vector<ShadowRayRecord> shadowRays{};
+		};
+		Wavefront m_Wavefront{};
+
+		//Progressive state, kept between frames so unfinished refinement carries over while the view stays the same
+		//Pass 0 traces every sparseStride-th pixel in both directions, every next pass halves the spacing and skips what earlier passes traced
+		struct Progressive
+		{
+			static constexpr int sparseStride{ 4 }; //1 in 16 pixels
+			static constexpr uint32_t passCount{ 3 };
+			static constexpr int untraced{ INT32_MAX };
+
+			//Traced pixels in the window surface format
+			std::vector<uint32_t> samples{};
+			//Spacing of the finest pass done per tile, refinement that ran out of time leaves some tiles finer than others
+			std::vector<int> tileStrides{};
+			//Spacing every tile has reached, the gaps are interpolated on this grid
+			int completeStride{ untraced };
+			uint32_t pass{ passCount }; //next pass, passCount once every pixel is traced
+			uint32_t nextTask{ 0 }; //next task of that pass, index into m_TileOrder
+			bool isValid{ false }; //false starts over from the sparse pass on the next frame
+
+			//What the samples were traced with, anything else starts over as well
+			Vector3 cameraOrigin{};
+			Vector3 cameraForward{};
+			LightingMode lightingMode{};
+			bool shadowsEnabled{};
+		};
+		Progressive m_Progressive{};
+
+		//Persists across frames, every frame hands its tiles (or wavefront batches) to the same threads
+		ThreadPool m_ThreadPool;
+
+		//The pixel path is instantiated per lighting mode and shadow setting, Render picks one per frame so the per-light loop has no mode branches
+		using TileKernel = void (Renderer::*)(Scene* pScene, uint32_t tileIndex, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials) const;
+		TileKernel GetTileKernel() const;
+		using ProgressiveTileKernel = void (Renderer::*)(Scene* pScene, uint32_t tileIndex, uint32_t pass, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials) const;
+		ProgressiveTileKernel GetProgressiveTileKernel() const;
+
+		//Renders one m_TileSize square of the image, tiles are numbered row by row
+		template<LightingMode lightingMode, bool shadowsEnabled>
+		void RenderTile(Scene* pScene, uint32_t tileIndex, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials) const;
+		//pVisibility: what the tile holding the pixel can see, nullptr tests the whole scene
+		template<LightingMode lightingMode, bool shadowsEnabled>
+		void RenderPixel(Scene* pScene, uint32_t pixelIndex, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials, const FrustumVisibility* pVisibility = nullptr)const;
+		//Traces the camera rays of the 2x2 pixel block starting at firstPx, firstPy as one packet
+		template<LightingMode lightingMode, bool shadowsEnabled>
+		void RenderPacket(Scene* pScene, int firstPx, int firstPy, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials, const FrustumVisibility* pVisibility = nullptr) const;
+
+		//Traces the pixels of one tile that belong to progressive pass, into m_Progressive.samples
+		template<LightingMode lightingMode, bool shadowsEnabled>
+		void TraceProgressiveTile(Scene* pScene, uint32_t tileIndex, uint32_t pass, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials) const;
+		//Runs the progressive passes until the frame budget is spent, then writes the image to pPixels
+		void RenderProgressive(Scene* pScene, uint32_t* pPixels, float aspectRatio, const Camera& camera,
+			const std::vector<Light>& lights, const std::vector<Material>& materials);
+		//Traced pixels as they are, the others bilinearly interpolated between the m_Progressive.completeStride grid around them
+		void ResolveProgressiveSamples(uint32_t* pPixels);
 
-		
+		uint32_t GetTileCount() const;
+		void UpdateTileOrder();
+		//What the tile from firstPx, firstPy to endPx, endPy can see, nullptr when tile culling is off
+		const FrustumVisibility* CullTile(Scene* pScene, int firstPx, int firstPy, int endPx, int endPy, float aspectRatio, const Camera& camera) const;
+		//Camera ray through image position x, y in pixels (pixel centers are at + 0.5), always with a 90 degree vertical field of view
+		Vector3 GetViewRayDirection(float x, float y, float aspectRatio, const Camera& camera) const;
+		template<LightingMode lightingMode, bool shadowsEnabled>
+		void ShadePixel(Scene* pScene, int px, int py, const HitRecord& closestHit, const Vector3& rayDirection,
+			const std::vector<Light>& lights, const std::vector<Material>& materials) const;
+		//False when the surface at hit faces away from light and no shadow ray is needed
+		bool GetShadowRay(const HitRecord& hit, const Light& light, ShadowRayRecord& shadowRay) const;
+		//Light reflected towards the camera by an unblocked light, modes that need no BRDF or radiance skip them
+		template<LightingMode lightingMode>
+		ColorRGB GetLightContribution(const HitRecord& hit, const Light& light, const ShadowRayRecord& shadowRay, const Vector3& rayDirection,
+			const Material& material) const;
+		void WritePixel(uint32_t pixelIndex, ColorRGB color) const;
 
+		//Wavefront stages, each runs over the whole image before the next starts
+		void GenerateCameraRays(uint32_t tileCount, float aspectRatio, const Camera& camera);
+		void IntersectCameraRays(Scene* pScene, uint32_t tileCount, float aspectRatio, const Camera& camera);
+		void CompactHits();
+		void SortGBufferByMaterial(uint32_t materialCount);
+		void GenerateShadowRays(const std::vector<Light>& lights);
+		void TraceShadowRays(Scene* pScene);
+		template<LightingMode lightingMode>
+		void ShadeGBuffer(const std::vector<Light>& lights, const std::vector<Material>& materials);
 	};
 }
 
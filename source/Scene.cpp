@@ -2,50 +2,155 @@
 #include "Utils.h"
 #include "Material.h"
 
+#include <algorithm>
+#include <iostream>
+
 namespace dae {
+	namespace
+	{
+		//Shadow rays of neighbouring pixels run on the same thread, so a per-thread cache sees their coherence without locking
+		struct OccluderCache
+		{
+			std::vector<ShadowOccluder> lastOccluders{}; //indexed by light
+			uint64_t pendingQueryCount{ 0 };
+			uint64_t pendingHitCount{ 0 };
+		};
+
+		thread_local OccluderCache t_OccluderCache{};
+
+		constexpr uint64_t g_OccluderCacheCountBatch{ 1024 };
+	}
 
 #pragma region Base Scene
 	//Initialize Scene with Default Solid Color Material (RED)
 	Scene::Scene():
-		m_Materials({ new Material_SolidColor({1,0,0})})
+		m_Materials({ Material_SolidColor({1,0,0}) })
 	{
 		m_SphereGeometries.reserve(32);
 		m_PlaneGeometries.reserve(32);
 		m_TriangleMeshGeometries.reserve(32);
+		m_TriangleMeshInstances.reserve(32);
 		m_Lights.reserve(32);
 	}
 
 	Scene::~Scene()
 	{
-		for(auto& pMaterial : m_Materials)
+		for (auto& pMesh : m_SharedTriangleMeshes)
 		{
-			delete pMaterial;
-			pMaterial = nullptr;
+			delete pMesh;
+			pMesh = nullptr;
 		}
 
-		m_Materials.clear();
+		m_SharedTriangleMeshes.clear();
 	}
 
 	void dae::Scene::GetClosestHit(const Ray& ray, HitRecord& closestHit) const
 	{
 		//todo W1
-		for (int i = 0; i < m_SphereGeometries.size(); i++)
+		for (const Plane& planeGeometry : m_PlaneGeometries)
 		{
-			if (i != 0)
+			HitRecord testHitRecord{};
+			GeometryUtils::HitTest_Plane(planeGeometry, ray, testHitRecord);
+
+			if (testHitRecord.t < closestHit.t)
 			{
-				HitRecord testHitRecord{};
-				GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray, testHitRecord);
-				if (testHitRecord.t < closestHit.t)
-				{
-					closestHit = testHitRecord;
-				}
+				closestHit = testHitRecord;
 			}
-			else
+		}
+
+		//Only objects in front of the closest plane hit can still win
+		Ray currentRay{ ray };
+		currentRay.max = std::min(ray.max, closestHit.t);
+
+		const std::vector<uint32_t>& objectIndices{ m_TopLevelBVH.GetPrimitiveIndices() };
+		GeometryUtils::TraverseBVH(m_TopLevelBVH, currentRay, false, [&](const BVHNode& leaf)
 			{
-				GeometryUtils::HitTest_Sphere(m_SphereGeometries[i], ray, closestHit);
-			}
+				bool leafHit{ false };
+				for (uint32_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+				{
+					HitRecord testHitRecord{};
+					if (HitTest_SceneObject(m_TopLevelObjects[objectIndices[i]], currentRay, testHitRecord) && testHitRecord.t < closestHit.t)
+					{
+						closestHit = testHitRecord;
+						currentRay.max = testHitRecord.t;
+						leafHit = true;
+					}
+				}
+				return leafHit;
+			});
+
+		//assert(false && "No Implemented Yet!");
+	}
+
+	void Scene::GetClosestHit(RayPacket& packet, HitRecord(&closestHits)[RayPacket::laneCount]) const
+	{
+		//Every hit shrinks packet.tMax, so the planes leave the same max GetClosestHit gives the top-level walk
+		for (const Plane& planeGeometry : m_PlaneGeometries)
+		{
+			GeometryUtils::HitTest_Plane(planeGeometry, packet, packet.activeMask, closestHits);
 		}
 
+		const std::vector<uint32_t>& objectIndices{ m_TopLevelBVH.GetPrimitiveIndices() };
+		GeometryUtils::TraverseBVH(m_TopLevelBVH, packet, packet.activeMask, [&](const BVHNode& leaf, int laneMask)
+			{
+				int leafHits{ 0 };
+				for (uint32_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+				{
+					leafHits |= HitTest_SceneObject(m_TopLevelObjects[objectIndices[i]], packet, laneMask, closestHits);
+				}
+				return leafHits;
+			});
+	}
+
+	void Scene::CullFrustum(const Frustum& frustum, FrustumVisibility& visibility) const
+	{
+		visibility.objects.clear();
+
+		const std::vector<uint32_t>& objectIndices{ m_TopLevelBVH.GetPrimitiveIndices() };
+		GeometryUtils::CullBVH(m_TopLevelBVH, frustum, [&](uint32_t first, uint32_t primitiveCount)
+			{
+				for (uint32_t i{ first }; i < first + primitiveCount; ++i)
+				{
+					const SceneObject& object{ m_TopLevelObjects[objectIndices[i]] };
+					const AABB bounds{ GetObjectBounds(object) };
+					if (!frustum.Overlaps(bounds))
+					{
+						continue;
+					}
+
+					//Meshes are culled further down their own BVH, in the space it was built in
+					uint32_t entryNode{ 0 };
+					if (object.type == SceneObjectType::TriangleMesh)
+					{
+						const TriangleMesh& mesh{ m_TriangleMeshGeometries[object.index] };
+						const bool isObjectSpace{ mesh.transformMode == MeshTransformMode::TransformRays };
+						if (!GeometryUtils::FindEntryNode(mesh.bvh, isObjectSpace ? frustum.Transformed(mesh.worldToObject) : frustum, entryNode))
+						{
+							continue;
+						}
+					}
+					else if (object.type == SceneObjectType::TriangleMeshInstance)
+					{
+						const TriangleMeshInstance& instance{ m_TriangleMeshInstances[object.index] };
+						if (!GeometryUtils::FindEntryNode(instance.pMesh->bvh, frustum.Transformed(instance.worldToObject), entryNode))
+						{
+							continue;
+						}
+					}
+
+					const Vector3 closestPoint{ Vector3::Max(bounds.min, Vector3::Min(frustum.origin, bounds.max)) };
+					visibility.objects.push_back(VisibleObject{ object, entryNode, bounds, (closestPoint - frustum.origin).SqrMagnitude() });
+				}
+			});
+
+		std::sort(visibility.objects.begin(), visibility.objects.end(), [](const VisibleObject& a, const VisibleObject& b)
+			{
+				return a.sqrDistance < b.sqrDistance;
+			});
+	}
+
+	void Scene::GetClosestHit(const Ray& ray, const FrustumVisibility& visibility, HitRecord& closestHit) const
+	{
 		for (const Plane& planeGeometry : m_PlaneGeometries)
 		{
 			HitRecord testHitRecord{};
@@ -57,67 +162,369 @@ namespace dae {
 			}
 		}
 
-		/*for (const Triangle& triangle : m_Triangles)
+		Ray currentRay{ ray };
+		currentRay.max = std::min(ray.max, closestHit.t);
+
+		for (const VisibleObject& visibleObject : visibility.objects)
 		{
 			HitRecord testHitRecord{};
-			GeometryUtils::HitTest_Triangle(triangle, ray, testHitRecord);
-			if (testHitRecord.t < closestHit.t)
+			if (HitTest_SceneObject(visibleObject.object, currentRay, testHitRecord, false, visibleObject.entryNode) && testHitRecord.t < closestHit.t)
 			{
 				closestHit = testHitRecord;
+				currentRay.max = testHitRecord.t;
 			}
-		}*/
+		}
+	}
 
-		for (const TriangleMesh& triangleMesh : m_TriangleMeshGeometries)
+	void Scene::GetClosestHit(RayPacket& packet, const FrustumVisibility& visibility, HitRecord(&closestHits)[RayPacket::laneCount]) const
+	{
+		for (const Plane& planeGeometry : m_PlaneGeometries)
 		{
-			HitRecord testHitRecord{};
-			GeometryUtils::HitTest_TriangleMesh(triangleMesh, ray, testHitRecord);
-			if (testHitRecord.t < closestHit.t)
+			GeometryUtils::HitTest_Plane(planeGeometry, packet, packet.activeMask, closestHits);
+		}
+
+		for (const VisibleObject& visibleObject : visibility.objects)
+		{
+			__m128 tEntry{};
+			const int laneMask{ GeometryUtils::SlabTest_AABB(visibleObject.bounds.min, visibleObject.bounds.max, packet, packet.activeMask, tEntry) };
+			if (laneMask != 0)
 			{
-				closestHit = testHitRecord;
+				HitTest_SceneObject(visibleObject.object, packet, laneMask, closestHits, visibleObject.entryNode);
 			}
 		}
+	}
+
+	bool Scene::DoesHit(const Ray& ray) const
+	{
+		ShadowOccluder occluder{};
+		return FindOccluder(ray, occluder);
+	}
+
+	bool Scene::DoesHit(const Ray& ray, uint32_t lightIndex) const
+	{
+		if (!m_IsOccluderCacheEnabled)
+		{
+			return DoesHit(ray);
+		}
 
+		OccluderCache& cache{ t_OccluderCache };
+		if (cache.lastOccluders.size() <= lightIndex)
+		{
+			cache.lastOccluders.resize(lightIndex + 1);
+		}
 
-		//assert(false && "No Implemented Yet!");
+		ShadowOccluder& lastOccluder{ cache.lastOccluders[lightIndex] };
+		const bool isCacheHit{ lastOccluder.isValid && HitTest_Occluder(lastOccluder, ray) };
+
+		//Shared counters are only touched once per batch, the totals trail the real ones by less than a batch per thread
+		++cache.pendingQueryCount;
+		cache.pendingHitCount += isCacheHit;
+		if (cache.pendingQueryCount == g_OccluderCacheCountBatch)
+		{
+			m_OccluderCacheQueryCount.fetch_add(cache.pendingQueryCount, std::memory_order_relaxed);
+			m_OccluderCacheHitCount.fetch_add(cache.pendingHitCount, std::memory_order_relaxed);
+			cache.pendingQueryCount = 0;
+			cache.pendingHitCount = 0;
+		}
+
+		//A ray that reaches the light keeps the old occluder, the next pixel may well be in its shadow again
+		return isCacheHit || FindOccluder(ray, lastOccluder);
 	}
 
-	bool Scene::DoesHit(const Ray& ray) const
+	bool Scene::FindOccluder(const Ray& ray, ShadowOccluder& occluder) const
 	{
 		//todo W3
 		//assert(false && "No Implemented Yet!");
-		HitRecord closestHit{};		
-
-		for (const Sphere& sphereGeometry : m_SphereGeometries)
+		for (const Plane& planeGeometry : m_PlaneGeometries)
 		{
-			if (GeometryUtils::HitTest_Sphere(sphereGeometry, ray))
+			if (GeometryUtils::HitTest_Plane(planeGeometry, ray))
 			{
 				return true;
 			}
 		}
-		for (const Plane& planeGeometry : m_PlaneGeometries)
+
+		//Any occluder will do, so the walk tries the biggest subtrees first and stops at the first hit
+		const std::vector<uint32_t>& objectIndices{ m_TopLevelBVH.GetPrimitiveIndices() };
+		return GeometryUtils::OcclusionTest_BVH(m_TopLevelBVH, ray, [&](const BVHNode& leaf)
+			{
+				for (uint32_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+				{
+					const SceneObject& object{ m_TopLevelObjects[objectIndices[i]] };
+					size_t occluderIndex{};
+					if (HitTest_SceneObject(object, ray, occluderIndex))
+					{
+						occluder.object = object;
+						occluder.triangleIndex = occluderIndex;
+						occluder.isValid = true;
+						return true;
+					}
+				}
+				return false;
+			});
+	}
+
+	bool Scene::HitTest_Occluder(const ShadowOccluder& occluder, const Ray& ray) const
+	{
+		//The cache outlives geometry changes, an index that no longer exists is simply a miss
+		const uint32_t index{ occluder.object.index };
+		switch (occluder.object.type)
 		{
-			if (GeometryUtils::HitTest_Plane(planeGeometry, ray))
+		case SceneObjectType::Sphere:
+			return index < m_SphereGeometries.size() && GeometryUtils::HitTest_Sphere(m_SphereGeometries[index], ray);
+		case SceneObjectType::TriangleMesh:
+		{
+			if (index >= m_TriangleMeshGeometries.size())
 			{
-				return true;
+				return false;
+			}
+			const TriangleMesh& mesh{ m_TriangleMeshGeometries[index] };
+			return GeometryUtils::HitTest_TriangleMeshTriangle(mesh, GeometryUtils::GetBVHSpaceRay(mesh, ray), occluder.triangleIndex);
+		}
+		case SceneObjectType::TriangleMeshInstance:
+		{
+			if (index >= m_TriangleMeshInstances.size())
+			{
+				return false;
 			}
-		}	
+			const TriangleMeshInstance& instance{ m_TriangleMeshInstances[index] };
+			return GeometryUtils::HitTest_TriangleMeshTriangle(*instance.pMesh, GeometryUtils::TransformRay(instance.worldToObject, ray), occluder.triangleIndex);
+		}
+		default:
+			return false;
+		}
+	}
+
+	float Scene::GetOccluderCacheHitRate() const
+	{
+		const uint64_t queryCount{ m_OccluderCacheQueryCount.load(std::memory_order_relaxed) };
+		return queryCount > 0 ? static_cast<float>(m_OccluderCacheHitCount.load(std::memory_order_relaxed)) / queryCount : 0.f;
+	}
+
+	void Scene::ResetOccluderCacheStats()
+	{
+		m_OccluderCacheQueryCount.store(0, std::memory_order_relaxed);
+		m_OccluderCacheHitCount.store(0, std::memory_order_relaxed);
+	}
+
+	void Scene::SetTriangleIntersectionKernel(TriangleIntersectionKernel kernel)
+	{
+		for (TriangleMesh& mesh : m_TriangleMeshGeometries)
+		{
+			mesh.SetIntersectionKernel(kernel);
+		}
+
+		for (TriangleMesh* pMesh : m_SharedTriangleMeshes)
+		{
+			pMesh->SetIntersectionKernel(kernel);
+		}
+	}
+
+	TriangleIntersectionKernel Scene::GetTriangleIntersectionKernel() const
+	{
+		if (!m_TriangleMeshGeometries.empty())
+		{
+			return m_TriangleMeshGeometries.front().intersectionKernel;
+		}
+		if (!m_SharedTriangleMeshes.empty())
+		{
+			return m_SharedTriangleMeshes.front()->intersectionKernel;
+		}
+		//Default of TriangleMesh
+		return TriangleIntersectionKernel::MollerTrumbore;
+	}
+
+	void Scene::SetMeshBVHLayout(BVHLayout layout)
+	{
+		for (TriangleMesh& mesh : m_TriangleMeshGeometries)
+		{
+			mesh.bvhSettings.layout = layout;
+			mesh.RebuildBVH();
+		}
+
+		for (TriangleMesh* pMesh : m_SharedTriangleMeshes)
+		{
+			pMesh->bvhSettings.layout = layout;
+			pMesh->RebuildBVH();
+		}
+	}
+
+	BVHLayout Scene::GetMeshBVHLayout() const
+	{
+		if (!m_TriangleMeshGeometries.empty())
+		{
+			return m_TriangleMeshGeometries.front().bvhSettings.layout;
+		}
+		if (!m_SharedTriangleMeshes.empty())
+		{
+			return m_SharedTriangleMeshes.front()->bvhSettings.layout;
+		}
+		return BVHSettings{}.layout;
+	}
+
+	float Scene::GetMeshBVHBytesPerTriangle() const
+	{
+		size_t memoryUsage{};
+		size_t triangleCount{};
+		for (const TriangleMesh& mesh : m_TriangleMeshGeometries)
+		{
+			memoryUsage += mesh.bvh.GetMemoryUsage();
+			triangleCount += mesh.bvh.GetPrimitiveCount();
+		}
+
+		for (const TriangleMesh* pMesh : m_SharedTriangleMeshes)
+		{
+			memoryUsage += pMesh->bvh.GetMemoryUsage();
+			triangleCount += pMesh->bvh.GetPrimitiveCount();
+		}
+
+		return triangleCount > 0 ? static_cast<float>(memoryUsage) / triangleCount : 0.f;
+	}
+
+	void Scene::PrintMeshBVHBuildStats() const
+	{
+		float buildTime{};
+		size_t triangleCount{};
+		for (const TriangleMesh& mesh : m_TriangleMeshGeometries)
+		{
+			buildTime += mesh.bvh.GetBuildTime();
+			triangleCount += mesh.bvh.GetPrimitiveCount();
+		}
+
+		for (const TriangleMesh* pMesh : m_SharedTriangleMeshes)
+		{
+			buildTime += pMesh->bvh.GetBuildTime();
+			triangleCount += pMesh->bvh.GetPrimitiveCount();
+		}
+
+		if (triangleCount == 0)
+		{
+			return;
+		}
 
-		/*for (const Triangle& triangle : m_Triangles)
+		std::cout << "Mesh BVH build: " << triangleCount << " triangles in " << buildTime << " ms";
+		if (buildTime > 0.f)
 		{
-			if (GeometryUtils::HitTest_Triangle(triangle, ray))
+			std::cout << " (" << triangleCount / buildTime / 1000.f << " Mtris/s)";
+		}
+		std::cout << std::endl;
+	}
+
+	void Scene::UpdateTopLevelBVH()
+	{
+		const size_t previousObjectCount{ m_TopLevelObjects.size() };
+
+		m_TopLevelObjects.clear();
+		std::vector<AABB> objectBounds{};
+		objectBounds.reserve(m_SphereGeometries.size() + m_TriangleMeshGeometries.size() + m_TriangleMeshInstances.size());
+
+		for (size_t i{}; i < m_SphereGeometries.size(); ++i)
+		{
+			m_TopLevelObjects.push_back({ SceneObjectType::Sphere, static_cast<uint32_t>(i) });
+		}
+
+		for (size_t i{}; i < m_TriangleMeshGeometries.size(); ++i)
+		{
+			if (!m_TriangleMeshGeometries[i].bvh.IsEmpty())
 			{
-				return true;
+				m_TopLevelObjects.push_back({ SceneObjectType::TriangleMesh, static_cast<uint32_t>(i) });
 			}
-		}*/
+		}
 
-		for (const TriangleMesh& triangleMeshGeometry : m_TriangleMeshGeometries)
+		for (size_t i{}; i < m_TriangleMeshInstances.size(); ++i)
 		{
-			if (GeometryUtils::HitTest_TriangleMesh(triangleMeshGeometry, ray))
+			if (!m_TriangleMeshInstances[i].pMesh->bvh.IsEmpty())
 			{
-				return true;
+				m_TopLevelObjects.push_back({ SceneObjectType::TriangleMeshInstance, static_cast<uint32_t>(i) });
 			}
-		}		
-		return false;
+		}
+
+		for (const SceneObject& object : m_TopLevelObjects)
+		{
+			objectBounds.push_back(GetObjectBounds(object));
+		}
+
+		//Objects only moved: keep the tree, update its bounds
+		if (m_TopLevelObjects.size() == previousObjectCount && !m_TopLevelBVH.IsEmpty())
+		{
+			m_TopLevelBVH.Refit(objectBounds);
+			return;
+		}
+
+		BVHSettings settings{};
+		settings.maxLeafSize = 2;
+		settings.quality = BVHBuildQuality::High;
+		m_TopLevelBVH.Build(objectBounds, settings);
+	}
+
+	bool Scene::HitTest_SceneObject(const SceneObject& object, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, uint32_t rootIndex) const
+	{
+		switch (object.type)
+		{
+		case SceneObjectType::Sphere:
+			return GeometryUtils::HitTest_Sphere(m_SphereGeometries[object.index], ray, hitRecord, ignoreHitRecord);
+		case SceneObjectType::TriangleMesh:
+			return GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[object.index], ray, hitRecord, ignoreHitRecord, rootIndex);
+		case SceneObjectType::TriangleMeshInstance:
+			return GeometryUtils::HitTest_TriangleMeshInstance(m_TriangleMeshInstances[object.index], ray, hitRecord, ignoreHitRecord, rootIndex);
+		default:
+			return false;
+		}
+	}
+
+	int Scene::HitTest_SceneObject(const SceneObject& object, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount], uint32_t rootIndex) const
+	{
+		switch (object.type)
+		{
+		case SceneObjectType::Sphere:
+			return GeometryUtils::HitTest_Sphere(m_SphereGeometries[object.index], packet, laneMask, hitRecords);
+		case SceneObjectType::TriangleMesh:
+			return GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[object.index], packet, laneMask, hitRecords, rootIndex);
+		case SceneObjectType::TriangleMeshInstance:
+			return GeometryUtils::HitTest_TriangleMeshInstance(m_TriangleMeshInstances[object.index], packet, laneMask, hitRecords, rootIndex);
+		default:
+			return 0;
+		}
+	}
+
+	AABB Scene::GetObjectBounds(const SceneObject& object) const
+	{
+		switch (object.type)
+		{
+		case SceneObjectType::Sphere:
+		{
+			const Sphere& sphere{ m_SphereGeometries[object.index] };
+			const Vector3 extent{ sphere.radius, sphere.radius, sphere.radius };
+			return { sphere.origin - extent, sphere.origin + extent };
+		}
+		case SceneObjectType::TriangleMesh:
+		{
+			const TriangleMesh& mesh{ m_TriangleMeshGeometries[object.index] };
+			return { mesh.transformedMinAABB, mesh.transformedMaxAABB };
+		}
+		case SceneObjectType::TriangleMeshInstance:
+		{
+			const TriangleMeshInstance& instance{ m_TriangleMeshInstances[object.index] };
+			return { instance.transformedMinAABB, instance.transformedMaxAABB };
+		}
+		default:
+			return {};
+		}
+	}
+
+	bool Scene::HitTest_SceneObject(const SceneObject& object, const Ray& ray, size_t& occluderIndex) const
+	{
+		switch (object.type)
+		{
+		case SceneObjectType::Sphere:
+			occluderIndex = 0;
+			return GeometryUtils::HitTest_Sphere(m_SphereGeometries[object.index], ray);
+		case SceneObjectType::TriangleMesh:
+			return GeometryUtils::HitTest_TriangleMesh(m_TriangleMeshGeometries[object.index], ray, occluderIndex);
+		case SceneObjectType::TriangleMeshInstance:
+			return GeometryUtils::HitTest_TriangleMeshInstance(m_TriangleMeshInstances[object.index], ray, occluderIndex);
+		default:
+			return false;
+		}
 	}
 
 #pragma region Scene Helpers
@@ -153,6 +560,27 @@ namespace dae {
 		return &m_TriangleMeshGeometries.back();
 	}
 
+	TriangleMesh* Scene::AddSharedTriangleMesh(TriangleCullMode cullMode)
+	{
+		TriangleMesh* pMesh{ new TriangleMesh{} };
+		pMesh->cullMode = cullMode;
+		pMesh->transformMode = MeshTransformMode::TransformRays;
+
+		m_SharedTriangleMeshes.push_back(pMesh);
+		return pMesh;
+	}
+
+	TriangleMeshInstance* Scene::AddTriangleMeshInstance(const TriangleMesh* pMesh, unsigned char materialIndex)
+	{
+		TriangleMeshInstance instance{};
+		instance.pMesh = pMesh;
+		instance.materialIndex = materialIndex;
+		instance.UpdateTransforms();
+
+		m_TriangleMeshInstances.emplace_back(instance);
+		return &m_TriangleMeshInstances.back();
+	}
+
 	Light* Scene::AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color)
 	{
 		Light l;
@@ -177,9 +605,9 @@ namespace dae {
 		return &m_Lights.back();
 	}
 
-	unsigned char Scene::AddMaterial(Material* pMaterial)
+	unsigned char Scene::AddMaterial(const Material& material)
 	{
-		m_Materials.push_back(pMaterial);
+		m_Materials.push_back(material);
 		return static_cast<unsigned char>(m_Materials.size() - 1);
 	}
 #pragma endregion
@@ -190,11 +618,11 @@ namespace dae {
 	{
 				//default: Material id0 >> SolidColor Material (RED)
 		constexpr unsigned char matId_Solid_Red = 0;
-		const unsigned char matId_Solid_Blue = AddMaterial(new Material_SolidColor{ colors::Blue });
+		const unsigned char matId_Solid_Blue = AddMaterial(Material_SolidColor{ colors::Blue });
 
-		const unsigned char matId_Solid_Yellow = AddMaterial(new Material_SolidColor{ colors::Yellow });
-		const unsigned char matId_Solid_Green = AddMaterial(new Material_SolidColor{ colors::Green });
-		const unsigned char matId_Solid_Magenta = AddMaterial(new Material_SolidColor{ colors::Magenta });
+		const unsigned char matId_Solid_Yellow = AddMaterial(Material_SolidColor{ colors::Yellow });
+		const unsigned char matId_Solid_Green = AddMaterial(Material_SolidColor{ colors::Green });
+		const unsigned char matId_Solid_Magenta = AddMaterial(Material_SolidColor{ colors::Magenta });
 
 		//Spheres
 		AddSphere({ -25.f, 0.f, 100.f }, 50.f, matId_Solid_Red);
@@ -214,11 +642,11 @@ namespace dae {
 		m_Camera.fovAngle = 45.f;
 
 		constexpr unsigned char matId_Solid_Red = 0;
-		const unsigned char matId_Solid_Blue = AddMaterial(new Material_SolidColor{ colors::Blue });
+		const unsigned char matId_Solid_Blue = AddMaterial(Material_SolidColor{ colors::Blue });
 
-		const unsigned char matId_Solid_Yellow = AddMaterial(new Material_SolidColor{ colors::Yellow });
-		const unsigned char matId_Solid_Green = AddMaterial(new Material_SolidColor{ colors::Green });
-		const unsigned char matId_Solid_Magenta = AddMaterial(new Material_SolidColor{ colors::Magenta });
+		const unsigned char matId_Solid_Yellow = AddMaterial(Material_SolidColor{ colors::Yellow });
+		const unsigned char matId_Solid_Green = AddMaterial(Material_SolidColor{ colors::Green });
+		const unsigned char matId_Solid_Magenta = AddMaterial(Material_SolidColor{ colors::Magenta });
 		
 		//plane
 		AddPlane({ -5.f,0.f,0.f }, {  1.f,0.f,0.f }, matId_Solid_Green);
@@ -247,14 +675,14 @@ namespace dae {
 		m_Camera.origin = { 0.f, 3.f, -9.f };
 		m_Camera.fovAngle = 45.f;
 
-		const auto matCT_GrayRoughMetal{ AddMaterial(new Material_CookTorrence({.972f, .960f, .915f}, 1.f, 1.f)) };
-		const auto matCT_GrayMediumMetal{ AddMaterial(new Material_CookTorrence({.972f, .960f, .915f}, 1.f, .6f)) };
-		const auto matCT_GraySmoothMetal{ AddMaterial(new Material_CookTorrence({.972f, .960f, .915f}, 1.f, .1f)) };
-		const auto matCT_GrayRoughPlastic{ AddMaterial(new Material_CookTorrence({.75f, .75f, .75f}, .0f, 1.f)) };
-		const auto matCT_GrayMediumPlastic{ AddMaterial(new Material_CookTorrence({.75f, .75f, .75f}, .0f, .6f)) };
-		const auto matCT_GraySmoothPlastic{ AddMaterial(new Material_CookTorrence({.75f, .75f, .75f}, .0f, .1f)) };
+		const auto matCT_GrayRoughMetal{ AddMaterial(Material_CookTorrence({.972f, .960f, .915f}, 1.f, 1.f)) };
+		const auto matCT_GrayMediumMetal{ AddMaterial(Material_CookTorrence({.972f, .960f, .915f}, 1.f, .6f)) };
+		const auto matCT_GraySmoothMetal{ AddMaterial(Material_CookTorrence({.972f, .960f, .915f}, 1.f, .1f)) };
+		const auto matCT_GrayRoughPlastic{ AddMaterial(Material_CookTorrence({.75f, .75f, .75f}, .0f, 1.f)) };
+		const auto matCT_GrayMediumPlastic{ AddMaterial(Material_CookTorrence({.75f, .75f, .75f}, .0f, .6f)) };
+		const auto matCT_GraySmoothPlastic{ AddMaterial(Material_CookTorrence({.75f, .75f, .75f}, .0f, .1f)) };
 
-		const auto matLambert_GrayBlue{ AddMaterial(new Material_Lambert({.49f, .57f, .57f}, 1.f)) };		
+		const auto matLambert_GrayBlue{ AddMaterial(Material_Lambert({.49f, .57f, .57f}, 1.f)) };		
 
 		//Planes
 		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue);
@@ -284,8 +712,8 @@ namespace dae {
 		m_Camera.fovAngle = 45.f;
 
 		//Materials
-		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ .49f, .57f, .57f }, 1.f));
-		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+		const auto matLambert_GrayBlue = AddMaterial(Material_Lambert({ .49f, .57f, .57f }, 1.f));
+		const auto matLambert_White = AddMaterial(Material_Lambert(colors::White, 1.f));
 
 		//planes
 		AddPlane(Vector3{ 0.f, 0.f, 10.f }, Vector3{ 0.f, 0.f, -1.f }, matLambert_GrayBlue); //back
@@ -359,15 +787,15 @@ namespace dae {
 		m_Camera.origin = { 0.f, 3.0f, -9.0f };
 		m_Camera.fovAngle = 45.f;
 
-		const auto matCT_GrayRoughMetal = AddMaterial(new Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 1.0f));
-		const auto matCT_GrayMediumMetal = AddMaterial(new Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 0.6f));
-		const auto matCT_GraySmoothMetal = AddMaterial(new Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 0.1f));
-		const auto matCT_GrayRoughPlastic = AddMaterial(new Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 1.f));
-		const auto matCT_GrayMediumPlastic = AddMaterial(new Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 0.6f));
-		const auto matCT_GraySmoothPlastic = AddMaterial(new Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 0.1f));
+		const auto matCT_GrayRoughMetal = AddMaterial(Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 1.0f));
+		const auto matCT_GrayMediumMetal = AddMaterial(Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 0.6f));
+		const auto matCT_GraySmoothMetal = AddMaterial(Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 0.1f));
+		const auto matCT_GrayRoughPlastic = AddMaterial(Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 1.f));
+		const auto matCT_GrayMediumPlastic = AddMaterial(Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 0.6f));
+		const auto matCT_GraySmoothPlastic = AddMaterial(Material_CookTorrence({ 0.75f, 0.75f, 0.75f }, 0.0f, 0.1f));
 
-		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.0f));
-		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+		const auto matLambert_GrayBlue = AddMaterial(Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.0f));
+		const auto matLambert_White = AddMaterial(Material_Lambert(colors::White, 1.f));
 
 		//Plane
 		AddPlane(Vector3{ 0.0f, 0.0f, 10.0f }, Vector3{ 0.0f, 0.0f, -1.0f }, matLambert_GrayBlue);; //Back
@@ -387,18 +815,21 @@ namespace dae {
 		const Triangle baseTriangle = { Vector3(-0.75f, 1.5f, 0.0f), Vector3(0.75f, 0.0f, 0.0f), Vector3(-0.75f, 0.0f, 0.0f) };
 
 		m_pMeshes[0] = AddTriangleMesh(TriangleCullMode::BackFaceCulling, matLambert_White);
+		m_pMeshes[0]->transformMode = MeshTransformMode::TransformRays;
 		m_pMeshes[0]->AppendTriangle(baseTriangle, true);
 		m_pMeshes[0]->Translate({ -1.75f, 4.5f, 0.0f });
 		m_pMeshes[0]->UpdateAABB();
 		m_pMeshes[0]->UpdateTransforms();
 
 		m_pMeshes[1] = AddTriangleMesh(TriangleCullMode::FrontFaceCulling, matLambert_White);
+		m_pMeshes[1]->transformMode = MeshTransformMode::TransformRays;
 		m_pMeshes[1]->AppendTriangle(baseTriangle, true);
 		m_pMeshes[1]->Translate({ 0.0f, 4.5f, 0.0f });
 		m_pMeshes[1]->UpdateAABB();
 		m_pMeshes[1]->UpdateTransforms();
 
 		m_pMeshes[2] = AddTriangleMesh(TriangleCullMode::NoCulling, matLambert_White);
+		m_pMeshes[2]->transformMode = MeshTransformMode::TransformRays;
 		m_pMeshes[2]->AppendTriangle(baseTriangle, true);
 		m_pMeshes[2]->Translate({ 1.75f, 4.5f, 0.0f });
 		m_pMeshes[2]->UpdateAABB();
@@ -417,7 +848,6 @@ namespace dae {
 		for (const auto m : m_pMeshes)
 		{
 			m->RotateY(yawAngle);
-			m->UpdateAABB();
 			m->UpdateTransforms();
 		}
 	}
@@ -428,8 +858,8 @@ namespace dae {
 		m_Camera.origin = { 0.f, 3.0f, -9.0f };
 		m_Camera.fovAngle = 45.f;
 
-		const auto matLambert_GrayBlue = AddMaterial(new Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.0f));
-		const auto matLambert_White = AddMaterial(new Material_Lambert(colors::White, 1.f));
+		const auto matLambert_GrayBlue = AddMaterial(Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.0f));
+		const auto matLambert_White = AddMaterial(Material_Lambert(colors::White, 1.f));
 
 		//Plane
 		AddPlane(Vector3{ 0.0f, 0.0f, 10.0f }, Vector3{ 0.0f, 0.0f, -1.0f }, matLambert_GrayBlue);; //Back
@@ -443,6 +873,10 @@ namespace dae {
 		Utils::ParseOBJ("Resources/lowpoly_bunny2.obj", pMesh->positions, pMesh->normals, pMesh->indices);
 
 		pMesh->Scale({ 2.f,2.f,2.f });
+		pMesh->transformMode = MeshTransformMode::TransformRays;
+		pMesh->bvhSettings.quality = BVHBuildQuality::High;
+		pMesh->bvhSettings.layout = BVHLayout::Wide4;
+		pMesh->pBVHCache = &m_BVHCache;
 
 		pMesh->UpdateAABB();
 		pMesh->UpdateTransforms();
@@ -459,10 +893,63 @@ namespace dae {
 
 		const auto yawAngle = (cosf(pTimer->GetTotal()) + 1.f) / 2.f * PI_2;
 		pMesh->RotateY(yawAngle);
-		pMesh->UpdateAABB();
 		pMesh->UpdateTransforms();
 	}
 
+	void Scene_W4_BunnyInstanceScene::Initialize()
+	{
+		sceneName = "Bunny Instance Scene";
+		m_Camera.origin = { 0.f, 3.0f, -9.0f };
+		m_Camera.fovAngle = 45.f;
+
+		const auto matLambert_GrayBlue = AddMaterial(Material_Lambert({ 0.49f, 0.57f, 0.57f }, 1.0f));
+		const auto matLambert_White = AddMaterial(Material_Lambert(colors::White, 1.f));
+		const auto matCT_GrayMediumMetal = AddMaterial(Material_CookTorrence({ 0.972f, 0.960f, 0.915f }, 1.0f, 0.6f));
+
+		//Plane
+		AddPlane(Vector3{ 0.0f, 0.0f, 10.0f }, Vector3{ 0.0f, 0.0f, -1.0f }, matLambert_GrayBlue);; //Back
+		AddPlane(Vector3{ 0.0f, 0.0f, 0.0f }, Vector3{ 0.0f, 1.0f, 0.0f }, matLambert_GrayBlue);; //Bottom
+
+		//One parsed bunny, placed m_GridSize * m_GridSize times
+		TriangleMesh* pBunny = AddSharedTriangleMesh(TriangleCullMode::BackFaceCulling);
+		Utils::ParseOBJ("Resources/lowpoly_bunny2.obj", pBunny->positions, pBunny->normals, pBunny->indices);
+		pBunny->bvhSettings.quality = BVHBuildQuality::High;
+		pBunny->bvhSettings.layout = BVHLayout::Wide4;
+		pBunny->pBVHCache = &m_BVHCache;
+		pBunny->UpdateTransforms();
+
+		constexpr float spacing{ 1.f };
+		for (int x{ 0 }; x < m_GridSize; ++x)
+		{
+			for (int z{ 0 }; z < m_GridSize; ++z)
+			{
+				TriangleMeshInstance* pInstance = AddTriangleMeshInstance(pBunny, (x + z) % 2 ? matLambert_White : matCT_GrayMediumMetal);
+				pInstance->Scale({ 0.6f, 0.6f, 0.6f });
+				pInstance->RotateY((x * m_GridSize + z) * 0.5f);
+				pInstance->Translate({ (x - m_GridSize / 2) * spacing, 0.f, z * spacing });
+				pInstance->UpdateTransforms();
+			}
+		}
+
+		//Light
+		AddPointLight(Vector3{ 0.0f, 5.0f, 5.0f }, 50.f, ColorRGB{ 1.0f, 0.61f, 0.45f }); // Backlight
+		AddPointLight(Vector3{ -2.5f, 5.0f, -5.0f }, 70.f, ColorRGB{ 1.0f, 0.8f, 0.45f }); // Frontlight left
+		AddPointLight(Vector3{ 2.5f, 2.5f, -5.0f }, 50.f, ColorRGB{ 0.34f, 0.47f, 0.68f });
+	}
+
+	void Scene_W4_BunnyInstanceScene::Update(Timer* pTimer)
+	{
+		Scene::Update(pTimer);
+
+		//Every instance spins, the shared geometry and its BVH never change
+		const auto yawAngle = (cosf(pTimer->GetTotal()) + 1.f) / 2.f * PI_2;
+		for (size_t i{}; i < m_TriangleMeshInstances.size(); ++i)
+		{
+			m_TriangleMeshInstances[i].RotateY(yawAngle + i * 0.5f);
+			m_TriangleMeshInstances[i].UpdateTransforms();
+		}
+	}
+
 #pragma endregion
 
 }
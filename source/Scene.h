@@ -1,20 +1,58 @@
 #pragma once
+#include <atomic>
 #include <string>
 #include <vector>
 
 #include "Math.h"
 #include "DataTypes.h"
 #include "Camera.h"
+#include "Material.h"
 
 namespace dae
 {
 	//Forward Declarations
 	class Timer;
-	class Material;
 	struct Plane;
 	struct Sphere;
 	struct Light;
 
+	enum class SceneObjectType : uint8_t
+	{
+		Sphere,
+		TriangleMesh,
+		TriangleMeshInstance
+	};
+
+	//Leaf entry of the top-level BVH, indexes into the geometry vector of its type
+	struct SceneObject
+	{
+		SceneObjectType type{};
+		uint32_t index{};
+	};
+
+	//Top-level object overlapping a frustum
+	struct VisibleObject
+	{
+		SceneObject object{};
+		uint32_t entryNode{}; //node the mesh BVH walk starts at (0 for spheres)
+		AABB bounds{}; //world space, lets a packet skip the object the frustum overlaps but its rays miss
+		float sqrDistance{}; //from the frustum origin to the object bounds
+	};
+
+	//What the rays inside a frustum can hit, nearest objects first so later ones test against a shorter ray, see Scene::CullFrustum
+	struct FrustumVisibility
+	{
+		std::vector<VisibleObject> objects{};
+	};
+
+	//Primitive that blocked a shadow ray: an object and, for meshes and instances, the TriangleSoA index in it
+	struct ShadowOccluder
+	{
+		SceneObject object{};
+		size_t triangleIndex{};
+		bool isValid{ false };
+	};
+
 	//Scene Base Class
 	class Scene
 	{
@@ -35,12 +73,45 @@ namespace dae
 
 		Camera& GetCamera() { return m_Camera; }
 		void GetClosestHit(const Ray& ray, HitRecord& closestHit) const;
+		//Closest hit of every active lane, the same hits GetClosestHit finds for each ray on its own
+		void GetClosestHit(RayPacket& packet, HitRecord(&closestHits)[RayPacket::laneCount]) const;
+		//Collects what rays inside frustum can hit, once for all of them
+		void CullFrustum(const Frustum& frustum, FrustumVisibility& visibility) const;
+		//Closest hit of a ray inside the frustum visibility was culled for, only tests what survived
+		void GetClosestHit(const Ray& ray, const FrustumVisibility& visibility, HitRecord& closestHit) const;
+		void GetClosestHit(RayPacket& packet, const FrustumVisibility& visibility, HitRecord(&closestHits)[RayPacket::laneCount]) const;
 		bool DoesHit(const Ray& ray) const;
+		//Shadow ray toward lights[lightIndex]: first tries the primitive that blocked the previous one on this thread
+		bool DoesHit(const Ray& ray, uint32_t lightIndex) const;
+
+		//Rebuilds (or refits) the top-level BVH over all bounded geometry, call after moving geometry
+		void UpdateTopLevelBVH();
+		//Switches the ray-triangle test of every mesh in the scene
+		void SetTriangleIntersectionKernel(TriangleIntersectionKernel kernel);
+		//Ray-triangle test of the first mesh, the one every mesh has after SetTriangleIntersectionKernel
+		TriangleIntersectionKernel GetTriangleIntersectionKernel() const;
+		//Rebuilds the BVH of every mesh in the scene with the given node layout
+		void SetMeshBVHLayout(BVHLayout layout);
+		//Node layout of the first mesh, the one every mesh has after SetMeshBVHLayout
+		BVHLayout GetMeshBVHLayout() const;
+		//Mesh BVH memory (nodes + primitive order) per triangle, over all meshes in the scene
+		float GetMeshBVHBytesPerTriangle() const;
+		//Writes the build time of the last mesh BVH builds, summed over all meshes in the scene
+		void PrintMeshBVHBuildStats() const;
+
+		void SetOccluderCacheEnabled(bool isEnabled) { m_IsOccluderCacheEnabled = isEnabled; }
+		bool IsOccluderCacheEnabled() const { return m_IsOccluderCacheEnabled; }
+		//Fraction of DoesHit(ray, lightIndex) calls answered by the occluder cache since the last reset
+		float GetOccluderCacheHitRate() const;
+		//Counts behind the hit rate, to combine the stats of several scenes
+		uint64_t GetOccluderCacheQueryCount() const { return m_OccluderCacheQueryCount.load(std::memory_order_relaxed); }
+		uint64_t GetOccluderCacheHitCount() const { return m_OccluderCacheHitCount.load(std::memory_order_relaxed); }
+		void ResetOccluderCacheStats();
 
 		const std::vector<Plane>& GetPlaneGeometries() const { return m_PlaneGeometries; }
 		const std::vector<Sphere>& GetSphereGeometries() const { return m_SphereGeometries; }
 		const std::vector<Light>& GetLights() const { return m_Lights; }
-		const std::vector<Material*> GetMaterials() const { return m_Materials; }
+		const std::vector<Material>& GetMaterials() const { return m_Materials; }
 
 	protected:
 		std::string	sceneName;
@@ -48,8 +119,23 @@ namespace dae
 		std::vector<Plane> m_PlaneGeometries{};
 		std::vector<Sphere> m_SphereGeometries{};
 		std::vector<TriangleMesh> m_TriangleMeshGeometries{};
+		std::vector<TriangleMesh*> m_SharedTriangleMeshes{};
+		std::vector<TriangleMeshInstance> m_TriangleMeshInstances{};
 		std::vector<Light> m_Lights{};
-		std::vector<Material*> m_Materials{};
+		//Flat table indexed by materialIndex, the default red material is entry 0
+		std::vector<Material> m_Materials{};
+
+		//Top-level acceleration structure over spheres and meshes, planes are unbounded and tested separately
+		std::vector<SceneObject> m_TopLevelObjects{};
+		BVH m_TopLevelBVH{};
+
+		//Mesh BVHs built by earlier runs, meshes opt in through TriangleMesh::pBVHCache
+		BVHCache m_BVHCache{ "Resources/BVHCache" };
+
+		//Every thread keeps its own last occluder per light, only the counters are shared
+		bool m_IsOccluderCacheEnabled{ true };
+		mutable std::atomic<uint64_t> m_OccluderCacheQueryCount{ 0 };
+		mutable std::atomic<uint64_t> m_OccluderCacheHitCount{ 0 };
 
 		//temp
 		/*std::vector<Triangle> m_Triangles{};*/
@@ -59,10 +145,26 @@ namespace dae
 		Sphere* AddSphere(const Vector3& origin, float radius, unsigned char materialIndex = 0);
 		Plane* AddPlane(const Vector3& origin, const Vector3& normal, unsigned char materialIndex = 0);
 		TriangleMesh* AddTriangleMesh(TriangleCullMode cullMode, unsigned char materialIndex = 0);
+		//Geometry that is only rendered through instances, call UpdateTransforms() once it is filled in
+		TriangleMesh* AddSharedTriangleMesh(TriangleCullMode cullMode);
+		TriangleMeshInstance* AddTriangleMeshInstance(const TriangleMesh* pMesh, unsigned char materialIndex = 0);
 
 		Light* AddPointLight(const Vector3& origin, float intensity, const ColorRGB& color);
 		Light* AddDirectionalLight(const Vector3& direction, float intensity, const ColorRGB& color);
-		unsigned char AddMaterial(Material* pMaterial);
+		unsigned char AddMaterial(const Material& material);
+
+	private:
+		//rootIndex is the mesh BVH node to start at, see FrustumVisibility
+		bool HitTest_SceneObject(const SceneObject& object, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false, uint32_t rootIndex = 0) const;
+		//Occlusion only, no hit record, occluderIndex is the blocking triangle of a mesh or instance
+		bool HitTest_SceneObject(const SceneObject& object, const Ray& ray, size_t& occluderIndex) const;
+		//Closest hit for the lanes in laneMask, returns the lanes that found a hit closer than packet.tMax
+		int HitTest_SceneObject(const SceneObject& object, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount], uint32_t rootIndex = 0) const;
+		AABB GetObjectBounds(const SceneObject& object) const;
+		//Finds any primitive blocking ray, occluder is left alone when there is none
+		bool FindOccluder(const Ray& ray, ShadowOccluder& occluder) const;
+		//Occlusion test against a single cached primitive
+		bool HitTest_Occluder(const ShadowOccluder& occluder, const Ray& ray) const;
 	};
 
 	//+++++++++++++++++++++++++++++++++++++++++
@@ -159,4 +261,20 @@ namespace dae
 	private:
 		TriangleMesh* pMesh{ nullptr };
 	};
+
+	class Scene_W4_BunnyInstanceScene final : public Scene
+	{
+	public:
+		Scene_W4_BunnyInstanceScene() = default;
+
+		Scene_W4_BunnyInstanceScene(const Scene_W4_BunnyInstanceScene&) = delete;
+		Scene_W4_BunnyInstanceScene(Scene_W4_BunnyInstanceScene&&) noexcept = delete;
+		Scene_W4_BunnyInstanceScene& operator=(const Scene_W4_BunnyInstanceScene&) = delete;
+		Scene_W4_BunnyInstanceScene& operator=(Scene_W4_BunnyInstanceScene&&) noexcept = delete;
+
+		void Initialize() override;
+		void Update(Timer* pTimer) override;
+	private:
+		static constexpr int m_GridSize{ 10 };
+	};
 }
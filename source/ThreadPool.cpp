@@ -0,0 +1,139 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+namespace dae
+{
+	namespace
+	{
+		uint32_t GetPoolThreadCount(uint32_t threadCount)
+		{
+			return threadCount > 0 ? threadCount : std::max(std::thread::hardware_concurrency(), 1u);
+		}
+	}
+
+	ThreadPool::ThreadPool(uint32_t threadCount)
+		: m_Queues(GetPoolThreadCount(threadCount))
+	{
+		m_Workers.reserve(m_Queues.size() - 1);
+		for (uint32_t queueIndex{ 1 }; queueIndex < m_Queues.size(); ++queueIndex)
+		{
+			m_Workers.emplace_back([this, queueIndex]() { WorkerLoop(queueIndex); });
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			m_IsStopping = true;
+		}
+		m_WorkCondition.notify_all();
+
+		for (std::thread& worker : m_Workers)
+		{
+			worker.join();
+		}
+	}
+
+	void ThreadPool::ParallelFor(uint32_t count, const std::function<void(uint32_t)>& task)
+	{
+		if (count == 0)
+		{
+			return;
+		}
+
+		m_pTask = &task;
+		m_PendingTaskCount.store(count, std::memory_order_relaxed);
+
+		//Contiguous ranges, neighbouring tasks (such as neighbouring tiles) tend to touch the same data
+		const uint64_t queueCount{ m_Queues.size() };
+		for (uint64_t queueIndex{ 0 }; queueIndex < queueCount; ++queueIndex)
+		{
+			WorkQueue& queue{ m_Queues[queueIndex] };
+			std::lock_guard<std::mutex> lock{ queue.mutex };
+			queue.begin = static_cast<uint32_t>(queueIndex * count / queueCount);
+			queue.end = static_cast<uint32_t>((queueIndex + 1) * count / queueCount);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock{ m_Mutex };
+			++m_Generation;
+		}
+		m_WorkCondition.notify_all();
+
+		RunTasks(0);
+
+		std::unique_lock<std::mutex> lock{ m_Mutex };
+		m_DoneCondition.wait(lock, [this]() { return m_PendingTaskCount.load(std::memory_order_acquire) == 0; });
+	}
+
+	void ThreadPool::WorkerLoop(uint32_t queueIndex)
+	{
+		uint64_t seenGeneration{ 0 };
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock{ m_Mutex };
+				m_WorkCondition.wait(lock, [&]() { return m_IsStopping || m_Generation != seenGeneration; });
+				if (m_IsStopping)
+				{
+					return;
+				}
+				seenGeneration = m_Generation;
+			}
+
+			RunTasks(queueIndex);
+		}
+	}
+
+	void ThreadPool::RunTasks(uint32_t queueIndex)
+	{
+		uint32_t taskIndex{};
+		while (PopTask(queueIndex, taskIndex) || StealTask(queueIndex, taskIndex))
+		{
+			(*m_pTask)(taskIndex);
+
+			//The last task wakes ParallelFor, under the lock so the wake up cannot slip in between its check and its wait
+			if (m_PendingTaskCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				std::lock_guard<std::mutex> lock{ m_Mutex };
+				m_DoneCondition.notify_all();
+			}
+		}
+	}
+
+	bool ThreadPool::PopTask(uint32_t queueIndex, uint32_t& taskIndex)
+	{
+		WorkQueue& queue{ m_Queues[queueIndex] };
+		std::lock_guard<std::mutex> lock{ queue.mutex };
+		if (queue.begin == queue.end)
+		{
+			return false;
+		}
+
+		taskIndex = queue.begin++;
+		return true;
+	}
+
+	bool ThreadPool::StealTask(uint32_t thiefIndex, uint32_t& taskIndex)
+	{
+		//Victims in a different order per thief, so idle threads do not all pile onto the same queue
+		const uint32_t queueCount{ static_cast<uint32_t>(m_Queues.size()) };
+		for (uint32_t offset{ 1 }; offset < queueCount; ++offset)
+		{
+			WorkQueue& queue{ m_Queues[(thiefIndex + offset) % queueCount] };
+			std::lock_guard<std::mutex> lock{ queue.mutex };
+			if (queue.begin == queue.end)
+			{
+				continue;
+			}
+
+			//From the back, away from where the owner is working
+			taskIndex = --queue.end;
+			m_StolenTaskCount.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		return false;
+	}
+}
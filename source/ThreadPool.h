@@ -0,0 +1,67 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dae
+{
+	/**
+	 * \brief Worker threads that live as long as the pool, so frames do not pay for starting threads.
+	 * ParallelFor hands every thread a contiguous range of the task indices. Each thread works through its
+	 * own range from the front and, once it runs dry, steals single tasks from the back of the others, so
+	 * uneven tasks (such as tiles over complex geometry) still keep every thread busy.
+	 * The thread calling ParallelFor works along and is counted in GetThreadCount().
+	 */
+	class ThreadPool final
+	{
+	public:
+		//0 uses every hardware thread, 1 runs every task on the calling thread
+		explicit ThreadPool(uint32_t threadCount = 0);
+		~ThreadPool();
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool(ThreadPool&&) noexcept = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		ThreadPool& operator=(ThreadPool&&) noexcept = delete;
+
+		//Calls task(index) for every index in [0, count), returns once all calls are done
+		//Not reentrant: tasks must not call ParallelFor on the same pool
+		void ParallelFor(uint32_t count, const std::function<void(uint32_t)>& task);
+
+		uint32_t GetThreadCount() const { return static_cast<uint32_t>(m_Queues.size()); }
+		//Tasks run by another thread than the one they were handed to, since the pool was created
+		uint64_t GetStolenTaskCount() const { return m_StolenTaskCount.load(std::memory_order_relaxed); }
+
+	private:
+		//Task indices [begin, end) not started yet, the owner takes from begin and thieves from end
+		struct alignas(64) WorkQueue
+		{
+			std::mutex mutex{};
+			uint32_t begin{};
+			uint32_t end{};
+		};
+
+		std::vector<WorkQueue> m_Queues; //one per thread, the calling thread uses queue 0
+		std::vector<std::thread> m_Workers{};
+
+		//Set before the indices are handed out, threads read it only after taking an index
+		const std::function<void(uint32_t)>* m_pTask{ nullptr };
+		std::atomic<uint32_t> m_PendingTaskCount{ 0 };
+		std::atomic<uint64_t> m_StolenTaskCount{ 0 };
+
+		std::mutex m_Mutex{};
+		std::condition_variable m_WorkCondition{};
+		std::condition_variable m_DoneCondition{};
+		uint64_t m_Generation{ 0 }; //bumped by every ParallelFor to wake the workers
+		bool m_IsStopping{ false };
+
+		void WorkerLoop(uint32_t queueIndex);
+		void RunTasks(uint32_t queueIndex);
+		bool PopTask(uint32_t queueIndex, uint32_t& taskIndex);
+		bool StealTask(uint32_t thiefIndex, uint32_t& taskIndex);
+	};
+}
@@ -0,0 +1,305 @@
+#pragma once
+#include <cmath>
+#include <utility>
+
+#include "Math.h"
+#include "DataTypes.h"
+
+namespace dae
+{
+	/**
+	 * Ray-triangle intersection kernels working on TriangleSoA.
+	 * Every kernel exposes the same interface so the mesh hit loop can be instantiated per kernel:
+	 *  - Kernel(const Ray& ray): per-ray setup
+	 *  - bool Intersect(const TriangleSoA& triangles, size_t index, const Ray& ray, float& t) const:
+	 *    true when the ray hits inside (ray.min, ray.max), t is the hit distance
+	 * Culling is not part of the kernels, see IsTriangleCulled.
+	 */
+	namespace TriangleKernels
+	{
+		//Uses the stored normal, shadow rays travel away from the surface so they cull the opposite side
+		inline bool IsTriangleCulled(const TriangleSoA& triangles, size_t index, TriangleCullMode cullMode, const Vector3& direction, bool isShadowRay)
+		{
+			const float dotNormalViewRay{ triangles.normalx[index] * direction.x + triangles.normaly[index] * direction.y + triangles.normalz[index] * direction.z };
+			const float facing{ isShadowRay ? -dotNormalViewRay : dotNormalViewRay };
+
+			return (cullMode == TriangleCullMode::BackFaceCulling && facing > 0) ||
+				(cullMode == TriangleCullMode::FrontFaceCulling && facing < 0) ||
+				dotNormalViewRay == 0.f;
+		}
+
+#pragma region EdgeTests
+		//Plane intersection followed by three edge/cross product tests (original HitTest_Triangle)
+		struct EdgeTests
+		{
+			explicit EdgeTests(const Ray&) {}
+
+			bool Intersect(const TriangleSoA& triangles, size_t index, const Ray& ray, float& t) const
+			{
+				const Vector3 normal{ triangles.normalx[index], triangles.normaly[index], triangles.normalz[index] };
+				const Vector3 v0{ triangles.v0x[index], triangles.v0y[index], triangles.v0z[index] };
+				const Vector3 edge1{ triangles.edge1x[index], triangles.edge1y[index], triangles.edge1z[index] };
+				const Vector3 edge2{ triangles.edge2x[index], triangles.edge2y[index], triangles.edge2z[index] };
+
+				const Vector3 originToV0{ v0 - ray.origin };
+				t = Vector3::Dot(originToV0, normal) / Vector3::Dot(normal, ray.direction);
+				if (!(t > ray.min && t < ray.max))
+				{
+					return false;
+				}
+
+				const Vector3 v0ToHitPoint{ t * ray.direction - originToV0 };
+				if (Vector3::Dot(Vector3::Cross(edge1, v0ToHitPoint), normal) < 0)
+				{
+					return false;
+				}
+
+				if (Vector3::Dot(Vector3::Cross(edge2 - edge1, v0ToHitPoint - edge1), normal) < 0)
+				{
+					return false;
+				}
+
+				return Vector3::Dot(Vector3::Cross(edge2, v0ToHitPoint), normal) <= 0;
+			}
+		};
+#pragma endregion
+
+#pragma region MollerTrumbore
+		//Moller-Trumbore: barycentrics and t straight from the edges, no plane intersection
+		struct MollerTrumbore
+		{
+			explicit MollerTrumbore(const Ray&) {}
+
+			bool Intersect(const TriangleSoA& triangles, size_t index, const Ray& ray, float& t) const
+			{
+				const Vector3 edge1{ triangles.edge1x[index], triangles.edge1y[index], triangles.edge1z[index] };
+				const Vector3 edge2{ triangles.edge2x[index], triangles.edge2y[index], triangles.edge2z[index] };
+
+				const Vector3 p{ Vector3::Cross(ray.direction, edge2) };
+				const float determinant{ Vector3::Dot(edge1, p) };
+				if (determinant == 0.f)
+				{
+					return false;
+				}
+				const float inverseDeterminant{ 1.f / determinant };
+
+				const Vector3 s{ ray.origin.x - triangles.v0x[index], ray.origin.y - triangles.v0y[index], ray.origin.z - triangles.v0z[index] };
+				const float u{ Vector3::Dot(s, p) * inverseDeterminant };
+				if (u < 0.f || u > 1.f)
+				{
+					return false;
+				}
+
+				const Vector3 q{ Vector3::Cross(s, edge1) };
+				const float v{ Vector3::Dot(ray.direction, q) * inverseDeterminant };
+				if (v < 0.f || u + v > 1.f)
+				{
+					return false;
+				}
+
+				t = Vector3::Dot(edge2, q) * inverseDeterminant;
+				return t > ray.min && t < ray.max;
+			}
+		};
+#pragma endregion
+
+#pragma region Watertight
+		/**
+		 * Woop, Benthin and Wald watertight test: shears the triangle into ray space so shared edges
+		 * are evaluated with the exact same arithmetic from both sides.
+		 * Needs the original vertices, see TriangleSoA::SetKernelData.
+		 */
+		struct Watertight
+		{
+			explicit Watertight(const Ray& ray)
+			{
+				const Vector3 absDirection{ std::abs(ray.direction.x), std::abs(ray.direction.y), std::abs(ray.direction.z) };
+				kz = absDirection.x > absDirection.y ? (absDirection.x > absDirection.z ? 0 : 2) : (absDirection.y > absDirection.z ? 1 : 2);
+				kx = (kz + 1) % 3;
+				ky = (kx + 1) % 3;
+
+				//Keep the winding of the triangle when looking down the negative axis
+				if (ray.direction[kz] < 0.f)
+				{
+					std::swap(kx, ky);
+				}
+
+				shearX = ray.direction[kx] / ray.direction[kz];
+				shearY = ray.direction[ky] / ray.direction[kz];
+				shearZ = 1.f / ray.direction[kz];
+			}
+
+			bool Intersect(const TriangleSoA& triangles, size_t index, const Ray& ray, float& t) const
+			{
+				const float* pKernelData{ &triangles.kernelData[index * triangles.kernelDataStride] };
+
+				const Vector3 a{ Vector3{ triangles.v0x[index], triangles.v0y[index], triangles.v0z[index] } - ray.origin };
+				const Vector3 b{ Vector3{ pKernelData[0], pKernelData[1], pKernelData[2] } - ray.origin };
+				const Vector3 c{ Vector3{ pKernelData[3], pKernelData[4], pKernelData[5] } - ray.origin };
+
+				const float ax{ a[kx] - shearX * a[kz] };
+				const float ay{ a[ky] - shearY * a[kz] };
+				const float bx{ b[kx] - shearX * b[kz] };
+				const float by{ b[ky] - shearY * b[kz] };
+				const float cx{ c[kx] - shearX * c[kz] };
+				const float cy{ c[ky] - shearY * c[kz] };
+
+				float u{ cx * by - cy * bx };
+				float v{ ax * cy - ay * cx };
+				float w{ bx * ay - by * ax };
+
+				//Fall back to double precision on an edge so neighbouring triangles agree
+				if (u == 0.f || v == 0.f || w == 0.f)
+				{
+					u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+					v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+					w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+				}
+
+				if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+				{
+					return false;
+				}
+
+				const float determinant{ u + v + w };
+				if (determinant == 0.f)
+				{
+					return false;
+				}
+
+				const float scaledT{ u * shearZ * a[kz] + v * shearZ * b[kz] + w * shearZ * c[kz] };
+				t = scaledT / determinant;
+				return t > ray.min && t < ray.max;
+			}
+
+			int kx{};
+			int ky{};
+			int kz{};
+			float shearX{};
+			float shearY{};
+			float shearZ{};
+		};
+#pragma endregion
+
+#pragma region PrecomputedAffine
+		/**
+		 * Baldwin and Weber: a per-triangle affine transform maps the triangle onto the unit triangle
+		 * in the z = 0 plane, the test is then one 3x4 transform of the ray and a 2D check.
+		 * The 3x4 world to triangle space matrix comes from TriangleSoA::SetKernelData.
+		 */
+		struct PrecomputedAffine
+		{
+			explicit PrecomputedAffine(const Ray&) {}
+
+			bool Intersect(const TriangleSoA& triangles, size_t index, const Ray& ray, float& t) const
+			{
+				const float* m{ &triangles.kernelData[index * triangles.kernelDataStride] };
+
+				const float originZ{ m[8] * ray.origin.x + m[9] * ray.origin.y + m[10] * ray.origin.z + m[11] };
+				const float directionZ{ m[8] * ray.direction.x + m[9] * ray.direction.y + m[10] * ray.direction.z };
+
+				t = -originZ / directionZ;
+				if (!(t > ray.min && t < ray.max))
+				{
+					return false;
+				}
+
+				const Vector3 hitPoint{ ray.origin + t * ray.direction };
+				const float u{ m[0] * hitPoint.x + m[1] * hitPoint.y + m[2] * hitPoint.z + m[3] };
+				const float v{ m[4] * hitPoint.x + m[5] * hitPoint.y + m[6] * hitPoint.z + m[7] };
+
+				return u >= 0.f && v >= 0.f && u + v <= 1.f;
+			}
+		};
+#pragma endregion
+
+#pragma region Packet
+		inline __m128 Dot4(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+		{
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+		}
+
+		inline __m128 CrossComponent4(__m128 a1, __m128 b2, __m128 a2, __m128 b1)
+		{
+			return _mm_sub_ps(_mm_mul_ps(a1, b2), _mm_mul_ps(a2, b1));
+		}
+
+		/**
+		 * Moller-Trumbore of one triangle against the four rays of a packet, one ray per lane, SSE2 only.
+		 * Same arithmetic and culling as IntersectMollerTrumbore8 for camera rays, so every lane gets the t its scalar ray would.
+		 * Returns the lanes that hit inside (packet.tMin, packet.tMax), t holds their hit distances.
+		 */
+		inline __m128 IntersectMollerTrumbore4(const TriangleSoA& triangles, size_t index, TriangleCullMode cullMode, const RayPacket& packet, __m128& t)
+		{
+			const __m128 zero{ _mm_setzero_ps() };
+			const __m128 one{ _mm_set1_ps(1.f) };
+
+			const __m128 dotNormalViewRay{ Dot4(_mm_set1_ps(triangles.normalx[index]), _mm_set1_ps(triangles.normaly[index]), _mm_set1_ps(triangles.normalz[index]),
+				packet.directionX, packet.directionY, packet.directionZ) };
+
+			__m128 valid{ _mm_cmpneq_ps(dotNormalViewRay, zero) };
+			if (cullMode == TriangleCullMode::BackFaceCulling)
+			{
+				valid = _mm_andnot_ps(_mm_cmpgt_ps(dotNormalViewRay, zero), valid);
+			}
+			else if (cullMode == TriangleCullMode::FrontFaceCulling)
+			{
+				valid = _mm_andnot_ps(_mm_cmplt_ps(dotNormalViewRay, zero), valid);
+			}
+
+			if (_mm_movemask_ps(valid) == 0)
+			{
+				return valid;
+			}
+
+			const __m128 edge1X{ _mm_set1_ps(triangles.edge1x[index]) };
+			const __m128 edge1Y{ _mm_set1_ps(triangles.edge1y[index]) };
+			const __m128 edge1Z{ _mm_set1_ps(triangles.edge1z[index]) };
+			const __m128 edge2X{ _mm_set1_ps(triangles.edge2x[index]) };
+			const __m128 edge2Y{ _mm_set1_ps(triangles.edge2y[index]) };
+			const __m128 edge2Z{ _mm_set1_ps(triangles.edge2z[index]) };
+
+			//p = direction x edge2
+			const __m128 pX{ CrossComponent4(packet.directionY, edge2Z, packet.directionZ, edge2Y) };
+			const __m128 pY{ CrossComponent4(packet.directionZ, edge2X, packet.directionX, edge2Z) };
+			const __m128 pZ{ CrossComponent4(packet.directionX, edge2Y, packet.directionY, edge2X) };
+
+			const __m128 determinant{ Dot4(edge1X, edge1Y, edge1Z, pX, pY, pZ) };
+			valid = _mm_and_ps(valid, _mm_cmpneq_ps(determinant, zero));
+			const __m128 inverseDeterminant{ _mm_div_ps(one, determinant) };
+
+			const __m128 sX{ _mm_sub_ps(packet.originX, _mm_set1_ps(triangles.v0x[index])) };
+			const __m128 sY{ _mm_sub_ps(packet.originY, _mm_set1_ps(triangles.v0y[index])) };
+			const __m128 sZ{ _mm_sub_ps(packet.originZ, _mm_set1_ps(triangles.v0z[index])) };
+
+			const __m128 u{ _mm_mul_ps(Dot4(sX, sY, sZ, pX, pY, pZ), inverseDeterminant) };
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+			//q = s x edge1
+			const __m128 qX{ CrossComponent4(sY, edge1Z, sZ, edge1Y) };
+			const __m128 qY{ CrossComponent4(sZ, edge1X, sX, edge1Z) };
+			const __m128 qZ{ CrossComponent4(sX, edge1Y, sY, edge1X) };
+
+			const __m128 v{ _mm_mul_ps(Dot4(packet.directionX, packet.directionY, packet.directionZ, qX, qY, qZ), inverseDeterminant) };
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+			t = _mm_mul_ps(Dot4(edge2X, edge2Y, edge2Z, qX, qY, qZ), inverseDeterminant);
+			return _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, packet.tMin), _mm_cmplt_ps(t, packet.tMax)));
+		}
+#pragma endregion
+
+#pragma region AVX2
+		//True when the CPU (and OS) support AVX2, checked once
+		bool IsAVX2Supported();
+
+		/**
+		 * Moller-Trumbore against triangles [first, first + count), 8 per step with AVX2.
+		 * Culling follows IsTriangleCulled. Only call when IsAVX2Supported() is true.
+		 * Returns true on a hit inside (ray.min, ray.max): t and hitIndex belong to the closest one,
+		 * shadow rays stop at the first hit.
+		 */
+		bool IntersectMollerTrumbore8(const TriangleSoA& triangles, size_t first, size_t count, TriangleCullMode cullMode,
+			const Ray& ray, bool isShadowRay, float& t, size_t& hitIndex);
+#pragma endregion
+	}
+}
@@ -0,0 +1,193 @@
+#include "TriangleKernels.h"
+
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//MSVC emits AVX2 intrinsics as they are, GCC and Clang need them enabled per function
+#if defined(__GNUC__) || defined(__clang__)
+#define AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define AVX2_TARGET
+#endif
+
+namespace dae
+{
+	namespace TriangleKernels
+	{
+		namespace
+		{
+			bool DetectAVX2()
+			{
+#if defined(_MSC_VER)
+				int cpuInfo[4]{};
+				__cpuid(cpuInfo, 0);
+				if (cpuInfo[0] < 7)
+				{
+					return false;
+				}
+
+				//OSXSAVE + AVX, and the OS has to save the YMM registers on a context switch
+				__cpuid(cpuInfo, 1);
+				const bool hasOSXSave{ (cpuInfo[2] & (1 << 27)) != 0 };
+				const bool hasAVX{ (cpuInfo[2] & (1 << 28)) != 0 };
+				if (!hasOSXSave || !hasAVX || (_xgetbv(0) & 0x6) != 0x6)
+				{
+					return false;
+				}
+
+				__cpuidex(cpuInfo, 7, 0);
+				return (cpuInfo[1] & (1 << 5)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+				__builtin_cpu_init();
+				return __builtin_cpu_supports("avx2");
+#else
+				return false;
+#endif
+			}
+
+			AVX2_TARGET inline __m256 Load8(const std::vector<float>& component, size_t index)
+			{
+				return _mm256_loadu_ps(component.data() + index);
+			}
+
+			AVX2_TARGET inline __m256 Dot8(__m256 ax, __m256 ay, __m256 az, __m256 bx, __m256 by, __m256 bz)
+			{
+				return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ax, bx), _mm256_mul_ps(ay, by)), _mm256_mul_ps(az, bz));
+			}
+
+			AVX2_TARGET inline __m256 CrossComponent8(__m256 a1, __m256 b2, __m256 a2, __m256 b1)
+			{
+				return _mm256_sub_ps(_mm256_mul_ps(a1, b2), _mm256_mul_ps(a2, b1));
+			}
+
+			AVX2_TARGET inline float HorizontalMin8(__m256 values)
+			{
+				__m128 minimum{ _mm_min_ps(_mm256_castps256_ps128(values), _mm256_extractf128_ps(values, 1)) };
+				minimum = _mm_min_ps(minimum, _mm_movehl_ps(minimum, minimum));
+				minimum = _mm_min_ss(minimum, _mm_shuffle_ps(minimum, minimum, 1));
+				return _mm_cvtss_f32(minimum);
+			}
+		}
+
+		bool IsAVX2Supported()
+		{
+			static const bool isSupported{ DetectAVX2() };
+			return isSupported;
+		}
+
+		AVX2_TARGET bool IntersectMollerTrumbore8(const TriangleSoA& triangles, size_t first, size_t count, TriangleCullMode cullMode,
+			const Ray& ray, bool isShadowRay, float& t, size_t& hitIndex)
+		{
+			const __m256 directionX{ _mm256_set1_ps(ray.direction.x) };
+			const __m256 directionY{ _mm256_set1_ps(ray.direction.y) };
+			const __m256 directionZ{ _mm256_set1_ps(ray.direction.z) };
+			const __m256 originX{ _mm256_set1_ps(ray.origin.x) };
+			const __m256 originY{ _mm256_set1_ps(ray.origin.y) };
+			const __m256 originZ{ _mm256_set1_ps(ray.origin.z) };
+			const __m256 tMin{ _mm256_set1_ps(ray.min) };
+
+			const __m256 zero{ _mm256_setzero_ps() };
+			const __m256 one{ _mm256_set1_ps(1.f) };
+			const __m256 infinity{ _mm256_set1_ps(INFINITY) };
+			const __m256 signMask{ _mm256_set1_ps(-0.f) };
+			const __m256i laneIndices{ _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7) };
+
+			float closestT{ ray.max };
+			bool didHit{ false };
+
+			const size_t last{ first + count };
+			for (size_t base{ first }; base < last; base += TriangleSoA::packetWidth)
+			{
+				//Lanes past the end of the range read padding and are masked off
+				const int laneCount{ static_cast<int>(std::min(last - base, TriangleSoA::packetWidth)) };
+				__m256 valid{ _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(laneCount), laneIndices)) };
+
+				//Culling, the normal faces the other way for shadow rays
+				const __m256 dotNormalViewRay{ Dot8(Load8(triangles.normalx, base), Load8(triangles.normaly, base), Load8(triangles.normalz, base),
+					directionX, directionY, directionZ) };
+				const __m256 facing{ isShadowRay ? _mm256_xor_ps(dotNormalViewRay, signMask) : dotNormalViewRay };
+
+				valid = _mm256_and_ps(valid, _mm256_cmp_ps(dotNormalViewRay, zero, _CMP_NEQ_OQ));
+				if (cullMode == TriangleCullMode::BackFaceCulling)
+				{
+					valid = _mm256_andnot_ps(_mm256_cmp_ps(facing, zero, _CMP_GT_OQ), valid);
+				}
+				else if (cullMode == TriangleCullMode::FrontFaceCulling)
+				{
+					valid = _mm256_andnot_ps(_mm256_cmp_ps(facing, zero, _CMP_LT_OQ), valid);
+				}
+
+				if (_mm256_movemask_ps(valid) == 0)
+				{
+					continue;
+				}
+
+				const __m256 edge1X{ Load8(triangles.edge1x, base) };
+				const __m256 edge1Y{ Load8(triangles.edge1y, base) };
+				const __m256 edge1Z{ Load8(triangles.edge1z, base) };
+				const __m256 edge2X{ Load8(triangles.edge2x, base) };
+				const __m256 edge2Y{ Load8(triangles.edge2y, base) };
+				const __m256 edge2Z{ Load8(triangles.edge2z, base) };
+
+				//p = direction x edge2
+				const __m256 pX{ CrossComponent8(directionY, edge2Z, directionZ, edge2Y) };
+				const __m256 pY{ CrossComponent8(directionZ, edge2X, directionX, edge2Z) };
+				const __m256 pZ{ CrossComponent8(directionX, edge2Y, directionY, edge2X) };
+
+				const __m256 determinant{ Dot8(edge1X, edge1Y, edge1Z, pX, pY, pZ) };
+				valid = _mm256_and_ps(valid, _mm256_cmp_ps(determinant, zero, _CMP_NEQ_OQ));
+				const __m256 inverseDeterminant{ _mm256_div_ps(one, determinant) };
+
+				const __m256 sX{ _mm256_sub_ps(originX, Load8(triangles.v0x, base)) };
+				const __m256 sY{ _mm256_sub_ps(originY, Load8(triangles.v0y, base)) };
+				const __m256 sZ{ _mm256_sub_ps(originZ, Load8(triangles.v0z, base)) };
+
+				const __m256 u{ _mm256_mul_ps(Dot8(sX, sY, sZ, pX, pY, pZ), inverseDeterminant) };
+				valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+
+				//q = s x edge1
+				const __m256 qX{ CrossComponent8(sY, edge1Z, sZ, edge1Y) };
+				const __m256 qY{ CrossComponent8(sZ, edge1X, sX, edge1Z) };
+				const __m256 qZ{ CrossComponent8(sX, edge1Y, sY, edge1X) };
+
+				const __m256 v{ _mm256_mul_ps(Dot8(directionX, directionY, directionZ, qX, qY, qZ), inverseDeterminant) };
+				valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+
+				const __m256 hitT{ _mm256_mul_ps(Dot8(edge2X, edge2Y, edge2Z, qX, qY, qZ), inverseDeterminant) };
+				valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(hitT, tMin, _CMP_GT_OQ), _mm256_cmp_ps(hitT, _mm256_set1_ps(closestT), _CMP_LT_OQ)));
+
+				const int validMask{ _mm256_movemask_ps(valid) };
+				if (validMask == 0)
+				{
+					continue;
+				}
+
+				//Closest lane of this packet, the lowest index wins ties like the scalar loop
+				const __m256 maskedT{ _mm256_blendv_ps(infinity, hitT, valid) };
+				const float packetClosestT{ HorizontalMin8(maskedT) };
+				const int closestMask{ _mm256_movemask_ps(_mm256_cmp_ps(maskedT, _mm256_set1_ps(packetClosestT), _CMP_EQ_OQ)) & validMask };
+
+#if defined(_MSC_VER)
+				unsigned long closestLane{};
+				_BitScanForward(&closestLane, static_cast<unsigned long>(closestMask));
+#else
+				const int closestLane{ __builtin_ctz(static_cast<unsigned>(closestMask)) };
+#endif
+
+				closestT = packetClosestT;
+				hitIndex = base + closestLane;
+				didHit = true;
+
+				if (isShadowRay)
+				{
+					break;
+				}
+			}
+
+			t = closestT;
+			return didHit;
+		}
+	}
+}
@@ -1,8 +1,15 @@
 #pragma once
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <utility>
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 #include "Math.h"
 #include "DataTypes.h"
+#include "TriangleKernels.h"
 
 namespace dae
 {
@@ -186,77 +193,1232 @@ namespace dae
 			return HitTest_Triangle(triangle, ray, temp, true);
 		}
 #pragma endregion
-#pragma region TriangeMesh HitTest
+#pragma region BVH HitTest
+		//Order in which a traversal visits the children the ray hits
+		enum class TraversalOrder
+		{
+			NearestFirst,	//closest hit: a near hit shrinks ray.max, which culls the farther children
+			LargestFirst	//occlusion: any hit ends the walk, and the biggest boxes are the likeliest to hold one
+		};
 
-		inline bool SlabTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
+		//Half the surface area of a node, enough to compare two boxes
+		inline float GetHalfArea(const BVHNode& node)
 		{
-			const Vector3 inversedDirection = { 1.f / ray.direction.x,1.f / ray.direction.y,1.f / ray.direction.z };
-			const float tx1 = (mesh.transformedMinAABB.x - ray.origin.x) * inversedDirection.x;
-			const float tx2 = (mesh.transformedMaxAABB.x - ray.origin.x) * inversedDirection.x;
+			const float extentX{ node.maxAABB.x - node.minAABB.x };
+			const float extentY{ node.maxAABB.y - node.minAABB.y };
+			const float extentZ{ node.maxAABB.z - node.minAABB.z };
+			return extentX * extentY + extentY * extentZ + extentZ * extentX;
+		}
+
+		//AABB / BVH HIT-TESTS
+		inline bool SlabTest_AABB(const Vector3& minAABB, const Vector3& maxAABB, const Ray& ray, const Vector3& inversedDirection, float& tEntry)
+		{
+			const float tx1 = (minAABB.x - ray.origin.x) * inversedDirection.x;
+			const float tx2 = (maxAABB.x - ray.origin.x) * inversedDirection.x;
 
 			float tmin = std::min(tx1, tx2);
 			float tmax = std::max(tx1, tx2);
 
-			const float ty1 = (mesh.transformedMinAABB.y - ray.origin.y) * inversedDirection.y;
-			const float ty2 = (mesh.transformedMaxAABB.y - ray.origin.y) * inversedDirection.y;
+			const float ty1 = (minAABB.y - ray.origin.y) * inversedDirection.y;
+			const float ty2 = (maxAABB.y - ray.origin.y) * inversedDirection.y;
 
 			tmin = std::max(tmin, std::min(ty1, ty2));
 			tmax = std::min(tmax, std::max(ty1, ty2));
 
-			const float tz1 = (mesh.transformedMinAABB.z - ray.origin.z) * inversedDirection.z;
-			const float tz2 = (mesh.transformedMaxAABB.z - ray.origin.z) * inversedDirection.z;
+			const float tz1 = (minAABB.z - ray.origin.z) * inversedDirection.z;
+			const float tz2 = (maxAABB.z - ray.origin.z) * inversedDirection.z;
 
 			tmin = std::max(tmin, std::min(tz1, tz2));
 			tmax = std::min(tmax, std::max(tz1, tz2));
 
-			return tmax > 0 && tmax >= tmin;
+			tEntry = tmin;
+			return tmax > 0 && tmax >= tmin && tmin < ray.max;
 		}
 
-		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false)
+		/**
+		 * \brief Walks a BVH in the given order (front to back by default), skipping nodes the ray enters beyond ray.max
+		 * \param nodes BVH nodes, root at index 0
+		 * \param ray ray to trace, the leaf intersector shrinks ray.max when it finds a closer hit
+		 * \param anyHit stop at the first leaf that reports a hit
+		 * \param intersectLeaf bool(const BVHNode&), tests the primitives of a leaf and returns whether one was hit
+		 * \param rootIndex node to start at, see FindEntryNode
+		 * \return whether any leaf reported a hit
+		 */
+		template<TraversalOrder order = TraversalOrder::NearestFirst, typename LeafIntersector>
+		inline bool TraverseBVH(const std::vector<BVHNode>& nodes, Ray& ray, bool anyHit, LeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
 		{
-			//todo W5
-			//assert(false && "No Implemented Yet!");
+			if (nodes.empty())
+			{
+				return false;
+			}
+
+			const Vector3 inversedDirection = { 1.f / ray.direction.x,1.f / ray.direction.y,1.f / ray.direction.z };
 
-			if (!SlabTest_TriangleMesh(mesh, ray))
+			float tEntry{};
+			if (!SlabTest_AABB(nodes[rootIndex].minAABB, nodes[rootIndex].maxAABB, ray, inversedDirection, tEntry))
 			{
 				return false;
 			}
 
-			if (mesh.indices.size() % 3)
+			//Pending nodes together with the distance at which the ray enters them
+			//At most one pending sibling per level above the node being visited plus its two children, see BVH::maxDepth
+			constexpr int maxStackSize{ BVH::maxDepth + 1 };
+			uint32_t stack[maxStackSize];
+			float stackEntry[maxStackSize];
+			int stackSize{ 0 };
+			stack[stackSize] = rootIndex;
+			stackEntry[stackSize++] = tEntry;
+
+			bool hit{ false };
+			while (stackSize > 0)
+			{
+				--stackSize;
+				if (stackEntry[stackSize] >= ray.max)
+				{
+					continue;
+				}
+
+				const BVHNode& node{ nodes[stack[stackSize]] };
+				if (node.IsLeaf())
+				{
+					if (intersectLeaf(node))
+					{
+						if (anyHit) return true;
+						hit = true;
+					}
+					continue;
+				}
+
+				//Push the child to visit second first, so the other one is visited next
+				const BVHNode& leftChild{ nodes[node.leftFirst] };
+				const BVHNode& rightChild{ nodes[node.leftFirst + 1] };
+				float tLeft{};
+				float tRight{};
+				const bool hitLeft{ SlabTest_AABB(leftChild.minAABB, leftChild.maxAABB, ray, inversedDirection, tLeft) };
+				const bool hitRight{ SlabTest_AABB(rightChild.minAABB, rightChild.maxAABB, ray, inversedDirection, tRight) };
+
+				assert(stackSize + 2 <= maxStackSize);
+				const auto isRightFirst{ [&]()
+					{
+						if constexpr (order == TraversalOrder::LargestFirst)
+						{
+							return GetHalfArea(rightChild) > GetHalfArea(leftChild);
+						}
+						return tLeft > tRight;
+					} };
+				if (hitLeft && hitRight && isRightFirst())
+				{
+					stack[stackSize] = node.leftFirst;
+					stackEntry[stackSize++] = tLeft;
+					stack[stackSize] = node.leftFirst + 1;
+					stackEntry[stackSize++] = tRight;
+					continue;
+				}
+				if (hitRight)
+				{
+					stack[stackSize] = node.leftFirst + 1;
+					stackEntry[stackSize++] = tRight;
+				}
+				if (hitLeft)
+				{
+					stack[stackSize] = node.leftFirst;
+					stackEntry[stackSize++] = tLeft;
+				}
+			}
+
+			return hit;
+		}
+
+		inline int GetLowestSetBit(int mask)
+		{
+#if defined(_MSC_VER)
+			unsigned long index{};
+			_BitScanForward(&index, static_cast<unsigned long>(mask));
+			return static_cast<int>(index);
+#else
+			return __builtin_ctz(static_cast<unsigned>(mask));
+#endif
+		}
+
+		//Child boxes of a wide node as min x, y, z, max x, y, z
+		inline void LoadChildBounds(const BVH4Node& node, __m128(&bounds)[6])
+		{
+			bounds[0] = _mm_load_ps(node.minX);
+			bounds[1] = _mm_load_ps(node.minY);
+			bounds[2] = _mm_load_ps(node.minZ);
+			bounds[3] = _mm_load_ps(node.maxX);
+			bounds[4] = _mm_load_ps(node.maxY);
+			bounds[5] = _mm_load_ps(node.maxZ);
+		}
+
+		//Grid offsets to world space, the build made sure origin + offset * cellSize encloses every child
+		inline __m128 DequantizeBounds(const uint8_t(&offsets)[4], float origin, float cellSize)
+		{
+			int packedOffsets{};
+			std::memcpy(&packedOffsets, offsets, sizeof(packedOffsets));
+
+			const __m128i zero{ _mm_setzero_si128() };
+			const __m128i widenedOffsets{ _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packedOffsets), zero), zero) };
+			return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(widenedOffsets), _mm_set1_ps(cellSize)));
+		}
+
+		inline void LoadChildBounds(const BVH4QuantizedNode& node, __m128(&bounds)[6])
+		{
+			const float cellSize[3]{ node.GetCellSize(0), node.GetCellSize(1), node.GetCellSize(2) };
+			bounds[0] = DequantizeBounds(node.minX, node.origin.x, cellSize[0]);
+			bounds[1] = DequantizeBounds(node.minY, node.origin.y, cellSize[1]);
+			bounds[2] = DequantizeBounds(node.minZ, node.origin.z, cellSize[2]);
+			bounds[3] = DequantizeBounds(node.maxX, node.origin.x, cellSize[0]);
+			bounds[4] = DequantizeBounds(node.maxY, node.origin.y, cellSize[1]);
+			bounds[5] = DequantizeBounds(node.maxZ, node.origin.z, cellSize[2]);
+		}
+
+		/**
+		 * \brief Walks a 4-wide BVH in the given order, all children of a node are slab tested with one set of SSE instructions
+		 * \param nodes BVH4Node or BVH4QuantizedNode, root at index 0
+		 * \param ray ray to trace, the leaf intersector shrinks ray.max when it finds a closer hit
+		 * \param anyHit stop at the first leaf that reports a hit
+		 * \param intersectLeaf bool(const BVHNode&), same leaf intersector TraverseBVH takes
+		 * \param rootIndex wide node to start at, see FindEntryNode
+		 * \return whether any leaf reported a hit
+		 */
+		template<TraversalOrder order = TraversalOrder::NearestFirst, typename WideNode, typename LeafIntersector>
+		inline bool TraverseBVH4(const std::vector<WideNode>& nodes, Ray& ray, bool anyHit, LeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
+		{
+			if (nodes.empty())
 			{
 				return false;
 			}
-			
+
+			const __m128 originX{ _mm_set1_ps(ray.origin.x) };
+			const __m128 originY{ _mm_set1_ps(ray.origin.y) };
+			const __m128 originZ{ _mm_set1_ps(ray.origin.z) };
+			const __m128 inversedDirectionX{ _mm_set1_ps(1.f / ray.direction.x) };
+			const __m128 inversedDirectionY{ _mm_set1_ps(1.f / ray.direction.y) };
+			const __m128 inversedDirectionZ{ _mm_set1_ps(1.f / ray.direction.z) };
+			const __m128 zero{ _mm_setzero_ps() };
+
+			//Pending children (wide node or leaf range) together with the distance at which the ray enters them
+			struct StackEntry
+			{
+				uint32_t child;
+				uint32_t primitiveCount;
+				float tEntry;
+			};
+			//At most three pending siblings per level above the node being visited plus its four children,
+			//collapsing never makes the wide tree deeper than the binary one, see BVH::maxDepth
+			constexpr int maxStackSize{ 3 * BVH::maxDepth + 1 };
+			StackEntry stack[maxStackSize];
+			int stackSize{ 0 };
+			stack[stackSize++] = { rootIndex, 0, -FLT_MAX };
+
 			bool hit{ false };
-			HitRecord smallestT;
-			smallestT.t = FLT_MAX;
-			HitRecord currentRecord;			
-			Triangle tri;
-			for (size_t i{ 0 }; i < (mesh.indices.size() / 3); ++i)
+			while (stackSize > 0)
 			{
-				const size_t index{ (i * 3) };
+				const StackEntry entry{ stack[--stackSize] };
+				if (entry.tEntry >= ray.max)
+				{
+					continue;
+				}
 
-				tri = { mesh.transformedPositions[mesh.indices[index]], mesh.transformedPositions[mesh.indices[index + 1]], mesh.transformedPositions[mesh.indices[index + 2]] };
-				tri.cullMode = mesh.cullMode;
-				tri.materialIndex = mesh.materialIndex;
-				tri.normal = mesh.transformedNormals[i];
-				if (HitTest_Triangle(tri, ray, currentRecord, ignoreHitRecord))
+				if (entry.primitiveCount > 0)
 				{
-					if (currentRecord.t < smallestT.t)
+					BVHNode leaf{};
+					leaf.leftFirst = entry.child;
+					leaf.primitiveCount = entry.primitiveCount;
+					if (intersectLeaf(leaf))
 					{
-						smallestT = currentRecord;
+						if (anyHit) return true;
+						hit = true;
 					}
-					hit = true;
+					continue;
+				}
+
+				//Same slab test as SlabTest_AABB, four boxes wide
+				const WideNode& node{ nodes[entry.child] };
+
+				__m128 bounds[6];
+				LoadChildBounds(node, bounds);
+
+				const __m128 tx1{ _mm_mul_ps(_mm_sub_ps(bounds[0], originX), inversedDirectionX) };
+				const __m128 tx2{ _mm_mul_ps(_mm_sub_ps(bounds[3], originX), inversedDirectionX) };
+				__m128 tmin{ _mm_min_ps(tx1, tx2) };
+				__m128 tmax{ _mm_max_ps(tx1, tx2) };
+
+				const __m128 ty1{ _mm_mul_ps(_mm_sub_ps(bounds[1], originY), inversedDirectionY) };
+				const __m128 ty2{ _mm_mul_ps(_mm_sub_ps(bounds[4], originY), inversedDirectionY) };
+				tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2));
+				tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+				const __m128 tz1{ _mm_mul_ps(_mm_sub_ps(bounds[2], originZ), inversedDirectionZ) };
+				const __m128 tz2{ _mm_mul_ps(_mm_sub_ps(bounds[5], originZ), inversedDirectionZ) };
+				tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2));
+				tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+				const __m128 emptyMask{ _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(node.child)), _mm_set1_epi32(-1))) };
+				const __m128 hitMask{ _mm_andnot_ps(emptyMask, _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(tmax, zero), _mm_cmpge_ps(tmax, tmin)), _mm_cmplt_ps(tmin, _mm_set1_ps(ray.max)))) };
+				int mask{ _mm_movemask_ps(hitMask) };
+				if (mask == 0)
+				{
+					continue;
+				}
+
+				alignas(16) float tEntries[4];
+				_mm_store_ps(tEntries, tmin);
+
+				//Lower keys are visited first: the entry distance, or the negated half area for LargestFirst
+				alignas(16) float sortKeys[4];
+				if constexpr (order == TraversalOrder::LargestFirst)
+				{
+					const __m128 extentX{ _mm_sub_ps(bounds[3], bounds[0]) };
+					const __m128 extentY{ _mm_sub_ps(bounds[4], bounds[1]) };
+					const __m128 extentZ{ _mm_sub_ps(bounds[5], bounds[2]) };
+					const __m128 halfArea{ _mm_add_ps(_mm_add_ps(_mm_mul_ps(extentX, extentY), _mm_mul_ps(extentY, extentZ)), _mm_mul_ps(extentZ, extentX)) };
+					_mm_store_ps(sortKeys, _mm_sub_ps(zero, halfArea));
 				}
+				else
+				{
+					_mm_store_ps(sortKeys, tmin);
+				}
+
+				//Insert the hit children sorted by descending key, so the one to visit first ends on top of the stack
+				assert(stackSize + 4 <= maxStackSize);
+				const int firstHitChild{ stackSize };
+				float insertedKeys[4];
+				do
+				{
+					const int i{ GetLowestSetBit(mask) };
+					mask &= mask - 1;
+
+					int insertAt{ stackSize++ - firstHitChild };
+					for (; insertAt > 0 && insertedKeys[insertAt - 1] < sortKeys[i]; --insertAt)
+					{
+						stack[firstHitChild + insertAt] = stack[firstHitChild + insertAt - 1];
+						insertedKeys[insertAt] = insertedKeys[insertAt - 1];
+					}
+					stack[firstHitChild + insertAt] = { node.child[i], node.primitiveCount[i], tEntries[i] };
+					insertedKeys[insertAt] = sortKeys[i];
+				} while (mask != 0);
 			}
-			hitRecord = smallestT;
+
 			return hit;
 		}
 
+		//Walks the BVH in the layout it was built with, rootIndex indexes the nodes of that layout
+		template<TraversalOrder order = TraversalOrder::NearestFirst, typename LeafIntersector>
+		inline bool TraverseBVH(const BVH& bvh, Ray& ray, bool anyHit, LeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
+		{
+			switch (bvh.GetLayout())
+			{
+			case BVHLayout::Wide4:
+				return TraverseBVH4<order>(bvh.GetWideNodes(), ray, anyHit, std::forward<LeafIntersector>(intersectLeaf), rootIndex);
+			case BVHLayout::Wide4Quantized:
+				return TraverseBVH4<order>(bvh.GetQuantizedNodes(), ray, anyHit, std::forward<LeafIntersector>(intersectLeaf), rootIndex);
+			case BVHLayout::Binary:
+			default:
+				return TraverseBVH<order>(bvh.GetNodes(), ray, anyHit, std::forward<LeafIntersector>(intersectLeaf), rootIndex);
+			}
+		}
+
+		//Any-hit walk for occlusion queries, the ray never shrinks
+		template<typename LeafIntersector>
+		inline bool OcclusionTest_BVH(const BVH& bvh, const Ray& ray, LeafIntersector&& intersectLeaf)
+		{
+			Ray occlusionRay{ ray };
+			return TraverseBVH<TraversalOrder::LargestFirst>(bvh, occlusionRay, true, std::forward<LeafIntersector>(intersectLeaf));
+		}
+
+		//Child boxes of a wide node, empty slots included
+		template<typename WideNode>
+		inline void GetChildBounds(const WideNode& node, AABB(&childBounds)[4])
+		{
+			__m128 bounds[6];
+			LoadChildBounds(node, bounds);
+			alignas(16) float components[6][4];
+			for (int component{ 0 }; component < 6; ++component)
+			{
+				_mm_store_ps(components[component], bounds[component]);
+			}
+
+			for (int i{ 0 }; i < 4; ++i)
+			{
+				childBounds[i] = AABB{ { components[0][i], components[1][i], components[2][i] }, { components[3][i], components[4][i], components[5][i] } };
+			}
+		}
+
+		//Calls visitLeaf(first, primitiveCount) for every leaf overlapping frustum, in no particular order
+		template<typename LeafVisitor>
+		inline void CullBVH(const BVH& bvh, const Frustum& frustum, LeafVisitor&& visitLeaf)
+		{
+			if (bvh.IsEmpty() || !frustum.Overlaps(bvh.GetBounds()))
+			{
+				return;
+			}
+
+			//Bounded like the wide ray walk, the binary walk needs less
+			constexpr int maxStackSize{ 3 * BVH::maxDepth + 1 };
+			uint32_t stack[maxStackSize];
+			int stackSize{ 0 };
+			stack[stackSize++] = 0;
+
+			const auto cullWideNodes{ [&](const auto& nodes)
+				{
+					while (stackSize > 0)
+					{
+						const auto& node{ nodes[stack[--stackSize]] };
+						AABB childBounds[4];
+						GetChildBounds(node, childBounds);
+						for (int i{ 0 }; i < 4; ++i)
+						{
+							if (node.IsEmpty(i) || !frustum.Overlaps(childBounds[i]))
+							{
+								continue;
+							}
+
+							if (node.IsLeaf(i))
+							{
+								visitLeaf(node.child[i], static_cast<uint32_t>(node.primitiveCount[i]));
+								continue;
+							}
+
+							assert(stackSize < maxStackSize);
+							stack[stackSize++] = node.child[i];
+						}
+					}
+				} };
+
+			switch (bvh.GetLayout())
+			{
+			case BVHLayout::Wide4:
+				cullWideNodes(bvh.GetWideNodes());
+				return;
+			case BVHLayout::Wide4Quantized:
+				cullWideNodes(bvh.GetQuantizedNodes());
+				return;
+			case BVHLayout::Binary:
+			default:
+				break;
+			}
+
+			const std::vector<BVHNode>& nodes{ bvh.GetNodes() };
+			while (stackSize > 0)
+			{
+				const BVHNode& node{ nodes[stack[--stackSize]] };
+				if (node.IsLeaf())
+				{
+					visitLeaf(node.leftFirst, node.primitiveCount);
+					continue;
+				}
+
+				for (uint32_t child{ node.leftFirst }; child < node.leftFirst + 2; ++child)
+				{
+					if (frustum.Overlaps(AABB{ nodes[child].minAABB, nodes[child].maxAABB }))
+					{
+						assert(stackSize < maxStackSize);
+						stack[stackSize++] = child;
+					}
+				}
+			}
+		}
+
+		/**
+		 * \brief Finds the deepest node whose subtree holds every leaf overlapping frustum
+		 * A walk of any ray inside frustum can start there instead of at the root and visits the same leaves
+		 * \param frustum frustum in the space of the BVH
+		 * \param entryNode node for the rootIndex of TraverseBVH, in the nodes of the layout the BVH was built with
+		 * \return false when no leaf overlaps frustum, no ray inside it can hit the BVH then
+		 */
+		inline bool FindEntryNode(const BVH& bvh, const Frustum& frustum, uint32_t& entryNode)
+		{
+			entryNode = 0;
+			if (bvh.IsEmpty() || !frustum.Overlaps(bvh.GetBounds()))
+			{
+				return false;
+			}
+
+			//Descend as long as a single interior child overlaps
+			const auto descendWideNodes{ [&](const auto& nodes)
+				{
+					while (true)
+					{
+						const auto& node{ nodes[entryNode] };
+						AABB childBounds[4];
+						GetChildBounds(node, childBounds);
+
+						int overlapCount{ 0 };
+						int overlappingChild{ 0 };
+						for (int i{ 0 }; i < 4; ++i)
+						{
+							if (!node.IsEmpty(i) && frustum.Overlaps(childBounds[i]))
+							{
+								++overlapCount;
+								overlappingChild = i;
+							}
+						}
+
+						if (overlapCount != 1 || node.IsLeaf(overlappingChild))
+						{
+							return overlapCount > 0;
+						}
+						entryNode = node.child[overlappingChild];
+					}
+				} };
+
+			switch (bvh.GetLayout())
+			{
+			case BVHLayout::Wide4:
+				return descendWideNodes(bvh.GetWideNodes());
+			case BVHLayout::Wide4Quantized:
+				return descendWideNodes(bvh.GetQuantizedNodes());
+			case BVHLayout::Binary:
+			default:
+				break;
+			}
+
+			const std::vector<BVHNode>& nodes{ bvh.GetNodes() };
+			while (!nodes[entryNode].IsLeaf())
+			{
+				const uint32_t left{ nodes[entryNode].leftFirst };
+				const bool overlapsLeft{ frustum.Overlaps(AABB{ nodes[left].minAABB, nodes[left].maxAABB }) };
+				const bool overlapsRight{ frustum.Overlaps(AABB{ nodes[left + 1].minAABB, nodes[left + 1].maxAABB }) };
+				if (overlapsLeft == overlapsRight)
+				{
+					return overlapsLeft;
+				}
+				entryNode = overlapsLeft ? left : left + 1;
+			}
+			return true;
+		}
+#pragma endregion
+#pragma region TriangeMesh HitTest
+
+		inline bool SlabTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
+		{
+			const Vector3 inversedDirection = { 1.f / ray.direction.x,1.f / ray.direction.y,1.f / ray.direction.z };
+			float tEntry{};
+			return SlabTest_AABB(mesh.transformedMinAABB, mesh.transformedMaxAABB, ray, inversedDirection, tEntry);
+		}
+
+		//Hit test against the mesh BVH, in whatever space GetBVHPositions() lives in
+		//intersectLeaf(leaf, currentRay, closestTriangle) tests one leaf range, shrinking currentRay.max on every closer hit
+		//rootIndex is the node to start at, see FindEntryNode
+		template<typename LeafIntersector>
+		inline bool HitTest_TriangleMeshBVH(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, LeafIntersector&& intersectLeaf, uint32_t rootIndex)
+		{
+			if (mesh.bvh.IsEmpty())
+			{
+				return false;
+			}
+
+			//Every closer hit shrinks the ray, so farther nodes and triangles get rejected early
+			Ray currentRay{ ray };
+			size_t closestTriangle{};
+
+			const bool hit{ TraverseBVH(mesh.bvh, currentRay, ignoreHitRecord, [&](const BVHNode& leaf)
+				{
+					return intersectLeaf(leaf, currentRay, closestTriangle);
+				}, rootIndex) };
+
+			if (!hit || ignoreHitRecord)
+			{
+				return hit;
+			}
+
+			hitRecord.didHit = true;
+			hitRecord.materialIndex = mesh.materialIndex;
+			hitRecord.normal = mesh.triangles.GetNormal(closestTriangle);
+			hitRecord.origin = ray.origin + currentRay.max * ray.direction;
+			hitRecord.t = currentRay.max;
+			return true;
+		}
+
+		//Scalar leaf loop, one triangle at a time with the given kernel
+		template<typename Kernel>
+		inline bool HitTest_TriangleMeshBVH(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, uint32_t rootIndex)
+		{
+			const TriangleSoA& triangles{ mesh.triangles };
+			const Kernel kernel{ ray };
+
+			return HitTest_TriangleMeshBVH(mesh, ray, hitRecord, ignoreHitRecord, [&](const BVHNode& leaf, Ray& currentRay, size_t& closestTriangle)
+				{
+					bool leafHit{ false };
+					for (size_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+					{
+						if (TriangleKernels::IsTriangleCulled(triangles, i, mesh.cullMode, ray.direction, ignoreHitRecord))
+						{
+							continue;
+						}
+
+						float t{};
+						if (kernel.Intersect(triangles, i, currentRay, t))
+						{
+							if (ignoreHitRecord) return true;
+
+							currentRay.max = t;
+							closestTriangle = i;
+							leafHit = true;
+						}
+					}
+					return leafHit;
+				}, rootIndex);
+		}
+
+		//Moller-Trumbore leaf loop testing 8 triangles per step
+		inline bool HitTest_TriangleMeshBVH_AVX2(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, uint32_t rootIndex)
+		{
+			return HitTest_TriangleMeshBVH(mesh, ray, hitRecord, ignoreHitRecord, [&](const BVHNode& leaf, Ray& currentRay, size_t& closestTriangle)
+				{
+					float t{};
+					if (!TriangleKernels::IntersectMollerTrumbore8(mesh.triangles, leaf.leftFirst, leaf.primitiveCount, mesh.cullMode, currentRay, ignoreHitRecord, t, closestTriangle))
+					{
+						return false;
+					}
+
+					currentRay.max = t;
+					return true;
+				}, rootIndex);
+		}
+
+		inline bool HitTest_TriangleMeshBVH(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, uint32_t rootIndex = 0)
+		{
+			switch (mesh.intersectionKernel)
+			{
+			case TriangleIntersectionKernel::EdgeTests:
+				return HitTest_TriangleMeshBVH<TriangleKernels::EdgeTests>(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+			case TriangleIntersectionKernel::Watertight:
+				return HitTest_TriangleMeshBVH<TriangleKernels::Watertight>(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+			case TriangleIntersectionKernel::PrecomputedAffine:
+				return HitTest_TriangleMeshBVH<TriangleKernels::PrecomputedAffine>(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+			case TriangleIntersectionKernel::MollerTrumbore:
+			default:
+				if (TriangleKernels::IsAVX2Supported())
+				{
+					return HitTest_TriangleMeshBVH_AVX2(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+				}
+				return HitTest_TriangleMeshBVH<TriangleKernels::MollerTrumbore>(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+			}
+		}
+
+		//Any-hit test of triangles [first, first + count), occluderIndex is set to the one that blocks the ray
+		template<typename Kernel>
+		inline bool OcclusionTest_Triangles(const TriangleMesh& mesh, const Kernel& kernel, const Ray& ray, size_t first, size_t count, size_t& occluderIndex)
+		{
+			const TriangleSoA& triangles{ mesh.triangles };
+			for (size_t i{ first }; i < first + count; ++i)
+			{
+				float t{};
+				if (!TriangleKernels::IsTriangleCulled(triangles, i, mesh.cullMode, ray.direction, true) && kernel.Intersect(triangles, i, ray, t))
+				{
+					occluderIndex = i;
+					return true;
+				}
+			}
+			return false;
+		}
+
+		/**
+		 * \brief Sets up the intersection kernel of the mesh for ray and hands the matching triangle test to test
+		 * \param test bool(intersectTriangles), intersectTriangles is bool(size_t first, size_t count, size_t& occluderIndex)
+		 */
+		template<typename OcclusionTest>
+		inline bool DispatchOcclusionKernel(const TriangleMesh& mesh, const Ray& ray, OcclusionTest&& test)
+		{
+			const auto withKernel{ [&](const auto& kernel)
+				{
+					return test([&](size_t first, size_t count, size_t& occluderIndex)
+						{
+							return OcclusionTest_Triangles(mesh, kernel, ray, first, count, occluderIndex);
+						});
+				} };
+
+			switch (mesh.intersectionKernel)
+			{
+			case TriangleIntersectionKernel::EdgeTests:
+				return withKernel(TriangleKernels::EdgeTests{ ray });
+			case TriangleIntersectionKernel::Watertight:
+				return withKernel(TriangleKernels::Watertight{ ray });
+			case TriangleIntersectionKernel::PrecomputedAffine:
+				return withKernel(TriangleKernels::PrecomputedAffine{ ray });
+			case TriangleIntersectionKernel::MollerTrumbore:
+			default:
+				if (TriangleKernels::IsAVX2Supported())
+				{
+					return test([&](size_t first, size_t count, size_t& occluderIndex)
+						{
+							float t{};
+							return TriangleKernels::IntersectMollerTrumbore8(mesh.triangles, first, count, mesh.cullMode, ray, true, t, occluderIndex);
+						});
+				}
+				return withKernel(TriangleKernels::MollerTrumbore{ ray });
+			}
+		}
+
+		//Occlusion test against the mesh BVH: no closest triangle or hit record, the first blocking triangle ends the walk
+		//occluderIndex is the TriangleSoA index of that triangle
+		inline bool HitTest_TriangleMeshBVH(const TriangleMesh& mesh, const Ray& ray, size_t& occluderIndex)
+		{
+			return DispatchOcclusionKernel(mesh, ray, [&](auto&& intersectTriangles)
+				{
+					return OcclusionTest_BVH(mesh.bvh, ray, [&](const BVHNode& leaf)
+						{
+							return intersectTriangles(leaf.leftFirst, leaf.primitiveCount, occluderIndex);
+						});
+				});
+		}
+
+		//Occlusion test against one triangle (TriangleSoA index) with the same kernel as the BVH test, for occluder caches
+		inline bool HitTest_TriangleMeshTriangle(const TriangleMesh& mesh, const Ray& ray, size_t triangleIndex)
+		{
+			if (triangleIndex >= mesh.triangles.Size())
+			{
+				return false;
+			}
+
+			size_t occluderIndex{};
+			return DispatchOcclusionKernel(mesh, ray, [&](auto&& intersectTriangles)
+				{
+					return intersectTriangles(triangleIndex, 1, occluderIndex);
+				});
+		}
+
+		//Same ray in the space of transform, the direction is not renormalized so t keeps its meaning
+		inline Ray TransformRay(const Matrix& transform, const Ray& ray)
+		{
+			Ray transformedRay{ ray };
+			transformedRay.origin = transform.TransformPoint(ray.origin);
+			transformedRay.direction = transform.TransformVector(ray.direction);
+			return transformedRay;
+		}
+
+		//Shadow ray in the space GetBVHPositions() lives in
+		inline Ray GetBVHSpaceRay(const TriangleMesh& mesh, const Ray& ray)
+		{
+			return mesh.transformMode == MeshTransformMode::TransformVertices ? ray : TransformRay(mesh.worldToObject, ray);
+		}
+
+		//Hit test against an object space mesh placed in the world by objectToWorld
+		inline bool HitTest_TriangleMeshObjectSpace(const TriangleMesh& mesh, const Matrix& objectToWorld, const Matrix& worldToObject,
+			const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord, uint32_t rootIndex = 0)
+		{
+			const Ray objectRay{ TransformRay(worldToObject, ray) };
+
+			HitRecord objectHitRecord{};
+			if (!HitTest_TriangleMeshBVH(mesh, objectRay, objectHitRecord, ignoreHitRecord, rootIndex))
+			{
+				return false;
+			}
+
+			if (ignoreHitRecord) return true;
+
+			hitRecord = objectHitRecord;
+			hitRecord.origin = ray.origin + objectHitRecord.t * ray.direction;
+			hitRecord.normal = objectToWorld.TransformVector(objectHitRecord.normal);
+			return true;
+		}
+
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false, uint32_t rootIndex = 0)
+		{
+			//todo W5
+			//assert(false && "No Implemented Yet!");
+
+			if (mesh.transformMode == MeshTransformMode::TransformVertices)
+			{
+				return HitTest_TriangleMeshBVH(mesh, ray, hitRecord, ignoreHitRecord, rootIndex);
+			}
+
+			return HitTest_TriangleMeshObjectSpace(mesh, mesh.objectToWorld, mesh.worldToObject, ray, hitRecord, ignoreHitRecord, rootIndex);
+		}
+
+		//Occlusion test for shadow rays, see HitTest_TriangleMeshBVH(mesh, ray, occluderIndex)
+		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray, size_t& occluderIndex)
+		{
+			return HitTest_TriangleMeshBVH(mesh, GetBVHSpaceRay(mesh, ray), occluderIndex);
+		}
+
 		inline bool HitTest_TriangleMesh(const TriangleMesh& mesh, const Ray& ray)
 		{
-			HitRecord temp{};
-			return HitTest_TriangleMesh(mesh, ray, temp, true);
+			size_t occluderIndex{};
+			return HitTest_TriangleMesh(mesh, ray, occluderIndex);
+		}
+
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray, HitRecord& hitRecord, bool ignoreHitRecord = false, uint32_t rootIndex = 0)
+		{
+			if (!HitTest_TriangleMeshObjectSpace(*instance.pMesh, instance.objectToWorld, instance.worldToObject, ray, hitRecord, ignoreHitRecord, rootIndex))
+			{
+				return false;
+			}
+
+			if (!ignoreHitRecord)
+			{
+				hitRecord.materialIndex = instance.materialIndex;
+			}
+			return true;
+		}
+
+		//Occlusion test for shadow rays, see HitTest_TriangleMeshBVH(mesh, ray, occluderIndex)
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray, size_t& occluderIndex)
+		{
+			return HitTest_TriangleMeshBVH(*instance.pMesh, TransformRay(instance.worldToObject, ray), occluderIndex);
+		}
+
+		inline bool HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, const Ray& ray)
+		{
+			size_t occluderIndex{};
+			return HitTest_TriangleMeshInstance(instance, ray, occluderIndex);
+		}
+#pragma endregion
+#pragma region Packet HitTest
+		//Every packet test mirrors the arithmetic of its scalar test lane by lane, so a packet finds the exact hits its rays would on their own
+		//laneMask selects the lanes to test, a lane that finds a hit closer than packet.tMax gets its hit record written and its tMax shrunk
+
+		//Calls laneFunction(lane) for every lane in laneMask, lowest first
+		template<typename LaneFunction>
+		inline void ForEachLane(int laneMask, LaneFunction&& laneFunction)
+		{
+			while (laneMask != 0)
+			{
+				const int lane{ GetLowestSetBit(laneMask) };
+				laneMask &= laneMask - 1;
+				laneFunction(lane);
+			}
+		}
+
+		//All bits set in the lanes of laneMask
+		inline __m128 GetLaneMask(int laneMask)
+		{
+			const __m128i laneBits{ _mm_setr_epi32(1, 2, 4, 8) };
+			return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(laneMask), laneBits), laneBits));
+		}
+
+		inline __m128 Select(__m128 mask, __m128 a, __m128 b)
+		{
+			return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+		}
+
+		inline float HorizontalMin(__m128 values)
+		{
+			values = _mm_min_ps(values, _mm_movehl_ps(values, values));
+			values = _mm_min_ss(values, _mm_shuffle_ps(values, values, 1));
+			return _mm_cvtss_f32(values);
+		}
+
+		//SlabTest_AABB for the lanes in laneMask, returns the lanes that hit, tEntry is infinite in all others
+		//_mm_min_ps(b, a) picks the same value as std::min(a, b), also when one of them is NaN
+		inline int SlabTest_AABB(const Vector3& minAABB, const Vector3& maxAABB, const RayPacket& packet, int laneMask, __m128& tEntry)
+		{
+			const __m128 tx1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.x), packet.originX), packet.inversedDirectionX) };
+			const __m128 tx2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.x), packet.originX), packet.inversedDirectionX) };
+			__m128 tmin{ _mm_min_ps(tx2, tx1) };
+			__m128 tmax{ _mm_max_ps(tx2, tx1) };
+
+			const __m128 ty1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.y), packet.originY), packet.inversedDirectionY) };
+			const __m128 ty2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.y), packet.originY), packet.inversedDirectionY) };
+			tmin = _mm_max_ps(_mm_min_ps(ty2, ty1), tmin);
+			tmax = _mm_min_ps(_mm_max_ps(ty2, ty1), tmax);
+
+			const __m128 tz1{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minAABB.z), packet.originZ), packet.inversedDirectionZ) };
+			const __m128 tz2{ _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxAABB.z), packet.originZ), packet.inversedDirectionZ) };
+			tmin = _mm_max_ps(_mm_min_ps(tz2, tz1), tmin);
+			tmax = _mm_min_ps(_mm_max_ps(tz2, tz1), tmax);
+
+			const __m128 hit{ _mm_and_ps(GetLaneMask(laneMask),
+				_mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(tmax, _mm_setzero_ps()), _mm_cmpge_ps(tmax, tmin)), _mm_cmplt_ps(tmin, packet.tMax))) };
+			tEntry = Select(hit, tmin, _mm_set1_ps(INFINITY));
+			return _mm_movemask_ps(hit);
+		}
+
+		/**
+		 * \brief Walks a BVH with a whole packet: a node is entered when any lane hits it, a leaf is tested for the lanes that hit it only
+		 * The packet visits the child its lanes enter first first, a lane drops out of a node once its closest hit is nearer than the node
+		 * \param nodes BVH nodes, root at index 0
+		 * \param packet rays to trace, the leaf intersector shrinks packet.tMax of lanes that find a closer hit
+		 * \param laneMask lanes to trace
+		 * \param intersectLeaf int(const BVHNode& leaf, int laneMask), tests the primitives of a leaf for laneMask and returns the lanes that hit
+		 * \param rootIndex node to start at, see FindEntryNode
+		 * \return lanes any leaf reported a hit for
+		 */
+		template<typename PacketLeafIntersector>
+		inline int TraverseBVH(const std::vector<BVHNode>& nodes, RayPacket& packet, int laneMask, PacketLeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
+		{
+			if (nodes.empty())
+			{
+				return 0;
+			}
+
+			__m128 tEntry{};
+			if (SlabTest_AABB(nodes[rootIndex].minAABB, nodes[rootIndex].maxAABB, packet, laneMask, tEntry) == 0)
+			{
+				return 0;
+			}
+
+			//Pending nodes together with the distance at which every lane enters them, bounded like the single ray walk
+			constexpr int maxStackSize{ BVH::maxDepth + 1 };
+			uint32_t stack[maxStackSize];
+			__m128 stackEntry[maxStackSize];
+			int stackSize{ 0 };
+			stack[stackSize] = rootIndex;
+			stackEntry[stackSize++] = tEntry;
+
+			int hitMask{ 0 };
+			while (stackSize > 0)
+			{
+				--stackSize;
+				const int nodeLanes{ _mm_movemask_ps(_mm_cmplt_ps(stackEntry[stackSize], packet.tMax)) };
+				if (nodeLanes == 0)
+				{
+					continue;
+				}
+
+				const BVHNode& node{ nodes[stack[stackSize]] };
+				if (node.IsLeaf())
+				{
+					hitMask |= intersectLeaf(node, nodeLanes);
+					continue;
+				}
+
+				const BVHNode& leftChild{ nodes[node.leftFirst] };
+				const BVHNode& rightChild{ nodes[node.leftFirst + 1] };
+				__m128 tLeft{};
+				__m128 tRight{};
+				const int leftLanes{ SlabTest_AABB(leftChild.minAABB, leftChild.maxAABB, packet, nodeLanes, tLeft) };
+				const int rightLanes{ SlabTest_AABB(rightChild.minAABB, rightChild.maxAABB, packet, nodeLanes, tRight) };
+
+				//Push the child to visit second first, so the other one is visited next
+				assert(stackSize + 2 <= maxStackSize);
+				if (leftLanes && rightLanes && HorizontalMin(tLeft) > HorizontalMin(tRight))
+				{
+					stack[stackSize] = node.leftFirst;
+					stackEntry[stackSize++] = tLeft;
+					stack[stackSize] = node.leftFirst + 1;
+					stackEntry[stackSize++] = tRight;
+					continue;
+				}
+				if (rightLanes)
+				{
+					stack[stackSize] = node.leftFirst + 1;
+					stackEntry[stackSize++] = tRight;
+				}
+				if (leftLanes)
+				{
+					stack[stackSize] = node.leftFirst;
+					stackEntry[stackSize++] = tLeft;
+				}
+			}
+
+			return hitMask;
+		}
+
+		//Packet walk of a 4-wide BVH, the children are slab tested one at a time with all lanes at once
+		template<typename WideNode, typename PacketLeafIntersector>
+		inline int TraverseBVH4(const std::vector<WideNode>& nodes, RayPacket& packet, int laneMask, PacketLeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
+		{
+			if (nodes.empty())
+			{
+				return 0;
+			}
+
+			//Pending children (wide node or leaf range) together with the distance at which every lane enters them
+			struct StackEntry
+			{
+				__m128 tEntry;
+				uint32_t child;
+				uint32_t primitiveCount;
+			};
+			//Bounded like the single ray walk
+			constexpr int maxStackSize{ 3 * BVH::maxDepth + 1 };
+			StackEntry stack[maxStackSize];
+			int stackSize{ 0 };
+			stack[stackSize++] = { Select(GetLaneMask(laneMask), _mm_set1_ps(-FLT_MAX), _mm_set1_ps(INFINITY)), rootIndex, 0 };
+
+			int hitMask{ 0 };
+			while (stackSize > 0)
+			{
+				const StackEntry entry{ stack[--stackSize] };
+				const int nodeLanes{ _mm_movemask_ps(_mm_cmplt_ps(entry.tEntry, packet.tMax)) };
+				if (nodeLanes == 0)
+				{
+					continue;
+				}
+
+				if (entry.primitiveCount > 0)
+				{
+					BVHNode leaf{};
+					leaf.leftFirst = entry.child;
+					leaf.primitiveCount = entry.primitiveCount;
+					hitMask |= intersectLeaf(leaf, nodeLanes);
+					continue;
+				}
+
+				const WideNode& node{ nodes[entry.child] };
+				AABB childBounds[4];
+				GetChildBounds(node, childBounds);
+
+				//Insert the hit children sorted by descending entry distance, so the nearest ends on top of the stack
+				assert(stackSize + 4 <= maxStackSize);
+				const int firstHitChild{ stackSize };
+				float insertedKeys[4];
+				for (int i{ 0 }; i < 4; ++i)
+				{
+					if (node.IsEmpty(i))
+					{
+						continue;
+					}
+
+					__m128 tEntry{};
+					if (SlabTest_AABB(childBounds[i].min, childBounds[i].max, packet, nodeLanes, tEntry) == 0)
+					{
+						continue;
+					}
+
+					const float key{ HorizontalMin(tEntry) };
+					int insertAt{ stackSize++ - firstHitChild };
+					for (; insertAt > 0 && insertedKeys[insertAt - 1] < key; --insertAt)
+					{
+						stack[firstHitChild + insertAt] = stack[firstHitChild + insertAt - 1];
+						insertedKeys[insertAt] = insertedKeys[insertAt - 1];
+					}
+					stack[firstHitChild + insertAt] = { tEntry, node.child[i], node.primitiveCount[i] };
+					insertedKeys[insertAt] = key;
+				}
+			}
+
+			return hitMask;
+		}
+
+		//Packet walk of the BVH in the layout it was built with
+		template<typename PacketLeafIntersector>
+		inline int TraverseBVH(const BVH& bvh, RayPacket& packet, int laneMask, PacketLeafIntersector&& intersectLeaf, uint32_t rootIndex = 0)
+		{
+			switch (bvh.GetLayout())
+			{
+			case BVHLayout::Wide4:
+				return TraverseBVH4(bvh.GetWideNodes(), packet, laneMask, std::forward<PacketLeafIntersector>(intersectLeaf), rootIndex);
+			case BVHLayout::Wide4Quantized:
+				return TraverseBVH4(bvh.GetQuantizedNodes(), packet, laneMask, std::forward<PacketLeafIntersector>(intersectLeaf), rootIndex);
+			case BVHLayout::Binary:
+			default:
+				return TraverseBVH(bvh.GetNodes(), packet, laneMask, std::forward<PacketLeafIntersector>(intersectLeaf), rootIndex);
+			}
+		}
+
+		//Hit test for every lane at once, see HitTest_Sphere(sphere, ray, hitRecord)
+		inline int HitTest_Sphere(const Sphere& sphere, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount])
+		{
+			const __m128 sphereOrToRayOrX{ _mm_sub_ps(packet.originX, _mm_set1_ps(sphere.origin.x)) };
+			const __m128 sphereOrToRayOrY{ _mm_sub_ps(packet.originY, _mm_set1_ps(sphere.origin.y)) };
+			const __m128 sphereOrToRayOrZ{ _mm_sub_ps(packet.originZ, _mm_set1_ps(sphere.origin.z)) };
+
+			const __m128 a{ TriangleKernels::Dot4(packet.directionX, packet.directionY, packet.directionZ, packet.directionX, packet.directionY, packet.directionZ) };
+			const __m128 b{ _mm_mul_ps(_mm_set1_ps(2.f), TriangleKernels::Dot4(packet.directionX, packet.directionY, packet.directionZ, sphereOrToRayOrX, sphereOrToRayOrY, sphereOrToRayOrZ)) };
+			const __m128 c{ _mm_sub_ps(TriangleKernels::Dot4(sphereOrToRayOrX, sphereOrToRayOrY, sphereOrToRayOrZ, sphereOrToRayOrX, sphereOrToRayOrY, sphereOrToRayOrZ),
+				_mm_set1_ps(sphere.radius * sphere.radius)) };
+
+			const __m128 discriminant{ _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.f), a), c)) };
+			const __m128 hasRoots{ _mm_and_ps(GetLaneMask(laneMask), _mm_cmpgt_ps(discriminant, _mm_setzero_ps())) };
+			if (_mm_movemask_ps(hasRoots) == 0)
+			{
+				return 0;
+			}
+
+			const __m128 sqrtDiscriminant{ _mm_sqrt_ps(discriminant) };
+			const __m128 minusB{ _mm_xor_ps(b, _mm_set1_ps(-0.f)) };
+			const __m128 twoA{ _mm_mul_ps(_mm_set1_ps(2.f), a) };
+			const __m128 t0{ _mm_div_ps(_mm_sub_ps(minusB, sqrtDiscriminant), twoA) };
+			const __m128 t1{ _mm_div_ps(_mm_add_ps(minusB, sqrtDiscriminant), twoA) };
+
+			//The near root when it lies inside the ray, the far one otherwise
+			const __m128 isT0Valid{ _mm_and_ps(_mm_cmpgt_ps(t0, packet.tMin), _mm_cmplt_ps(t0, packet.tMax)) };
+			const __m128 isT1Valid{ _mm_and_ps(_mm_cmpgt_ps(t1, packet.tMin), _mm_cmplt_ps(t1, packet.tMax)) };
+			const __m128 t{ Select(isT0Valid, t0, t1) };
+			const __m128 hit{ _mm_and_ps(hasRoots, _mm_or_ps(isT0Valid, isT1Valid)) };
+			const int hitMask{ _mm_movemask_ps(hit) };
+			if (hitMask == 0)
+			{
+				return 0;
+			}
+
+			packet.tMax = Select(hit, t, packet.tMax);
+			ForEachLane(hitMask, [&](int lane)
+				{
+					const Ray& ray{ packet.rays[lane] };
+					HitRecord& hitRecord{ hitRecords[lane] };
+					hitRecord.t = packet.GetMax(lane);
+					hitRecord.didHit = true;
+					hitRecord.materialIndex = sphere.materialIndex;
+					hitRecord.origin = ray.origin + hitRecord.t * ray.direction;
+					hitRecord.normal = (hitRecord.origin - sphere.origin).Normalized();
+				});
+			return hitMask;
+		}
+
+		//Hit test for every lane at once, see HitTest_Plane(plane, ray, hitRecord)
+		//Unlike the scalar test a hit at exactly packet.tMax does not count, it would not be closer than the hit already found
+		inline int HitTest_Plane(const Plane& plane, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount])
+		{
+			const __m128 normalX{ _mm_set1_ps(plane.normal.x) };
+			const __m128 normalY{ _mm_set1_ps(plane.normal.y) };
+			const __m128 normalZ{ _mm_set1_ps(plane.normal.z) };
+
+			const __m128 numerator{ TriangleKernels::Dot4(_mm_sub_ps(_mm_set1_ps(plane.origin.x), packet.originX), _mm_sub_ps(_mm_set1_ps(plane.origin.y), packet.originY),
+				_mm_sub_ps(_mm_set1_ps(plane.origin.z), packet.originZ), normalX, normalY, normalZ) };
+			const __m128 t{ _mm_div_ps(numerator, TriangleKernels::Dot4(packet.directionX, packet.directionY, packet.directionZ, normalX, normalY, normalZ)) };
+
+			const __m128 hit{ _mm_and_ps(GetLaneMask(laneMask), _mm_and_ps(_mm_cmpge_ps(t, packet.tMin), _mm_cmplt_ps(t, packet.tMax))) };
+			const int hitMask{ _mm_movemask_ps(hit) };
+			if (hitMask == 0)
+			{
+				return 0;
+			}
+
+			packet.tMax = Select(hit, t, packet.tMax);
+			ForEachLane(hitMask, [&](int lane)
+				{
+					const Ray& ray{ packet.rays[lane] };
+					HitRecord& hitRecord{ hitRecords[lane] };
+					hitRecord.t = packet.GetMax(lane);
+					hitRecord.didHit = true;
+					hitRecord.materialIndex = plane.materialIndex;
+					hitRecord.normal = plane.normal;
+					hitRecord.origin = ray.origin + hitRecord.t * ray.direction;
+				});
+			return hitMask;
+		}
+
+		//Scalar kernel per lane, for the kernels without a packet version
+		template<typename Kernel>
+		inline int HitTest_TriangleMeshBVH(const TriangleMesh& mesh, RayPacket& packet, int laneMask, size_t(&closestTriangles)[RayPacket::laneCount], uint32_t rootIndex)
+		{
+			const TriangleSoA& triangles{ mesh.triangles };
+			const Kernel kernels[RayPacket::laneCount]{ Kernel{ packet.rays[0] }, Kernel{ packet.rays[1] }, Kernel{ packet.rays[2] }, Kernel{ packet.rays[3] } };
+
+			return TraverseBVH(mesh.bvh, packet, laneMask, [&](const BVHNode& leaf, int leafLanes)
+				{
+					int leafHits{ 0 };
+					ForEachLane(leafLanes, [&](int lane)
+						{
+							Ray currentRay{ packet.GetRay(lane) };
+							for (size_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+							{
+								float t{};
+								if (!TriangleKernels::IsTriangleCulled(triangles, i, mesh.cullMode, currentRay.direction, false) && kernels[lane].Intersect(triangles, i, currentRay, t))
+								{
+									currentRay.max = t;
+									closestTriangles[lane] = i;
+									leafHits |= 1 << lane;
+								}
+							}
+
+							if (leafHits & (1 << lane))
+							{
+								packet.SetMax(lane, currentRay.max);
+							}
+						});
+					return leafHits;
+				}, rootIndex);
+		}
+
+		//Moller-Trumbore leaf loop testing each triangle against all lanes at once
+		inline int HitTest_TriangleMeshBVH_SSE(const TriangleMesh& mesh, RayPacket& packet, int laneMask, size_t(&closestTriangles)[RayPacket::laneCount], uint32_t rootIndex)
+		{
+			return TraverseBVH(mesh.bvh, packet, laneMask, [&](const BVHNode& leaf, int leafLanes)
+				{
+					const __m128 lanes{ GetLaneMask(leafLanes) };
+					int leafHits{ 0 };
+					for (size_t i{ leaf.leftFirst }; i < leaf.leftFirst + leaf.primitiveCount; ++i)
+					{
+						__m128 t{};
+						const __m128 hit{ _mm_and_ps(lanes, TriangleKernels::IntersectMollerTrumbore4(mesh.triangles, i, mesh.cullMode, packet, t)) };
+						const int hitMask{ _mm_movemask_ps(hit) };
+						if (hitMask == 0)
+						{
+							continue;
+						}
+
+						packet.tMax = Select(hit, t, packet.tMax);
+						ForEachLane(hitMask, [&](int lane) { closestTriangles[lane] = i; });
+						leafHits |= hitMask;
+					}
+					return leafHits;
+				}, rootIndex);
+		}
+
+		//Closest triangle of every lane against the mesh BVH, in whatever space GetBVHPositions() lives in
+		//closestTriangles holds the TriangleSoA index for the returned lanes, their hit distance is in packet.tMax
+		inline int HitTest_TriangleMeshBVH(const TriangleMesh& mesh, RayPacket& packet, int laneMask, size_t(&closestTriangles)[RayPacket::laneCount], uint32_t rootIndex = 0)
+		{
+			if (mesh.bvh.IsEmpty())
+			{
+				return 0;
+			}
+
+			switch (mesh.intersectionKernel)
+			{
+			case TriangleIntersectionKernel::EdgeTests:
+				return HitTest_TriangleMeshBVH<TriangleKernels::EdgeTests>(mesh, packet, laneMask, closestTriangles, rootIndex);
+			case TriangleIntersectionKernel::Watertight:
+				return HitTest_TriangleMeshBVH<TriangleKernels::Watertight>(mesh, packet, laneMask, closestTriangles, rootIndex);
+			case TriangleIntersectionKernel::PrecomputedAffine:
+				return HitTest_TriangleMeshBVH<TriangleKernels::PrecomputedAffine>(mesh, packet, laneMask, closestTriangles, rootIndex);
+			case TriangleIntersectionKernel::MollerTrumbore:
+			default:
+				return HitTest_TriangleMeshBVH_SSE(mesh, packet, laneMask, closestTriangles, rootIndex);
+			}
+		}
+
+		//Packet version of HitTest_TriangleMeshObjectSpace, every lane is moved into object space on its own
+		inline int HitTest_TriangleMeshObjectSpace(const TriangleMesh& mesh, const Matrix& objectToWorld, const Matrix& worldToObject,
+			RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount], uint32_t rootIndex = 0)
+		{
+			RayPacket objectPacket{};
+			for (int lane{ 0 }; lane < RayPacket::laneCount; ++lane)
+			{
+				objectPacket.rays[lane] = TransformRay(worldToObject, packet.GetRay(lane));
+			}
+			objectPacket.Load();
+
+			size_t closestTriangles[RayPacket::laneCount]{};
+			const int hitMask{ HitTest_TriangleMeshBVH(mesh, objectPacket, laneMask, closestTriangles, rootIndex) };
+			ForEachLane(hitMask, [&](int lane)
+				{
+					const Ray& ray{ packet.rays[lane] };
+					HitRecord& hitRecord{ hitRecords[lane] };
+					hitRecord.t = objectPacket.GetMax(lane);
+					hitRecord.didHit = true;
+					hitRecord.materialIndex = mesh.materialIndex;
+					hitRecord.normal = objectToWorld.TransformVector(mesh.triangles.GetNormal(closestTriangles[lane]));
+					hitRecord.origin = ray.origin + hitRecord.t * ray.direction;
+					packet.SetMax(lane, hitRecord.t);
+				});
+			return hitMask;
+		}
+
+		inline int HitTest_TriangleMesh(const TriangleMesh& mesh, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount], uint32_t rootIndex = 0)
+		{
+			if (mesh.transformMode != MeshTransformMode::TransformVertices)
+			{
+				return HitTest_TriangleMeshObjectSpace(mesh, mesh.objectToWorld, mesh.worldToObject, packet, laneMask, hitRecords, rootIndex);
+			}
+
+			size_t closestTriangles[RayPacket::laneCount]{};
+			const int hitMask{ HitTest_TriangleMeshBVH(mesh, packet, laneMask, closestTriangles, rootIndex) };
+			ForEachLane(hitMask, [&](int lane)
+				{
+					const Ray& ray{ packet.rays[lane] };
+					HitRecord& hitRecord{ hitRecords[lane] };
+					hitRecord.t = packet.GetMax(lane);
+					hitRecord.didHit = true;
+					hitRecord.materialIndex = mesh.materialIndex;
+					hitRecord.normal = mesh.triangles.GetNormal(closestTriangles[lane]);
+					hitRecord.origin = ray.origin + hitRecord.t * ray.direction;
+				});
+			return hitMask;
+		}
+
+		inline int HitTest_TriangleMeshInstance(const TriangleMeshInstance& instance, RayPacket& packet, int laneMask, HitRecord(&hitRecords)[RayPacket::laneCount], uint32_t rootIndex = 0)
+		{
+			const int hitMask{ HitTest_TriangleMeshObjectSpace(*instance.pMesh, instance.objectToWorld, instance.worldToObject, packet, laneMask, hitRecords, rootIndex) };
+			ForEachLane(hitMask, [&](int lane) { hitRecords[lane].materialIndex = instance.materialIndex; });
+			return hitMask;
 		}
 #pragma endregion
 	}
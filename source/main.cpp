@@ -5,10 +5,16 @@
 #undef main
 
 //Standard includes
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 //Project includes
 #include "Timer.h"
+#include "FramePipeline.h"
 #include "Renderer.h"
 #include "Scene.h"
 
@@ -22,11 +28,116 @@ void ShutDown(SDL_Window* pWindow)
 	SDL_Quit();
 }
 
+//Only plain digits, so a mistyped option is reported instead of read as a number
+bool ParseCount(const char* pArgument, int& count)
+{
+	if (!std::isdigit(static_cast<unsigned char>(pArgument[0])))
+		return false;
+
+	char* pEnd{ nullptr };
+	const long value{ std::strtol(pArgument, &pEnd, 10) };
+	if (*pEnd != '\0' || value > INT_MAX)
+		return false;
+
+	count = static_cast<int>(value);
+	return true;
+}
+
+void PrintUsage(const char* pProgram)
+{
+	std::cout << "Usage: " << pProgram << " [tile size] [-threads N] [-pipelined]" << std::endl
+		<< "  tile size     tile edge in pixels, auto-tuned when left out or 0" << std::endl
+		<< "  -threads N    render threads, every hardware thread when left out or 0" << std::endl
+		<< "  -pipelined    update the next frame while the current one renders and presents" << std::endl;
+}
+
+//Renders the current frame a few times with every triangle kernel, best run on the bunny scene, the scene keeps its kernel
+void BenchmarkTriangleKernels(Renderer* pRenderer, Scene* pScene)
+{
+	constexpr int frameCount{ 10 };
+	const std::pair<TriangleIntersectionKernel, const char*> kernels[]
+	{
+		{ TriangleIntersectionKernel::EdgeTests, "Edge tests" },
+		{ TriangleIntersectionKernel::MollerTrumbore, "Moller-Trumbore" },
+		{ TriangleIntersectionKernel::Watertight, "Watertight" },
+		{ TriangleIntersectionKernel::PrecomputedAffine, "Precomputed affine" }
+	};
+
+	const TriangleIntersectionKernel previousKernel{ pScene->GetTriangleIntersectionKernel() };
+	std::cout << "--- Triangle kernel benchmark (" << frameCount << " frames each) ---" << std::endl;
+	for (const auto& kernel : kernels)
+	{
+		pScene->SetTriangleIntersectionKernel(kernel.first);
+
+		const auto start{ std::chrono::high_resolution_clock::now() };
+		for (int i{ 0 }; i < frameCount; ++i)
+		{
+			pRenderer->Render(pScene);
+		}
+		const std::chrono::duration<float, std::milli> elapsed{ std::chrono::high_resolution_clock::now() - start };
+
+		std::cout << kernel.second << ": " << elapsed.count() / frameCount << " ms/frame" << std::endl;
+	}
+
+	pScene->SetTriangleIntersectionKernel(previousKernel);
+}
+
+//Same as above for the mesh BVH node layouts, together with the memory each one needs, the scene keeps its layout
+void BenchmarkBVHLayouts(Renderer* pRenderer, Scene* pScene)
+{
+	constexpr int frameCount{ 10 };
+	const std::pair<BVHLayout, const char*> layouts[]
+	{
+		{ BVHLayout::Binary, "Binary" },
+		{ BVHLayout::Wide4, "Wide4" },
+		{ BVHLayout::Wide4Quantized, "Wide4 quantized" }
+	};
+
+	const BVHLayout previousLayout{ pScene->GetMeshBVHLayout() };
+	std::cout << "--- BVH layout benchmark (" << frameCount << " frames each) ---" << std::endl;
+	for (const auto& layout : layouts)
+	{
+		pScene->SetMeshBVHLayout(layout.first);
+
+		const auto start{ std::chrono::high_resolution_clock::now() };
+		for (int i{ 0 }; i < frameCount; ++i)
+		{
+			pRenderer->Render(pScene);
+		}
+		const std::chrono::duration<float, std::milli> elapsed{ std::chrono::high_resolution_clock::now() - start };
+
+		std::cout << layout.second << ": " << elapsed.count() / frameCount << " ms/frame, "
+			<< pScene->GetMeshBVHBytesPerTriangle() << " bytes/triangle" << std::endl;
+	}
+
+	pScene->SetMeshBVHLayout(previousLayout);
+}
+
+//Optional arguments: tile size in pixels, auto-tuned for the scene and machine when left out
+//-threads N: render threads, every hardware thread when left out
+//-pipelined: updates the next frame while the current one renders and presents, one frame of extra latency
 int main(int argc, char* args[])
 {
-	//Unreferenced parameters
-	(void)argc;
-	(void)args;
+	int tileSize{ 0 };
+	int threadCount{ 0 };
+	bool isPipelined{ false };
+	for (int i{ 1 }; i < argc; ++i)
+	{
+		bool isValid{ true };
+		if (std::strcmp(args[i], "-pipelined") == 0)
+			isPipelined = true;
+		else if (std::strcmp(args[i], "-threads") == 0)
+			isValid = i + 1 < argc && ParseCount(args[++i], threadCount);
+		else
+			isValid = ParseCount(args[i], tileSize);
+
+		if (!isValid)
+		{
+			std::cout << "Invalid argument: " << args[i] << std::endl;
+			PrintUsage(args[0]);
+			return 1;
+		}
+	}
 
 	//Create window + surfaces
 	SDL_Init(SDL_INIT_VIDEO);
@@ -45,12 +156,41 @@ int main(int argc, char* args[])
 
 	//Initialize "framework"
 	const auto pTimer = new Timer();
-	const auto pRenderer = new Renderer(pWindow);
+	const auto pRenderer = new Renderer(pWindow, static_cast<uint32_t>(threadCount));
 
-	const auto pScene = new Scene_W4_ReferenceScene();
-	//const auto pScene = new Scene_W4_BunnyScene();
+	const auto createScene = []() -> Scene*
+		{
+			return new Scene_W4_ReferenceScene();
+			//return new Scene_W4_BunnyScene();
+			//return new Scene_W4_BunnyInstanceScene();
+		};
 
+	const auto pScene = createScene();
 	pScene->Initialize();
+	pScene->PrintMeshBVHBuildStats();
+
+	if (tileSize > 0)
+	{
+		pRenderer->SetTileSize(tileSize);
+	}
+	else
+	{
+		pScene->Update(pTimer);
+		pRenderer->AutoTuneTileSize(pScene);
+		pScene->ResetOccluderCacheStats();
+	}
+	std::cout << "Tile size: " << pRenderer->GetTileSize() << " (" << pRenderer->GetThreadPool().GetThreadCount() << " threads)" << std::endl;
+
+	//The pipeline renders one copy of the scene while the other one updates, the mesh BVHs come from the BVH cache the first copy filled
+	Scene* pPipelineScene{ nullptr };
+	FramePipeline* pPipeline{ nullptr };
+	if (isPipelined)
+	{
+		pPipelineScene = createScene();
+		pPipelineScene->Initialize();
+		pPipeline = new FramePipeline(pRenderer, pScene, pPipelineScene);
+		std::cout << "Pipelined frames" << std::endl;
+	}
 
 	//Start loop
 	pTimer->Start();
@@ -69,24 +209,70 @@ int main(int argc, char* args[])
 				isLooping = false;
 				break;
 			case SDL_KEYUP:
+				//Keys change the renderer or the scene, neither may be in use by the pipeline
+				if (pPipeline)
+					pPipeline->Flush();
 				if(e.key.keysym.scancode == SDL_SCANCODE_X)
 					takeScreenshot = true;
 				if (e.key.keysym.scancode == SDL_SCANCODE_F2)
 					pRenderer->Toggelshadow();
 				if (e.key.keysym.scancode == SDL_SCANCODE_F3)
 					pRenderer->CycleLightingModes();				
+				if (e.key.keysym.scancode == SDL_SCANCODE_F5)
+				{
+					pRenderer->ToggleProgressiveRendering();
+					std::cout << "Progressive rendering " << (pRenderer->IsProgressiveRenderingEnabled() ? "on" : "off")
+						<< " (" << pRenderer->GetProgressiveFrameBudget() << " ms/frame budget)" << std::endl;
+				}
 				if (e.key.keysym.scancode == SDL_SCANCODE_F6)
 					pTimer->StartBenchmark();
+				//The benchmarks render pScene only, the pipeline alternates between both scenes so the other one follows its settings
+				if (e.key.keysym.scancode == SDL_SCANCODE_F7)
+				{
+					BenchmarkTriangleKernels(pRenderer, pScene);
+					if (pPipelineScene && pPipelineScene->GetTriangleIntersectionKernel() != pScene->GetTriangleIntersectionKernel())
+						pPipelineScene->SetTriangleIntersectionKernel(pScene->GetTriangleIntersectionKernel());
+				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F8)
+				{
+					BenchmarkBVHLayouts(pRenderer, pScene);
+					if (pPipelineScene && pPipelineScene->GetMeshBVHLayout() != pScene->GetMeshBVHLayout())
+						pPipelineScene->SetMeshBVHLayout(pScene->GetMeshBVHLayout());
+				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F9)
+				{
+					pRenderer->TogglePacketTracing();
+					std::cout << "Packet tracing " << (pRenderer->IsPacketTracingEnabled() ? "on" : "off") << std::endl;
+				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F10)
+				{
+					pRenderer->ToggleTileCulling();
+					std::cout << "Tile frustum culling " << (pRenderer->IsTileCullingEnabled() ? "on" : "off") << std::endl;
+				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F11)
+				{
+					pRenderer->CycleRenderPaths();
+					std::cout << "Render path: " << pRenderer->GetRenderPathName() << std::endl;
+				}
+				if (e.key.keysym.scancode == SDL_SCANCODE_F12)
+				{
+					pRenderer->CycleTileOrders();
+					std::cout << "Tile order: " << pRenderer->GetTileOrderName() << std::endl;
+				}
 				break;			
 			}
 		}
 
 		//--------- Update ---------
-		pScene->Update(pTimer);
+		Scene* pUpdateScene{ pPipeline ? pPipeline->BeginFrame() : pScene };
+		pUpdateScene->Update(pTimer);
 		
 
 		//--------- Render ---------
-		pRenderer->Render(pScene);
+		if (pPipeline)
+			pPipeline->EndFrame();
+		else
+			pRenderer->Render(pScene);
 
 		//--------- Timer ---------
 		pTimer->Update();
@@ -94,12 +280,28 @@ int main(int argc, char* args[])
 		if (printTimer >= 1.f)
 		{
 			printTimer = 0.f;
-			std::cout << "dFPS: " << pTimer->GetdFPS() << std::endl;
+
+			//Pipelined frames alternate between both scenes, the rate covers all of them
+			uint64_t occluderQueryCount{ 0 };
+			uint64_t occluderHitCount{ 0 };
+			for (Scene* pStatsScene : { pScene, pPipelineScene })
+			{
+				if (pStatsScene)
+				{
+					occluderQueryCount += pStatsScene->GetOccluderCacheQueryCount();
+					occluderHitCount += pStatsScene->GetOccluderCacheHitCount();
+					pStatsScene->ResetOccluderCacheStats();
+				}
+			}
+			const float occluderHitRate{ occluderQueryCount > 0 ? static_cast<float>(occluderHitCount) / occluderQueryCount : 0.f };
+			std::cout << "dFPS: " << pTimer->GetdFPS() << ", occluder cache hit rate: " << occluderHitRate * 100.f << "%" << std::endl;
 		}
 
 		//Save screenshot after full render
 		if (takeScreenshot)
 		{
+			if (pPipeline)
+				pPipeline->Flush();
 			if (!pRenderer->SaveBufferToImage())
 				std::cout << "Screenshot saved!" << std::endl;
 			else
@@ -110,6 +312,8 @@ int main(int argc, char* args[])
 	pTimer->Stop();
 
 	//Shutdown "framework"
+	delete pPipeline;
+	delete pPipelineScene;
 	delete pScene;
 	delete pRenderer;
 	delete pTimer;
@@ -0,0 +1,302 @@
+//Builds BVHs over primitives whose centroids set one more bit of a 63-bit Morton code each, the input that makes
+//the linear builder split off a single primitive per code bit, and checks that every builder stays within
+//BVH::maxDepth and that every layout still finds the same closest hits as testing all primitives.
+//Every box reaches back over the origin, so rays through it visit every level and fill the traversal stacks.
+//Also checks that spatial splits over long overlapping slivers never pass the BVHSettings::maxDuplication cap.
+//Returns non-zero on failure. BVHDepthTest.vcxproj runs it after every build and RayTracer.vcxproj references that
+//project, so building the ray tracer builds and runs the test and a failure fails the build. Without Visual Studio:
+//	cl /std:c++20 /O2 /EHsc /I..\source /I..\include\sdl2-2.0.9 BVHDepthTest.cpp ..\source\BVH.cpp ..\source\Vector3.cpp ..\source\Vector4.cpp ..\source\Matrix.cpp
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "BVH.h"
+#include "Utils.h"
+
+using namespace dae;
+
+namespace
+{
+	//Morton grid cells per axis of a 63-bit code, the grid spans the centroid bounds
+	constexpr uint32_t g_GridSize{ 1u << 21 };
+	//Primitives sharing the code of the origin, split by position below the chain
+	constexpr uint32_t g_DuplicateCount{ 16 };
+
+	//Code bit b is bit b / 3 of the cell along axis 2 - b % 3 (x, y, z interleaved from the top)
+	//Sorted by code every primitive is the only one with its highest bit set, a chain of 63 levels above the duplicates
+	std::vector<AABB> CreateMortonChain()
+	{
+		std::vector<AABB> boxes{};
+		const auto addBox{ [&boxes](const Vector3& cell, float halfSize)
+			{
+				const Vector3 centroid{ cell.x + 0.5f, cell.y + 0.5f, cell.z + 0.5f };
+				boxes.push_back(AABB{ centroid - Vector3{ halfSize, halfSize, halfSize }, centroid + Vector3{ halfSize, halfSize, halfSize } });
+			} };
+
+		for (uint32_t i{ 0 }; i < g_DuplicateCount; ++i)
+		{
+			addBox({}, 0.25f);
+		}
+		for (uint32_t bit{ 0 }; bit < 63; ++bit)
+		{
+			Vector3 cell{};
+			cell[2 - bit % 3] = static_cast<float>(1u << bit / 3);
+			addBox(cell, cell[2 - bit % 3]);
+		}
+		//Stretches the centroid bounds over the whole grid so cells map to codes one to one
+		const float lastCell{ static_cast<float>(g_GridSize - 1) };
+		addBox({ lastCell, lastCell, lastCell }, 0.25f);
+		return boxes;
+	}
+
+	//Slivers 40 units long along x, y or z in turn, scattered over a 100 unit cube so most of them straddle every split plane
+	std::vector<AABB> CreateSlivers()
+	{
+		std::mt19937 generator{ 7 };
+		const auto random{ [&generator]() { return static_cast<float>(generator()) / 4294967296.f * 100.f; } };
+
+		std::vector<AABB> boxes(4000);
+		for (size_t i{ 0 }; i < boxes.size(); ++i)
+		{
+			const Vector3 start{ random(), random(), random() };
+			Vector3 end{ start.x + 0.1f, start.y + 0.1f, start.z + 0.1f };
+			end[static_cast<int>(i % 3)] += 40.f;
+			boxes[i] = AABB{ start, end };
+		}
+		return boxes;
+	}
+
+	//Clips the box of a primitive, the exact clipped bounds for box primitives
+	PrimitiveClipper CreateBoxClipper(const std::vector<AABB>& boxes)
+	{
+		return [&boxes](uint32_t primitiveIndex, const AABB& box)
+			{
+				AABB clipped{ boxes[primitiveIndex] };
+				clipped.min = Vector3::Max(clipped.min, box.min);
+				clipped.max = Vector3::Min(clipped.max, box.max);
+				return clipped;
+			};
+	}
+
+	float GetEntryDistance(const AABB& box, const Ray& ray)
+	{
+		const Vector3 inversedDirection{ 1.f / ray.direction.x, 1.f / ray.direction.y, 1.f / ray.direction.z };
+		float tEntry{};
+		if (!GeometryUtils::SlabTest_AABB(box.min, box.max, ray, inversedDirection, tEntry))
+		{
+			return FLT_MAX;
+		}
+		return std::max(tEntry, 0.f);
+	}
+
+	//Deepest level below nodeIndex, leaves of the wide layouts count as a level of their own like binary leaves do
+	uint32_t GetDepth(const std::vector<BVHNode>& nodes, uint32_t nodeIndex = 0)
+	{
+		const BVHNode& node{ nodes[nodeIndex] };
+		if (node.IsLeaf())
+		{
+			return 0;
+		}
+		return 1 + std::max(GetDepth(nodes, node.leftFirst), GetDepth(nodes, node.leftFirst + 1));
+	}
+
+	template<typename WideNode>
+	uint32_t GetDepth(const std::vector<WideNode>& nodes, uint32_t nodeIndex = 0)
+	{
+		const WideNode& node{ nodes[nodeIndex] };
+		uint32_t depth{ 0 };
+		for (int i{ 0 }; i < 4; ++i)
+		{
+			if (!node.IsEmpty(i))
+			{
+				depth = std::max(depth, 1 + (node.IsLeaf(i) ? 0 : GetDepth(nodes, node.child[i])));
+			}
+		}
+		return depth;
+	}
+
+	uint32_t GetDepth(const BVH& bvh)
+	{
+		switch (bvh.GetLayout())
+		{
+		case BVHLayout::Wide4:
+			return GetDepth(bvh.GetWideNodes());
+		case BVHLayout::Wide4Quantized:
+			return GetDepth(bvh.GetQuantizedNodes());
+		case BVHLayout::Binary:
+		default:
+			return GetDepth(bvh.GetNodes());
+		}
+	}
+
+	//Rays from one corner towards every centroid, most of them pass through the origin where all boxes overlap
+	std::vector<Ray> CreateRays(const std::vector<AABB>& boxes)
+	{
+		const Vector3 origin{ -3.f, -5.f, -7.f };
+		std::vector<Ray> rays{};
+		for (const AABB& box : boxes)
+		{
+			rays.push_back({ origin, (box.GetCenter() - origin).Normalized() });
+		}
+		return rays;
+	}
+
+	//Number of rays whose closest hit differs from testing every box, single rays and 4-wide packets
+	uint32_t CountWrongHits(const BVH& bvh, const std::vector<AABB>& boxes, const std::vector<Ray>& rays)
+	{
+		const std::vector<uint32_t>& primitiveIndices{ bvh.GetPrimitiveIndices() };
+		uint32_t wrongHitCount{ 0 };
+
+		std::vector<float> expected(rays.size());
+		for (size_t i{ 0 }; i < rays.size(); ++i)
+		{
+			expected[i] = FLT_MAX;
+			for (const AABB& box : boxes)
+			{
+				expected[i] = std::min(expected[i], GetEntryDistance(box, rays[i]));
+			}
+		}
+
+		for (size_t i{ 0 }; i < rays.size(); ++i)
+		{
+			Ray ray{ rays[i] };
+			GeometryUtils::TraverseBVH(bvh, ray, false, [&](const BVHNode& leaf)
+				{
+					bool hit{ false };
+					for (uint32_t j{ 0 }; j < leaf.primitiveCount; ++j)
+					{
+						const float t{ GetEntryDistance(boxes[primitiveIndices[leaf.leftFirst + j]], ray) };
+						if (t < ray.max)
+						{
+							ray.max = t;
+							hit = true;
+						}
+					}
+					return hit;
+				});
+			wrongHitCount += ray.max != expected[i];
+		}
+
+		for (size_t first{ 0 }; first < rays.size(); first += RayPacket::laneCount)
+		{
+			RayPacket packet{};
+			packet.activeMask = 0;
+			for (int lane{ 0 }; lane < RayPacket::laneCount; ++lane)
+			{
+				packet.rays[lane] = rays[std::min(first + lane, rays.size() - 1)];
+				packet.activeMask |= first + lane < rays.size() ? 1 << lane : 0;
+			}
+			packet.Load();
+
+			GeometryUtils::TraverseBVH(bvh, packet, packet.activeMask, [&](const BVHNode& leaf, int laneMask)
+				{
+					int hitMask{ 0 };
+					GeometryUtils::ForEachLane(laneMask, [&](int lane)
+						{
+							const Ray ray{ packet.GetRay(lane) };
+							for (uint32_t j{ 0 }; j < leaf.primitiveCount; ++j)
+							{
+								const float t{ GetEntryDistance(boxes[primitiveIndices[leaf.leftFirst + j]], ray) };
+								if (t < packet.GetMax(lane))
+								{
+									packet.SetMax(lane, t);
+									hitMask |= 1 << lane;
+								}
+							}
+						});
+					return hitMask;
+				});
+
+			GeometryUtils::ForEachLane(packet.activeMask, [&](int lane)
+				{
+					wrongHitCount += packet.GetMax(lane) != expected[first + lane];
+				});
+		}
+
+		return wrongHitCount;
+	}
+}
+
+int main()
+{
+	const std::vector<AABB> boxes{ CreateMortonChain() };
+	const std::vector<Ray> rays{ CreateRays(boxes) };
+	const PrimitiveClipper clipBox{ CreateBoxClipper(boxes) };
+
+	const std::pair<BVHLayout, const char*> layouts[]
+	{
+		{ BVHLayout::Binary, "binary" },
+		{ BVHLayout::Wide4, "wide4" },
+		{ BVHLayout::Wide4Quantized, "wide4 quantized" }
+	};
+	const std::pair<BVHBuildQuality, const char*> qualities[]
+	{
+		{ BVHBuildQuality::Fast, "fast SAH" },
+		{ BVHBuildQuality::Medium, "medium SAH" },
+		{ BVHBuildQuality::High, "sweep SAH" }
+	};
+
+	int failureCount{ 0 };
+	const auto check{ [&](const BVH& bvh, const char* builder, const char* layout)
+		{
+			const uint32_t depth{ GetDepth(bvh) };
+			const uint32_t wrongHitCount{ CountWrongHits(bvh, boxes, rays) };
+			const bool isPassed{ depth <= BVH::maxDepth && wrongHitCount == 0 };
+			failureCount += isPassed ? 0 : 1;
+			std::printf("%s %s, %s: depth %u (max %u), %u wrong hits\n", isPassed ? "PASS" : "FAIL", builder, layout, depth, BVH::maxDepth, wrongHitCount);
+		} };
+
+	for (const auto& layout : layouts)
+	{
+		for (const auto& quality : qualities)
+		{
+			BVHSettings settings{};
+			settings.maxLeafSize = 1;
+			settings.quality = quality.first;
+			settings.layout = layout.first;
+
+			BVH bvh{};
+			bvh.Build(boxes, settings);
+			check(bvh, quality.second, layout.second);
+
+			settings.spatialSplits = true;
+			bvh.Build(boxes, settings, clipBox);
+			check(bvh, "spatial splits", layout.second);
+		}
+
+		for (const uint32_t mortonCodeBits : { 30u, 63u })
+		{
+			BVHSettings settings{};
+			settings.maxLeafSize = 1;
+			settings.layout = layout.first;
+			settings.mortonCodeBits = mortonCodeBits;
+
+			BVH bvh{};
+			bvh.BuildLinear(boxes, settings);
+			check(bvh, mortonCodeBits > 32 ? "linear 63-bit" : "linear 30-bit", layout.second);
+		}
+	}
+
+	const std::vector<AABB> slivers{ CreateSlivers() };
+	const PrimitiveClipper clipSliver{ CreateBoxClipper(slivers) };
+	const uint32_t sliverCount{ static_cast<uint32_t>(slivers.size()) };
+	for (const float maxDuplication : { 0.01f, 0.3f, 0.5f })
+	{
+		BVHSettings settings{};
+		settings.spatialSplits = true;
+		settings.maxDuplication = maxDuplication;
+
+		BVH bvh{};
+		bvh.Build(slivers, settings, clipSliver);
+
+		//Same rounding as the builder
+		const uint32_t maxReferenceCount{ sliverCount + static_cast<uint32_t>(sliverCount * maxDuplication) };
+		const bool isPassed{ bvh.GetReferenceCount() <= maxReferenceCount };
+		failureCount += isPassed ? 0 : 1;
+		std::printf("%s spatial splits, max duplication %.2f: %u references (max %u)\n", isPassed ? "PASS" : "FAIL", maxDuplication, bvh.GetReferenceCount(), maxReferenceCount);
+	}
+
+	return failureCount == 0 ? 0 : 1;
+}